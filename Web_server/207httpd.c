@@ -1,286 +1,1576 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdbool.h>
+#include <ctype.h>
+#include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <netdb.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <linux/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
 
 #include "common.h"
+#include "httpd.h"
+#include "recvbuf.h"
+#include "filecache.h"
+#include "mime.h"
+#include "route.h"
+#include "pack.h"
+#include "timer.h"
+#include "metrics.h"
+#include "handoff.h"
+
+/**
+ * The deadline of a connection served with blocking I/O.
+ *
+ * Blocking engines share one wheel, run by a watchdog thread that shuts
+ * down the sockets of the connections it times out, which wakes up the
+ * thread blocked on them. The serving thread only takes the lock when it
+ * needs an earlier deadline than the one filed; a later one is stored in
+ * "deadline" and picked up by the watchdog when the filed one comes.
+ *
+ * While a response is being sent, the watchdog keeps its send clock, from
+ * the start and base published by the serving thread.
+ */
+typedef struct HttpWatch {
+    Timer         timer;       /* under watchLock */
+    long long     armed;       /* deadline filed in the wheel, or LLONG_MAX */
+    long long     deadline;    /* the current one */
+    long long     sendStart;   /* msecs, or 0 when not sending */
+    long long     sendBase;
+    HttpSendClock send;        /* the watchdog's, under watchLock */
+    long long     sendTotal;   /* the serving thread's */
+    int           sock;
+    bool          idle;        /* waiting for a request; read by a drain */
+} HttpWatch;
+
+ServerArgs svrArgs;
+
+static TimerWheel      watchWheel;
+static pthread_mutex_t watchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  watchCond;
+static long long       watchWake = LLONG_MAX;   /* of the watchdog */
+
+static bool            draining;
+static int             drainFd = -1;   /* readable once draining */
+
+static pthread_mutex_t liveLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  liveCond = PTHREAD_COND_INITIALIZER;
+static int             liveThreads;    /* of the thread engine */
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Create a TCP listen socket on the given port.
+ *
+ * With "-p", the socket is opened with SO_REUSEPORT, so that each event
+ * loop can open its own on the same port and the kernel spreads the new
+ * connections over them.
+ *
+ * After an upgrade, the sockets handed over by the old process are taken
+ * instead, as long as there are any left.
+ *
+ **************************************************************************
+ */
+int
+CreatePassiveTCP(unsigned port)
+{
+    int sock;
+    int optval;
+    struct sockaddr_in svrAddr;
+
+    sock = handoff_take_socket(port);
+    if (sock >= 0) {
+        return sock;
+    }
+
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("Failed to allocate the listen socket");
+        exit(EXIT_FAILURE);
+    }
+
+    optval = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+                   &optval, sizeof (optval)) < 0) {
+        perror("Failed to set socket option SO_REUSEADDR");
+        exit(EXIT_FAILURE);
+    }
+    if (svrArgs.reusePort &&
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+                   &optval, sizeof (optval)) < 0) {
+        perror("Failed to set socket option SO_REUSEPORT");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&svrAddr, 0, sizeof(svrAddr));
+    svrAddr.sin_family = AF_INET;
+    svrAddr.sin_port = htons(port);
+    svrAddr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(sock, (struct sockaddr *)&svrAddr, sizeof svrAddr) < 0) {
+        perror("Failed to bind IP address and port to the listen socket");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(sock, svrArgs.backlog) < 0) {
+        perror("Failed to listen for connections");
+        exit(EXIT_FAILURE);
+    }
+
+    handoff_add_socket(sock);
+    return sock;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get a new deadline for a connection sending a response, once
+ *        its last one has come.
+ *
+ * Returns the deadline, unchanged if the connection is not sending or
+ * has timed out.
+ *
+ **************************************************************************
+ */
+static long long
+httpd_watch_send_deadline(HttpWatch *w, long long deadline, long long now)
+{
+    HttpSendClock *sc = &w->send;
+    long long next;
+
+    /* A newer base is published after its start; see httpd_watch_send(). */
+    sc->base  = __atomic_load_n(&w->sendBase, __ATOMIC_ACQUIRE);
+    sc->start = __atomic_load_n(&w->sendStart, __ATOMIC_RELAXED);
+    if (sc->start == 0) {
+        return deadline;
+    }
+    if (sc->ackedAt < sc->start) {
+        sc->ackedAt = sc->start;   /* a new response */
+    }
+    next = httpd_send_deadline(sc, w->sock, now);
+
+    /* Unless the serving thread has moved on meanwhile. */
+    if (!__atomic_compare_exchange_n(&w->deadline, &deadline, next, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return deadline;
+    }
+    return next;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief The watchdog thread function of the blocking engines.
+ *
+ * It sleeps until the wheel next has work to do, or until a connection
+ * needs an earlier deadline than that.
+ *
+ **************************************************************************
+ */
+static void *
+httpd_watchdog(void *arg)
+{
+    pthread_mutex_lock(&watchLock);
+    while (1) {
+        long long now = NowMs();
+        Timer *t = timer_expire(&watchWheel, now);
+        int wait;
+
+        while (t != NULL) {
+            HttpWatch *w = (HttpWatch *)((char *)t - offsetof(HttpWatch,
+                                                              timer));
+            long long deadline = __atomic_load_n(&w->deadline,
+                                                 __ATOMIC_RELAXED);
+            t = t->next;
+            if (deadline <= now) {
+                deadline = httpd_watch_send_deadline(w, deadline, now);
+            }
+            if (deadline > now) {
+                __atomic_store_n(&w->armed, deadline, __ATOMIC_RELAXED);
+                timer_set(&watchWheel, &w->timer, deadline);
+            } else {
+                LogDebug("watchdog: Timeout (ssock=%u)\n", w->sock);
+                __atomic_store_n(&w->armed, LLONG_MAX, __ATOMIC_RELAXED);
+                shutdown(w->sock, SHUT_RDWR);
+            }
+        }
+
+        wait = timer_next_ms(&watchWheel, now);
+        if (wait < 0) {
+            watchWake = LLONG_MAX;
+            pthread_cond_wait(&watchCond, &watchLock);
+        } else {
+            struct timespec ts;
+
+            watchWake = now + wait;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec  += wait / 1000;
+            ts.tv_nsec += (wait % 1000) * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&watchCond, &watchLock, &ts);
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Start the watchdog thread, on the first connection.
+ *
+ **************************************************************************
+ */
+static void
+httpd_init_watchdog(void)
+{
+    pthread_condattr_t ca;
+    pthread_attr_t ta;
+    pthread_t th;
+
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&watchCond, &ca);
+    pthread_condattr_destroy(&ca);
+    timer_init(&watchWheel, NowMs());
+
+    pthread_attr_init(&ta);
+    pthread_attr_setdetachstate(&ta, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&th, &ta, httpd_watchdog, NULL) != 0) {
+        perror("Failed to create the watchdog thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_attr_destroy(&ta);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Set the deadline of a connection served with blocking I/O.
+ *
+ **************************************************************************
+ */
+static void
+httpd_watch_set(HttpWatch *w, long long deadline)
+{
+    __atomic_store_n(&w->deadline, deadline, __ATOMIC_RELAXED);
+    if (deadline >= __atomic_load_n(&w->armed, __ATOMIC_RELAXED)) {
+        return;   /* the watchdog files it again when it is due */
+    }
+
+    pthread_mutex_lock(&watchLock);
+    __atomic_store_n(&w->armed, deadline, __ATOMIC_RELAXED);
+    timer_set(&watchWheel, &w->timer, deadline);
+    if (deadline < watchWake) {
+        pthread_cond_signal(&watchCond);
+    }
+    pthread_mutex_unlock(&watchLock);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Start watching a connection, which has a request to send.
+ *
+ **************************************************************************
+ */
+static void
+httpd_watch_start(HttpWatch *w, int sock)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, httpd_init_watchdog);
+    memset(w, 0, sizeof *w);
+    w->armed = LLONG_MAX;
+    w->sock  = sock;
+    httpd_watch_set(w, NowMs() + svrArgs.headerTimeout * 1000LL);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Start the send clock of a connection's response.
+ *
+ * The start is published before the base, so that the watchdog never
+ * sees a new base with an old start, which would be too harsh.
+ *
+ **************************************************************************
+ */
+static void
+httpd_watch_send(HttpWatch *w, const HttpResponse *resp)
+{
+    long long now = NowMs();
+
+    __atomic_store_n(&w->sendStart, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->sendBase, w->sendBase + w->sendTotal,
+                     __ATOMIC_RELEASE);
+    w->sendTotal = httpd_response_remaining(resp);
+    httpd_watch_set(w, now + svrArgs.sendTimeout * 1000LL);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Set the deadline of a connection waiting for its next request.
+ *
+ * A connection with part of a request already received is held to the
+ * header timeout, and an idle one to the keep-alive timeout until it
+ * sends something. The send clock stops only once the new deadline is
+ * set, so that the watchdog does not time out the response just sent.
+ *
+ * "idle" is published, and the deadline set, before the drain is checked
+ * again, and a drain is set before it looks at the connections (see
+ * httpd_watch_drain()): either one cuts the idle time short.
+ *
+ **************************************************************************
+ */
+static void
+httpd_watch_wait(HttpWatch *w, const RecvBuf *rb)
+{
+    bool idle = recvbuf_pending(rb) == 0;
+    long long now = NowMs();
+
+    __atomic_store_n(&w->idle, idle, __ATOMIC_SEQ_CST);
+    httpd_watch_set(w, idle ? httpd_idle_deadline(now) :
+                              now + svrArgs.headerTimeout * 1000LL);
+    if (idle && httpd_draining()) {
+        httpd_watch_set(w, httpd_idle_deadline(now));
+    }
+    __atomic_store_n(&w->sendStart, 0, __ATOMIC_RELAXED);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Stop watching a connection, before its socket is closed.
+ *
+ * Once this returns, the watchdog no longer shuts down the socket, which
+ * may then be reused.
+ *
+ **************************************************************************
+ */
+static void
+httpd_watch_stop(HttpWatch *w)
+{
+    pthread_mutex_lock(&watchLock);
+    timer_del(&watchWheel, &w->timer);
+    pthread_mutex_unlock(&watchLock);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Cut short the idle time of the connections served with blocking
+ *        I/O, once draining.
+ *
+ * Every watched connection is in the wheel, so the drain takes them all
+ * out to look at them, and files them again. A serving thread that has
+ * moved its deadline meanwhile keeps it.
+ *
+ **************************************************************************
+ */
+static void
+httpd_watch_drain(void)
+{
+    long long grace = httpd_idle_deadline(NowMs());
+    Timer *t;
+
+    pthread_mutex_lock(&watchLock);
+    t = timer_take_all(&watchWheel);
+    while (t != NULL) {
+        HttpWatch *w = (HttpWatch *)((char *)t - offsetof(HttpWatch, timer));
+        long long deadline = __atomic_load_n(&w->deadline, __ATOMIC_RELAXED);
+
+        t = t->next;
+        if (__atomic_load_n(&w->idle, __ATOMIC_SEQ_CST) && deadline > grace &&
+            __atomic_compare_exchange_n(&w->deadline, &deadline, grace, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&w->armed, grace, __ATOMIC_RELAXED);
+            timer_set(&watchWheel, &w->timer, grace);
+        } else {
+            timer_set(&watchWheel, &w->timer, w->timer.deadline);
+        }
+    }
+    if (grace < watchWake) {
+        pthread_cond_signal(&watchCond);
+    }
+    pthread_mutex_unlock(&watchLock);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Tell whether the server is draining.
+ *
+ * A draining server accepts no more connections, and closes each one
+ * once its response is sent, or once it has been idle for DRAIN_IDLE_MS.
+ *
+ **************************************************************************
+ */
+bool
+httpd_draining(void)
+{
+    return __atomic_load_n(&draining, __ATOMIC_SEQ_CST);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the file descriptor that becomes readable once the server
+ *        drains, for the engines to wait on along with the listen socket.
+ *
+ **************************************************************************
+ */
+int
+httpd_drain_fd(void)
+{
+    return drainFd;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the deadline of a connection waiting idle for its next
+ *        request.
+ *
+ * Once the server drains, an idle connection is only left DRAIN_IDLE_MS
+ * to send one, which is answered with "Connection: close". Closing it
+ * right away would fail a request already on its way.
+ *
+ **************************************************************************
+ */
+long long
+httpd_idle_deadline(long long now)
+{
+    return now + (httpd_draining() ? DRAIN_IDLE_MS :
+                                     svrArgs.keepAliveTimeout * 1000LL);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Reads a request line from the client.
+ *
+ * The request is received into the connection's buffer in large chunks,
+ * and "line" is set to the next null-terminated line in that buffer. The
+ * characters '\r' and '\n' are removed. The first bytes received on an
+ * idle connection start the header timeout, and the request's clock.
+ *
+ * Returns the length of the line, or -1 if there is an error or EOF.
+ *
+ **************************************************************************
+ */
+static int
+httpd_readline(int sock,           // IN
+               RecvBuf *rb,        // IN/OUT
+               HttpWatch *w,       // IN/OUT
+               HttpRequest *req,   // IN/OUT
+               char **line)        // OUT
+{
+    while (1) {
+        int n = recvbuf_getline(rb, line);
+        if (n >= 0) {
+            return n;
+        }
+        if (recvbuf_fill(rb, sock) <= 0) {
+            return -1;   /* EOF, error, or line too long */
+        }
+        if (w->idle) {
+            /* The request has begun: it must now be received in time. */
+            __atomic_store_n(&w->idle, false, __ATOMIC_RELAXED);
+            httpd_watch_set(w, NowMs() + svrArgs.headerTimeout * 1000LL);
+            req->startNs = NowNs();
+        }
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Parse an HTTP date.
+ *
+ * Returns the time, or -1 if it is not a valid date in the preferred
+ * format; the obsolete formats are not accepted.
+ *
+ **************************************************************************
+ */
+static time_t
+httpd_parse_date(const char *str)
+{
+    struct tm tm;
+    const char *end;
+
+    memset(&tm, 0, sizeof tm);
+    end = strptime(str, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || end[strspn(end, " \t")] != '\0') {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the current time as an HTTP date.
+ *
+ * The string is formatted at most once a second by each thread, and is
+ * always HTTP_DATE_LEN characters long.
+ *
+ **************************************************************************
+ */
+static const char *
+httpd_get_date(void)
+{
+    static __thread time_t dateSec = -1;
+    static __thread char   dateStr[HTTP_DATE_LEN + 1];
+    time_t now = time(NULL);
+
+    if (now != dateSec) {
+        httpd_format_date(now, dateStr);
+        dateSec = now;
+    }
+    return dateStr;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Complete a header template into the response header.
+ *
+ * Only the date and the Content-Length are filled in per request; the
+ * rest of the header is copied from the template as is. A negative
+ * "content_len" leaves the Content-Length out, as for 304 responses.
+ *
+ **************************************************************************
+ */
+static void
+httpd_finish_header(HttpResponse *resp, const char *tmpl, int tmplLen,
+                    off_t content_len)
+{
+    static const char lenField[] = "\r\nContent-Length: ";
+    char digits[24];
+    char *p = resp->header;
+    int n = sizeof digits;
+    unsigned long long v = content_len;
+
+    do {
+        digits[--n] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+
+    memcpy(p, tmpl, tmplLen);
+    p += tmplLen;
+    memcpy(p, httpd_get_date(), HTTP_DATE_LEN);
+    p += HTTP_DATE_LEN;
+    if (content_len >= 0) {
+        memcpy(p, lenField, sizeof lenField - 1);
+        p += sizeof lenField - 1;
+        memcpy(p, digits + n, sizeof digits - n);
+        p += sizeof digits - n;
+    }
+    memcpy(p, "\r\n\r\n", 4);
+    p += 4;
+
+    resp->iov[0].iov_base = resp->header;
+    resp->iov[0].iov_len  = p - resp->header;
+}
+
+
+/**
+ * The header templates of not-found (404) responses, by keep-alive.
+ */
+static char           notFoundTmpl[2][256];
+static int            notFoundTmplLen[2];
+static pthread_once_t notFoundOnce = PTHREAD_ONCE_INIT;
+
+static void
+httpd_init_notfound(void)
+{
+    int k;
+
+    for (k = 0; k < 2; k++) {
+        notFoundTmplLen[k] = httpd_render_template(notFoundTmpl[k],
+                                                   sizeof notFoundTmpl[k],
+                                                   404, k, "text/html", "");
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Format a not-found (404) response.
+ *
+ **************************************************************************
+ */
+static void
+httpd_format_notfound(HttpResponse *resp, const char *fname)
+{
+    int bodyLen;
+
+    pthread_once(&notFoundOnce, httpd_init_notfound);
+
+    snprintf(resp->body, sizeof resp->body,
+             "<html>\n<body>\n<h1>404 Not Found</h1>\n"
+             "%s is not found\n"
+             "</body></html>\n", fname);
+    bodyLen = strlen(resp->body);
+
+    LogDebug("thread-%u: RESPONSE: status=404 mime=text/html "
+             "content_length=%d\n", pthread_self(), bodyLen);
+    resp->status = 404;
+    httpd_finish_header(resp, notFoundTmpl[resp->keepAlive],
+                        notFoundTmplLen[resp->keepAlive], bodyLen);
+    resp->iov[1].iov_base = resp->body;
+    resp->iov[1].iov_len  = bodyLen;
+    resp->iovCnt = 2;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Format a redirect or fixed response that a route gave a URL.
+ *
+ **************************************************************************
+ */
+static void
+httpd_format_fixed(HttpResponse *resp, const HttpRequest *req)
+{
+    char fields[MAX_FIXED + 32];
+    char tmpl[sizeof fields + 256];
+    const char *mime = NULL;
+    int tmplLen;
+    int bodyLen = 0;
+
+    resp->status = req->fixedStatus;
+    if (resp->status >= 300 && resp->status < 400) {
+        snprintf(fields, sizeof fields, "Location: %s\r\n", req->fixedText);
+    } else {
+        fields[0] = '\0';
+        if (resp->status != 204) {
+            mime    = "text/plain";
+            bodyLen = strlen(req->fixedText);
+        }
+    }
+
+    LogDebug("thread-%u: RESPONSE: status=%d fixed content_length=%d\n",
+             pthread_self(), resp->status, bodyLen);
+    tmplLen = httpd_render_template(tmpl, sizeof tmpl, resp->status,
+                                    resp->keepAlive, mime, fields);
+    httpd_finish_header(resp, tmpl, tmplLen, resp->status != 204 ? bodyLen
+                                                                : -1);
+    resp->iovCnt = 1;
+    if (bodyLen > 0) {
+        memcpy(resp->body, req->fixedText, bodyLen);
+        resp->iov[1].iov_base = resp->body;
+        resp->iov[1].iov_len  = bodyLen;
+        resp->iovCnt = 2;
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Format a response with the server's metrics.
+ *
+ **************************************************************************
+ */
+static void
+httpd_format_metrics(HttpResponse *resp)
+{
+    char tmpl[512];
+    size_t bodyLen;
+    int tmplLen;
+
+    resp->text = metrics_render(&bodyLen);
+    if (resp->text == NULL) {
+        bodyLen = 0;
+    }
+    resp->status = resp->text != NULL ? 200 : 503;
+    LogDebug("thread-%u: RESPONSE: status=%d metrics content_length=%d\n",
+             pthread_self(), resp->status, (int)bodyLen);
+    tmplLen = httpd_render_template(tmpl, sizeof tmpl, resp->status,
+                                    resp->keepAlive,
+                                    "text/plain; version=0.0.4; "
+                                    "charset=utf-8",
+                                    "Cache-Control: no-store\r\n");
+    httpd_finish_header(resp, tmpl, tmplLen, bodyLen);
+    resp->iov[1].iov_base = resp->text;
+    resp->iov[1].iov_len  = bodyLen;
+    resp->iovCnt = 2;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Initialize a response that holds no resources.
+ *
+ **************************************************************************
+ */
+void
+httpd_response_init(HttpResponse *resp)
+{
+    resp->entry      = NULL;
+    resp->iovIdx     = 0;
+    resp->iovCnt     = 0;
+    resp->fd         = -1;
+    resp->fileOff    = 0;
+    resp->fileEnd    = 0;
+    resp->pipefd[0]  = -1;
+    resp->pipefd[1]  = -1;
+    resp->pipeLen    = 0;
+    resp->text       = NULL;
+    resp->length     = 0;
+    resp->startNs    = 0;
+    resp->preparedNs = 0;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Checks whether an "If-None-Match:" list holds an entity tag.
+ *
+ * Tags are compared weakly, ignoring any "W/" prefix, as befits a
+ * revalidation; "*" matches any tag.
+ *
+ **************************************************************************
+ */
+static bool
+httpd_etag_listed(const char *list, const char *etag)
+{
+    int len = strlen(etag);
+
+    while (*list != '\0') {
+        list += strspn(list, " \t,");
+        if (*list == '*') {
+            return true;
+        }
+        if (strncmp(list, "W/", 2) == 0) {
+            list += 2;
+        }
+        if (strncmp(list, etag, len) == 0 &&
+            strchr(" \t,", list[len]) != NULL) {
+            return true;
+        }
+        if (*list == '"') {
+            const char *quote = strchr(list + 1, '"');
+            if (quote == NULL) {
+                break;
+            }
+            list = quote + 1;
+        }
+        list += strcspn(list, ",");
+    }
+    return false;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Parse a "Range:" value against the size of the file.
+ *
+ * Only a single byte range is served. A list of ranges, another unit or
+ * a malformed value is ignored, and the client gets the whole file.
+ *
+ * Returns 1 with the first and last byte of the range set,
+ *         0 if the header is to be ignored, or
+ *        -1 if the range lies past the end of the file.
+ *
+ **************************************************************************
+ */
+static int
+httpd_parse_range(const char *value,  // IN
+                  off_t size,         // IN
+                  off_t *first,       // OUT
+                  off_t *last)        // OUT
+{
+    long long start;
+    long long end = LLONG_MAX;
+    char *rest;
+
+    if (strncasecmp(value, "bytes=", 6) != 0 || strchr(value, ',') != NULL) {
+        return 0;
+    }
+    value += 6 + strspn(value + 6, " \t");
+
+    if (*value == '-') {
+        /* The last "end" bytes. */
+        if (!isdigit((unsigned char)value[1])) {
+            return 0;
+        }
+        end = strtoll(value + 1, &rest, 10);
+        if (rest[strspn(rest, " \t")] != '\0') {
+            return 0;
+        }
+        if (end == 0 || size == 0) {
+            return -1;
+        }
+        *first = end < size ? size - end : 0;
+        *last  = size - 1;
+        return 1;
+    }
+
+    if (!isdigit((unsigned char)*value)) {
+        return 0;
+    }
+    start = strtoll(value, &rest, 10);
+    if (*rest++ != '-') {
+        return 0;
+    }
+    if (isdigit((unsigned char)*rest)) {
+        end = strtoll(rest, &rest, 10);
+        if (end < start) {
+            return 0;
+        }
+    }
+    if (rest[strspn(rest, " \t")] != '\0') {
+        return 0;
+    }
+    if (start >= size) {
+        return -1;
+    }
+    *first = start;
+    *last  = end < size ? end : size - 1;
+    return 1;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Evaluate the conditional and range headers against a file.
+ *
+ * "If-None-Match:" takes precedence over "If-Modified-Since:", and a
+ * range is only honored if "If-Range:", when given, names the current
+ * ETag or Last-Modified date exactly.
+ *
+ * Returns 304 if the client's copy is current, 206 with the range set,
+ * 416 if the range is past the end of the file, or 200 for the whole
+ * file.
+ *
+ **************************************************************************
+ */
+static int
+httpd_evaluate_request(const HttpRequest *req,   // IN
+                       const FileEntry *entry,   // IN
+                       off_t *first,             // OUT
+                       off_t *last)              // OUT
+{
+    if (req->ifNoneMatch[0] != '\0') {
+        if (httpd_etag_listed(req->ifNoneMatch, entry->etag)) {
+            return 304;
+        }
+    } else if (req->ifModifiedSince >= 0 &&
+               entry->mtime.tv_sec <= req->ifModifiedSince) {
+        return 304;
+    }
+
+    if (req->range[0] == '\0' ||
+        (req->ifRange[0] != '\0' &&
+         strcmp(req->ifRange, entry->etag) != 0 &&
+         httpd_parse_date(req->ifRange) != entry->mtime.tv_sec)) {
+        return 200;
+    }
+    switch (httpd_parse_range(req->range, entry->size, first, last)) {
+        case 1:
+            return 206;
+        case -1:
+            return 416;
+        default:
+            return 200;
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Format the header of a 206, 304 or 416 response to a file.
+ *
+ * These are rendered per request, as the cached templates only cover
+ * the full (200) response.
+ *
+ **************************************************************************
+ */
+static void
+httpd_format_file_status(HttpResponse *resp, const FileEntry *entry,
+                         off_t first, off_t last)
+{
+    char fields[512];
+    char tmpl[MAX_RESPONSE];
+    const char *mime = NULL;
+    const char *vary = entry->compressible ? "Vary: Accept-Encoding\r\n" : "";
+    char cacheControl[MAX_VALIDATOR] = "";
+    off_t len;
+    int tmplLen;
+
+    if (entry->cacheControl != NULL) {
+        snprintf(cacheControl, sizeof cacheControl, "Cache-Control: %s\r\n",
+                 entry->cacheControl);
+    }
+
+    if (resp->status == 206) {
+        snprintf(fields, sizeof fields,
+                 "%s%s%s%s"
+                 "Accept-Ranges: bytes\r\n"
+                 "ETag: %s\r\n"
+                 "Last-Modified: %s\r\n"
+                 "%s"
+                 "Content-Range: bytes %lld-%lld/%lld\r\n",
+                 entry->encoding != NULL ? "Content-Encoding: " : "",
+                 entry->encoding != NULL ? entry->encoding : "",
+                 entry->encoding != NULL ? "\r\n" : "", vary,
+                 entry->etag, entry->lastModified, cacheControl,
+                 (long long)first,
+                 (long long)last, (long long)entry->size);
+        mime = entry->mime;
+        len  = last - first + 1;
+    } else if (resp->status == 304) {
+        snprintf(fields, sizeof fields,
+                 "%s"
+                 "ETag: %s\r\n"
+                 "Last-Modified: %s\r\n"
+                 "%s",
+                 vary, entry->etag, entry->lastModified, cacheControl);
+        len = -1;
+    } else {
+        snprintf(fields, sizeof fields,
+                 "Content-Range: bytes */%lld\r\n", (long long)entry->size);
+        len = 0;
+    }
+    tmplLen = httpd_render_template(tmpl, sizeof tmpl, resp->status,
+                                    resp->keepAlive, mime, fields);
+    httpd_finish_header(resp, tmpl, tmplLen, len);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Format the response to a request for a file or a route.
+ *
+ * If the requested file is found, a normal repsonse (200) is prepared
+ * from its file cache entry, which holds the header template and either
+ * the file data or the open file for httpd_send_body(). A conditional
+ * request for a file the client already has gets a 304 without a body,
+ * and a range request gets a 206 with only that range of the file. A
+ * client that accepts a content coding gets the br or gzip variant of
+ * a text file instead, to which the conditions and range then apply.
+ *
+ * Otherwise, a not-found response (404) is prepared.
+ *
+ **************************************************************************
+ */
+static void
+httpd_format_response(const HttpRequest *req,  // IN
+                      HttpResponse *resp)      // IN/OUT
+{
+    FileEntry *entry;
+    off_t first = 0;
+    off_t last;
+
+    if (req->fixedStatus != 0) {
+        httpd_format_fixed(resp, req);
+        return;
+    }
+    entry = filecache_get(req->fname);
+    if (entry == NULL) {
+        httpd_format_notfound(resp, req->fname + req->nameOff);
+        return;
+    }
+    if (req->acceptEncoding != 0) {
+        FileEntry *variant = filecache_get_variant(entry,
+                                                   req->acceptEncoding);
+        if (variant != NULL) {
+            filecache_put(entry);
+            entry = variant;
+        }
+    }
+
+    resp->entry  = entry;
+    resp->status = httpd_evaluate_request(req, entry, &first, &last);
+    LogDebug("thread-%u: RESPONSE: status=%d mime=%s encoding=%s "
+             "content_length=%lld\n", pthread_self(), resp->status,
+             entry->mime, entry->encoding != NULL ? entry->encoding : "none",
+             (long long)entry->size);
+    resp->iovCnt = 1;
+    if (resp->status == 200) {
+        httpd_finish_header(resp, entry->header[resp->keepAlive],
+                            entry->headerLen[resp->keepAlive], entry->size);
+        last = entry->size - 1;
+    } else {
+        httpd_format_file_status(resp, entry, first, last);
+        if (resp->status != 206) {
+            return;   /* no body */
+        }
+    }
+
+    if (entry->data != NULL) {
+        resp->iov[1].iov_base = entry->data + first;
+        resp->iov[1].iov_len  = last + 1 - first;
+        resp->iovCnt = 2;
+    } else {
+        resp->fd      = entry->fd;
+        resp->fileOff = first;
+        resp->fileEnd = last + 1;
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Prepare a response to the client.
+ *
+ * A draining server closes the connection after the response.
+ *
+ * The time the request took to receive, and the time taken here, are
+ * recorded in the metrics, and the time to send it once it is released.
+ *
+ **************************************************************************
+ */
+void
+httpd_prepare_response(const HttpRequest *req,  // IN
+                       HttpResponse *resp)      // OUT
+{
+    long long now = NowNs();
+
+    metrics_phase(METRICS_RECEIVE, now - req->startNs);
+    httpd_response_init(resp);
+    resp->keepAlive = req->keepAlive && !httpd_draining();
+    if (req->metrics) {
+        httpd_format_metrics(resp);
+    } else {
+        httpd_format_response(req, resp);
+    }
+    resp->length     = httpd_response_remaining(resp);
+    resp->startNs    = req->startNs;
+    resp->preparedNs = NowNs();
+    metrics_phase(METRICS_PREPARE, resp->preparedNs - now);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Release the resources held by a response.
+ *
+ * A prepared response is counted in the metrics, with what was sent of
+ * it, however far it got.
+ *
+ **************************************************************************
+ */
+void
+httpd_release_response(HttpResponse *resp)
+{
+    if (resp->preparedNs != 0) {
+        long long now = NowNs();
+
+        metrics_phase(METRICS_SEND, now - resp->preparedNs);
+        metrics_response(resp->status,
+                         resp->length - httpd_response_remaining(resp),
+                         now - resp->startNs);
+    }
+    if (resp->entry != NULL) {
+        filecache_put(resp->entry);   /* the cache owns the fd */
+    }
+    if (resp->pipefd[0] >= 0) {
+        close(resp->pipefd[0]);
+        close(resp->pipefd[1]);
+    }
+    free(resp->text);
+    httpd_response_init(resp);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Skip the first "n" bytes sent from the response's iov.
+ *
+ * Returns true once the whole iov has been sent.
+ *
+ **************************************************************************
+ */
+bool
+httpd_advance_iov(HttpResponse *resp, size_t n)
+{
+    while (resp->iovIdx < resp->iovCnt &&
+           n >= resp->iov[resp->iovIdx].iov_len) {
+        n -= resp->iov[resp->iovIdx].iov_len;
+        resp->iovIdx++;
+    }
+    if (n > 0) {
+        resp->iov[resp->iovIdx].iov_base =
+            (char *)resp->iov[resp->iovIdx].iov_base + n;
+        resp->iov[resp->iovIdx].iov_len -= n;
+    }
+    return resp->iovIdx == resp->iovCnt;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Count the bytes of a response that are still to be sent.
+ *
+ **************************************************************************
+ */
+off_t
+httpd_response_remaining(const HttpResponse *resp)
+{
+    off_t n = resp->fileEnd - resp->fileOff + resp->pipeLen;
+    int i;
+
+    for (i = resp->iovIdx; i < resp->iovCnt; i++) {
+        n += resp->iov[i].iov_len;
+    }
+    return n;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Start the send clock of a prepared response.
+ *
+ * Returns the first deadline of the response, the send timeout from now.
+ *
+ **************************************************************************
+ */
+long long
+httpd_send_begin(HttpSendClock *sc,          // IN/OUT
+                 const HttpResponse *resp,   // IN
+                 long long now)              // IN: msecs
+{
+    sc->base   += sc->total;
+    sc->total   = httpd_response_remaining(resp);
+    sc->start   = now;
+    sc->ackedAt = now;
+    return now + svrArgs.sendTimeout * 1000LL;
+}
 
-#define MAX_FILENAME   4096
-#define MAX_REQUEST    4096
-#define MAX_RESPONSE   4096
 
 /**
- * The server command line arguments.
+ **************************************************************************
+ *
+ * \brief Get the deadline of a response being sent, once the last one
+ *        has come.
+ *
+ * The client has to acknowledge some of the response within the send
+ * timeout, and, past that, the response as a whole at the minimum rate.
+ * If the kernel does not tell what has been acknowledged, the client is
+ * given the benefit of the doubt.
+ *
+ * Returns the new deadline, which is not after "now" if the response
+ * has timed out.
+ *
+ **************************************************************************
  */
-typedef struct ServerArgs {
-    unsigned short listenPort;
-    const char    *htdocRoot;
-} ServerArgs;
+long long
+httpd_send_deadline(HttpSendClock *sc,   // IN/OUT
+                    int sock,            // IN
+                    long long now)       // IN: msecs
+{
+    struct tcp_info ti;
+    socklen_t len = sizeof ti;
+    long long deadline;
+
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0 ||
+        len < offsetof(struct tcp_info, tcpi_bytes_acked) +
+              sizeof ti.tcpi_bytes_acked) {
+        return now + svrArgs.sendTimeout * 1000LL;
+    }
+    if ((long long)ti.tcpi_bytes_acked > sc->acked) {
+        sc->acked   = ti.tcpi_bytes_acked;
+        sc->ackedAt = now;
+    }
 
-static ServerArgs svrArgs;
+    deadline = sc->ackedAt + svrArgs.sendTimeout * 1000LL;
+    if (svrArgs.minRate > 0) {
+        long long done = sc->acked - sc->base;
+        long long floor;
+
+        if (done < 0) {
+            done = 0;
+        }
+        floor = sc->start + svrArgs.sendTimeout * 1000LL +
+                done * 1000 / svrArgs.minRate;
+        if (floor < deadline) {
+            deadline = floor;
+        }
+    }
+    return deadline;
+}
 
 
 /**
  **************************************************************************
  *
- * \brief Create a TCP listen socket on the given port.
+ * \brief Send (the rest of) the response header to the client.
+ *
+ * An in-memory body is sent along with the header in the same gather
+ * write, so a small response takes a single sendmsg() call. If a file
+ * body follows, MSG_MORE tells the kernel not to push the header out in
+ * a segment of its own.
+ *
+ * Returns 1 when done, 0 if the socket would block, or -1 on error.
  *
  **************************************************************************
  */
-static int
-CreatePassiveTCP(unsigned port)
+int
+httpd_send_header(int sock, HttpResponse *resp)
 {
-    int sock;
-    int optval;
-    struct sockaddr_in svrAddr;
+    int flags = MSG_NOSIGNAL;
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("Failed to allocate the listen socket");
-        exit(EXIT_FAILURE);
+    if (resp->fileOff < resp->fileEnd) {
+        flags |= MSG_MORE;
     }
 
-    optval = 1;
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
-                   &optval, sizeof (optval)) < 0) {
-        perror("Failed to set socket option SO_REUSEADDR");
-        exit(EXIT_FAILURE);
-    }
+    while (resp->iovIdx < resp->iovCnt) {
+        struct msghdr msg;
+        ssize_t n;
 
-    memset(&svrAddr, 0, sizeof(svrAddr));
-    svrAddr.sin_family = AF_INET;
-    svrAddr.sin_port = htons(port);
-    svrAddr.sin_addr.s_addr = INADDR_ANY;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov    = &resp->iov[resp->iovIdx];
+        msg.msg_iovlen = resp->iovCnt - resp->iovIdx;
 
-    if (bind(sock, (struct sockaddr *)&svrAddr, sizeof svrAddr) < 0) {
-        perror("Failed to bind IP address and port to the listen socket");
-        exit(EXIT_FAILURE);
+        n = sendmsg(sock, &msg, flags);
+        if (n < 0 && errno == EINTR) {
+            continue;    /* retry */
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;    /* resume when writable */
+        } else if (n < 0) {
+            return -1;   /* error */
+        }
+
+        httpd_advance_iov(resp, n);
     }
+    return 1;
+}
 
-    if (listen(sock, 5) < 0) {
-        perror("Failed to listen for connections");
-        exit(EXIT_FAILURE);
+
+/**
+ **************************************************************************
+ *
+ * \brief Send a chunk of the file through a pipe with splice().
+ *
+ * This is the fallback for files that sendfile() cannot handle. Bytes
+ * that made it into the pipe but not yet to the socket stay there for
+ * the next call.
+ *
+ * Returns the number of bytes sent, or -1 on error (errno is EAGAIN if
+ * the socket would block).
+ *
+ **************************************************************************
+ */
+static ssize_t
+httpd_splice_body(int sock, HttpResponse *resp)
+{
+    ssize_t n;
+
+    if (resp->pipeLen == 0) {
+        loff_t off = resp->fileOff;
+        n = splice(resp->fd, &off, resp->pipefd[1], NULL,
+                   resp->fileEnd - resp->fileOff, SPLICE_F_MOVE);
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;   /* the file was truncated */
+            }
+            return -1;
+        }
+        resp->fileOff = off;
+        resp->pipeLen = n;
     }
 
-    return sock;
+    n = splice(resp->pipefd[0], NULL, sock, NULL, resp->pipeLen,
+               SPLICE_F_MOVE |
+               (resp->fileOff < resp->fileEnd ? SPLICE_F_MORE : 0));
+    if (n > 0) {
+        resp->pipeLen -= n;
+    }
+    return n;
 }
 
 
 /**
  **************************************************************************
  *
- * \brief Reads a request line from the client.
+ * \brief Send (the rest of) the response body to the client.
  *
- * The request line received from the client is saved as a null-terminated
- * string in the "buf" argument. The characters '\r' and '\n' are removed.
+ * File bodies go straight from the page cache to the socket with
+ * sendfile(), or with splice() through a pipe where sendfile() is not
+ * supported, so they are never copied through user space. The file
+ * offset records how far a partial send got.
  *
- * Returns the number of bytes saved in the "buf" argument, or -1 if there
- * is an error or EOF.
+ * Returns 1 when done, 0 if the socket would block, or -1 on error.
  *
  **************************************************************************
  */
-static int
-httpd_readline(int sock, char *buf, int maxlen)
-{
-    int   n = 0;
-    char *p = buf;
-
-    while (n < maxlen - 1) {
-        char c;
-        int rc = read(sock, &c, 1);
-        if (rc == 1) {
-            /* Stop at \n and also strip away \r and \n. */
-            if (c == '\n') {
-                *p = 0;  /* null-terminated */
-                return n;
-            } else if (c != '\r') {
-                *p++ = c;
-                n++;
+int
+httpd_send_body(int sock, HttpResponse *resp)
+{
+    if (resp->fd < 0) {
+        return 1;    /* sent along with the header */
+    }
+
+    while (resp->fileOff < resp->fileEnd || resp->pipeLen > 0) {
+        ssize_t n;
+
+        if (resp->pipefd[0] < 0) {
+            n = sendfile(sock, resp->fd, &resp->fileOff,
+                         resp->fileEnd - resp->fileOff);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                if (pipe2(resp->pipefd, O_CLOEXEC) < 0) {
+                    resp->pipefd[0] = -1;
+                    return -1;
+                }
+                continue;   /* fall back to splice() */
             }
-        } else if (rc == 0) {
-            return -1;   /* EOF */
+            if (n == 0) {
+                return -1;  /* the file was truncated */
+            }
+        } else {
+            n = httpd_splice_body(sock, resp);
+        }
+
+        if (n > 0) {
+            continue;
         } else if (errno == EINTR) {
             continue;    /* retry */
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;    /* resume when writable */
         } else {
             return -1;   /* error */
         }
     }
-    return -1;  /* buffer too small */
+    return 1;
 }
 
 
 /**
  **************************************************************************
  *
- * \brief Get the size of the requested file.
+ * \brief Send a response to the client over a blocking socket.
+ *
+ * Returns true if the whole response has been sent, and the connection
+ * is kept alive.
  *
  **************************************************************************
  */
-static int
-httpd_get_file_size(FILE *fp)
+static bool
+httpd_write_response(int sock, HttpWatch *w, const HttpRequest *req)
 {
-    int fsize;
-    fseek(fp, 0, SEEK_END);
-    fsize = ftell(fp);
-    rewind(fp);
-    return fsize;
+    HttpResponse resp;
+    bool sent;
+
+    httpd_prepare_response(req, &resp);
+    httpd_watch_send(w, &resp);
+    sent = httpd_send_header(sock, &resp) > 0 &&
+           httpd_send_body(sock, &resp) > 0 && resp.keepAlive;
+    httpd_release_response(&resp);
+    return sent;
 }
 
 
 /**
  **************************************************************************
  *
- * \brief Get the MIME type of the requested file.
+ * \brief Maps a URL pathname to a file or a fixed response.
+ *
+ * The URL is mapped by the longest matching prefix in the routing table
+ * (see route_load()); a URL that no route matches is mapped as-is to a
+ * file under htdocRoot. If the file path ends with "/", "index.html" is
+ * appended. METRICS_URL is reserved for the server's metrics.
  *
  **************************************************************************
  */
-static const char *
-httpd_get_mime(const char *fname)
-{
-    const char *extf = strrchr(fname, '.');
-    if (extf == NULL) {
-        return "application/octet-stream";
-    } else if (strcmp(extf, ".html") == 0) {
-        return "text/html";
-    } else if (strcmp(extf, ".jpg") == 0) {
-        return "image/jpeg";
-    } else if (strcmp(extf, ".gif") == 0) {
-        return "image/gif";
-    } else if (strcmp(extf, ".text") == 0 ||
-               strcmp(extf, ".txt") == 0) {
-        return "text/plain";
-    } else {
-        return "application/octet-stream";
+static int
+httpd_map_url(const char *url, HttpRequest *req)
+{
+    if (strlen(url) == 0) {
+        Error("thread-%u: Invalid empty URL\n", pthread_self());
+        return -1;
+    }
+    if (strcmp(url, METRICS_URL) == 0) {
+        req->metrics = true;
+        return 0;
+    }
+    if (route_map(url, req) < 0) {
+        Error("thread-%u: URL mapped too long: %s\n", pthread_self(), url);
+        return -1;
     }
+    LogDebug("thread-%u: GET: url=%s file=%s status=%d\n", pthread_self(),
+             url, req->fname, req->fixedStatus);
+    return 0;
 }
 
 
 /**
  **************************************************************************
  *
- * \brief Send a response header to the client.
+ * \brief Checks whether a header value lists the given token.
  *
  **************************************************************************
  */
-static int
-httpd_write_header(int sock, int status, int content_len, const char *mime)
+static bool
+httpd_has_token(const char *value, const char *token)
 {
-    char header[MAX_RESPONSE];
+    int len = strlen(token);
 
-    Log("thread-%u: RESPONSE: status=%d mime=%s content_length=%d\n",
-        pthread_self(), status, mime, content_len);
-    snprintf(header, sizeof header,
-             "%s\r\n"
-             "Server: 207httpd/0.0.1\r\n"
-             "Connection: close\r\n"
-             "Content-Type: %s\r\n"
-             "Content-Length: %d\r\n"
-             "\r\n",
-             status == 200 ? "HTTP/1.1 200 OK" : "HTTP/1.1 404 Not Found",
-             mime, content_len);
-    return write(sock, header, strlen(header));
+    while (*value != '\0') {
+        value += strspn(value, " \t,");
+        if (strncasecmp(value, token, len) == 0 &&
+            strchr(" \t,", value[len]) != NULL) {
+            return true;
+        }
+        value += strcspn(value, ",");
+    }
+    return false;
 }
 
 
 /**
  **************************************************************************
  *
- * \brief Send a not-found (404) response to the client.
+ * \brief Initializes the state for parsing a new request.
+ *
+ * The engine sets "startNs" once the request has begun: right away if
+ * the connection is not idle, or else when its first byte comes.
  *
  **************************************************************************
  */
-static void
-httpd_write_notfound(int sock, const char *fname)
+void
+httpd_request_init(HttpRequest *req)
 {
-    char response[MAX_RESPONSE];
-
-    snprintf(response, sizeof response,
-             "<html>\n<body>\n<h1>404 Not Found</h1>\n"
-             "%s is not found\n"
-             "</body></html>\n", fname);
-    httpd_write_header(sock, 404, strlen(response), "text/html");
-    write(sock, response, strlen(response));
+    req->gotURL          = false;
+    req->keepAlive       = false;
+    req->metrics         = false;
+    req->startNs         = 0;
+    req->fname[0]        = '\0';
+    req->nameOff         = 0;
+    req->fixedStatus     = 0;
+    req->fixedText[0]    = '\0';
+    req->range[0]        = '\0';
+    req->ifRange[0]      = '\0';
+    req->ifNoneMatch[0]  = '\0';
+    req->ifModifiedSince = -1;
+    req->acceptEncoding  = 0;
 }
 
 
 /**
  **************************************************************************
  *
- * \brief Send a response to the client.
+ * \brief Keeps a header value, without surrounding whitespace.
  *
- * If the requested file is found, a normal repsonse (200) is sent to the
- * client with the requested file.
- *
- * Otherwise, a not-found response (404) is sent to the client.
+ * A value that does not fit is dropped, as if the header was not sent.
  *
  **************************************************************************
  */
 static void
-httpd_write_response(int sock, const char *fname)
+httpd_keep_value(char *buf, int size, const char *value)
 {
-    char data[MAX_RESPONSE];
-    char fullpath[MAX_FILENAME];
-    FILE *fp;
-    int sz;
+    int len;
 
-    snprintf(fullpath, sizeof fullpath, "%s/%s", svrArgs.htdocRoot, fname);
-    fp = fopen(fullpath, "rb");
-    if (fp == NULL) {
-        httpd_write_notfound(sock, fname);
-        return;
+    value += strspn(value, " \t");
+    len = strlen(value);
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) {
+        len--;
     }
-    httpd_write_header(sock, 200,
-                       httpd_get_file_size(fp),
-                       httpd_get_mime(fname));
-    while ((sz = fread(data, 1, sizeof data, fp)) > 0) {
-        write(sock, data, sz);
+    if (len >= size) {
+        len = 0;
     }
-    fclose(fp);
+    memcpy(buf, value, len);
+    buf[len] = '\0';
 }
 
 
 /**
  **************************************************************************
  *
- * \brief Maps a URL pathname to a filename relative to htdocRoot.
+ * \brief Parses an "Accept-Encoding:" value into HTTP_ENCODING_* flags.
  *
- * If the URL ends with "/", "index.html" is appended.
- * If the URL starts with "/images", it is then mapped to "/img".
- * Otherwise, the URL is mapped as-is to the filename.
+ * A coding with "q=0" is refused; any other weight accepts it, as the
+ * server's own order of preference decides between accepted codings.
  *
  **************************************************************************
  */
-static int
-httpd_map_url(const char *url, char *fname, int fname_len)
+static unsigned
+httpd_parse_encodings(const char *value)
 {
-    const char *images = "/images/";
-    const char *prefix = "";
-    const char *suffix = "";
+    unsigned flags = 0;
 
+    while (*value != '\0') {
+        const char *token;
+        const char *param;
+        unsigned flag = 0;
+        int len;
 
-    if (strlen(url) == 0) {
-        Error("thread-%u: Invalid empty URL\n", pthread_self());
-        return -1;
-    }
-    if (url[strlen(url) - 1] == '/') {
-        suffix = "index.html";
-    }
-    if (strlen(url) >= strlen(images) &&
-        strncmp(url, images, strlen(images)) == 0) {
-        url = url + strlen(images);
-        prefix = "/img/";
+        value += strspn(value, " \t,");
+        token  = value;
+        len    = strcspn(token, " \t;,");
+        value += strcspn(value, ",");
+
+        if (len == 2 && strncasecmp(token, "br", 2) == 0) {
+            flag = HTTP_ENCODING_BR;
+        } else if ((len == 4 && strncasecmp(token, "gzip", 4) == 0) ||
+                   (len == 6 && strncasecmp(token, "x-gzip", 6) == 0)) {
+            flag = HTTP_ENCODING_GZIP;
+        } else if (len == 1 && *token == '*') {
+            flag = HTTP_ENCODING_BR | HTTP_ENCODING_GZIP;
+        }
+
+        param = memchr(token, ';', value - token);
+        if (param != NULL) {
+            param += 1 + strspn(param + 1, " \t");
+            if ((*param == 'q' || *param == 'Q') && param[1] == '=' &&
+                strtod(param + 2, NULL) == 0) {
+                flag = 0;
+            }
+        }
+        flags |= flag;
     }
-    snprintf(fname, fname_len, "%s%s%s", prefix, url, suffix);
-    Log("thread-%u: GET: url=%s file=%s\n", pthread_self(), url, fname);
-    return 0;
+    return flags;
 }
 
 
@@ -293,28 +1583,53 @@ httpd_map_url(const char *url, char *fname, int fname_len)
  *         0 if it is any other GET header, or
  *        -1 if there is an error.
  *
- * The filename that the URL is mapped to is saved in the "fname" argument.
- * The string in the "req" argument may also be modified.
+ * The filename that the URL is mapped to is saved in "req", along with
+ * whether the connection is kept alive afterwards: HTTP/1.1 defaults to
+ * keep-alive and HTTP/1.0 to close, unless a "Connection:" header says
+ * otherwise. The range, conditional and content coding headers are saved
+ * for httpd_prepare_response(). The string in the "line" argument may also
+ * be modified.
  *
  **************************************************************************
  */
-static int
-httpd_parse_get_request(char *req, char *fname, int fname_len)
+int
+httpd_parse_get_request(char *line, HttpRequest *req)
 {
-    if (strlen(req) > 4 && memcmp(req, "GET ", 4) == 0) {
+    if (strlen(line) > 4 && memcmp(line, "GET ", 4) == 0) {
         char *httpStr;
-        char *url = req + 4;
+        char *url = line + 4;
         httpStr = strchr(url, ' ');
-        if (memcmp(httpStr, " HTTP", 5) != 0) {
-            Error("thread-%u: Invalid GET: %s\n", pthread_self(), req);
+        if (httpStr == NULL || memcmp(httpStr, " HTTP/", 6) != 0) {
+            Error("thread-%u: Invalid GET: %s\n", pthread_self(), line);
             return -1;
         }
         *httpStr = '\0';
-        if (httpd_map_url(url, fname, fname_len) < 0) {
+        req->keepAlive = strcmp(httpStr + 1, "HTTP/1.0") != 0;
+        if (httpd_map_url(url, req) < 0) {
             return -1;
         }
+        req->gotURL = true;
         return 1;
     }
+    if (strncasecmp(line, "Connection:", 11) == 0) {
+        if (httpd_has_token(line + 11, "close")) {
+            req->keepAlive = false;
+        } else if (httpd_has_token(line + 11, "keep-alive")) {
+            req->keepAlive = true;
+        }
+    } else if (strncasecmp(line, "Range:", 6) == 0) {
+        httpd_keep_value(req->range, sizeof req->range, line + 6);
+    } else if (strncasecmp(line, "If-Range:", 9) == 0) {
+        httpd_keep_value(req->ifRange, sizeof req->ifRange, line + 9);
+    } else if (strncasecmp(line, "If-None-Match:", 14) == 0) {
+        httpd_keep_value(req->ifNoneMatch, sizeof req->ifNoneMatch,
+                         line + 14);
+    } else if (strncasecmp(line, "Accept-Encoding:", 16) == 0) {
+        req->acceptEncoding = httpd_parse_encodings(line + 16);
+    } else if (strncasecmp(line, "If-Modified-Since:", 18) == 0) {
+        req->ifModifiedSince = httpd_parse_date(line + 18 +
+                                                strspn(line + 18, " \t"));
+    }
     /* Ignore other headers. */
     return 0;
 }
@@ -323,39 +1638,99 @@ httpd_parse_get_request(char *req, char *fname, int fname_len)
 /**
  **************************************************************************
  *
- * \brief The thread worker function to handle each GET request.
+ * \brief Reads and parses the headers of the next request.
+ *
+ * Returns 0 if a GET request has been received, or -1 if there is an
+ * error, EOF, or no GET line before the end of the headers.
  *
  **************************************************************************
  */
-static void *
-httpd_process_request(void *arg)
+static int
+httpd_read_request(int sock, RecvBuf *rb, HttpWatch *w, HttpRequest *req)
 {
-    char req[MAX_REQUEST];
-    char fname[MAX_REQUEST];
-    int sock    = (int)arg;
-    bool gotURL = false;
-
-    Log("thread-%u: Starting (ssock=%u)\n", pthread_self(), sock);
+    char *line;
 
+    httpd_request_init(req);
+    if (!w->idle) {
+        req->startNs = NowNs();
+    }
     while (1) {
-        int rc;
-        if (httpd_readline(sock, req, sizeof req) <= 0) {
-            break;
+        int n = httpd_readline(sock, rb, w, req, &line);
+        if (n < 0) {
+            return -1;
+        } else if (n == 0) {
+            break;   /* end of headers */
         }
-        Log("thread-%u: HEADER: %s\n", pthread_self(), req);
-        rc = httpd_parse_get_request(req, fname, sizeof fname);
-        if (rc == 1) {
-            gotURL = true;
-        } else if (rc < 0) {
-            break;
+        LogDebug("thread-%u: HEADER: %s\n", pthread_self(), line);
+        if (httpd_parse_get_request(line, req) < 0) {
+            return -1;
         }
     }
-    if (gotURL) {
-        httpd_write_response(sock, fname);
+    return req->gotURL ? 0 : -1;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Serve a connection with blocking I/O, then close it.
+ *
+ * Requests are served one after another until the client asks to close
+ * the connection, the per-connection request limit is reached, or the
+ * client stays idle for longer than the keep-alive timeout, takes longer
+ * than the header timeout to send a request, or receives a response too
+ * slowly, or the server drains. Pipelined requests are parsed straight
+ * out of the receive buffer.
+ *
+ **************************************************************************
+ */
+void
+httpd_serve_connection(int sock)
+{
+    RecvBuf rb;
+    HttpRequest req;
+    HttpWatch watch;
+    int numRequests = 0;
+
+    LogDebug("thread-%u: Starting (ssock=%u)\n", pthread_self(), sock);
+
+    recvbuf_init(&rb);
+    httpd_watch_start(&watch, sock);
+    while (httpd_read_request(sock, &rb, &watch, &req) == 0) {
+        if (++numRequests >= svrArgs.maxRequests) {
+            req.keepAlive = false;
+        }
+        if (!httpd_write_response(sock, &watch, &req)) {
+            break;
+        }
+        httpd_watch_wait(&watch, &rb);
     }
+    httpd_watch_stop(&watch);
 
-    Log("thread-%u: Exiting (ssock=%u)\n", pthread_self(), sock);
+    LogDebug("thread-%u: Exiting (ssock=%u, requests=%d)\n",
+        pthread_self(), sock, numRequests);
     close(sock);
+    metrics_closed();
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief The thread worker function to handle each connection.
+ *
+ **************************************************************************
+ */
+static void *
+httpd_process_request(void *arg)
+{
+    httpd_serve_connection((int)arg);
+
+    pthread_mutex_lock(&liveLock);
+    if (--liveThreads == 0) {
+        pthread_cond_signal(&liveCond);
+    }
+    pthread_mutex_unlock(&liveLock);
     return NULL;
 }
 
@@ -365,6 +1740,9 @@ httpd_process_request(void *arg)
  *
  * \brief The server loop to accept new client connections.
  *
+ * Once the server drains, it stops accepting, and returns when the last
+ * connection thread is done.
+ *
  **************************************************************************
  */
 static void
@@ -372,11 +1750,17 @@ ServerListenerLoop(int msock)
 {
     pthread_t th;
     pthread_attr_t ta;
+    struct pollfd pfd[2];
     bool listenerRunning = true;
 
     pthread_attr_init(&ta);
     pthread_attr_setdetachstate(&ta, PTHREAD_CREATE_DETACHED);
 
+    pfd[0].fd     = msock;
+    pfd[0].events = POLLIN;
+    pfd[1].fd     = httpd_drain_fd();
+    pfd[1].events = POLLIN;
+
     while (listenerRunning) {
         int ssock;
         struct sockaddr_in cliAddr;
@@ -386,14 +1770,29 @@ ServerListenerLoop(int msock)
         char cliName[INET_ADDRSTRLEN + PORT_STRLEN];
         char svrName[INET_ADDRSTRLEN + PORT_STRLEN];
 
+        if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+            perror("Failed to wait for connections");
+            break;
+        }
+        if (pfd[1].revents != 0) {
+            break;
+        } else if (pfd[0].revents == 0) {
+            continue;
+        }
+
+        /* Another process may take it first, after an upgrade. */
         cliAddrLen = sizeof cliAddr;
-        ssock = accept(msock, (struct sockaddr *)&cliAddr, &cliAddrLen);
+        ssock = accept4(msock, (struct sockaddr *)&cliAddr, &cliAddrLen,
+                        SOCK_CLOEXEC);
         if (ssock < 0) {
-            if (listenerRunning && ssock != EINTR) {
+            if (errno == EINTR || errno == ECONNABORTED ||
+                errno == EAGAIN || errno == EWOULDBLOCK) {
+                continue;
+            }
+            if (!httpd_draining()) {
                 perror("Failed to accept a connection");
-                listenerRunning = false;
             }
-            continue;
+            break;
         }
 
         localAddrLen = sizeof localAddr;
@@ -406,21 +1805,163 @@ ServerListenerLoop(int msock)
         }
         SocketAddrToString(&localAddr, svrName, sizeof svrName);
         SocketAddrToString(&cliAddr, cliName, sizeof cliName);
-        Log("Accepted client %s at server %s (ssock=%u)\n",
+        LogDebug("Accepted client %s at server %s (ssock=%u)\n",
             cliName, svrName, ssock);
 
-        if (pthread_create(&th, &ta, httpd_process_request,
-                           (void *)ssock) < 0) {
+        metrics_accepted();
+        pthread_mutex_lock(&liveLock);
+        liveThreads++;
+        pthread_mutex_unlock(&liveLock);
+        if ((errno = pthread_create(&th, &ta, httpd_process_request,
+                                    (void *)ssock)) != 0) {
             perror("Failed to create a worker thread");
             listenerRunning = false;
             close(ssock);
+            metrics_closed();
+            pthread_mutex_lock(&liveLock);
+            liveThreads--;
+            pthread_mutex_unlock(&liveLock);
             continue;
         }
     }
     pthread_attr_destroy(&ta);
+
+    pthread_mutex_lock(&liveLock);
+    while (liveThreads > 0) {
+        pthread_cond_wait(&liveCond, &liveLock);
+    }
+    pthread_mutex_unlock(&liveLock);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Start draining: stop accepting, and let the connections finish.
+ *
+ * The engines wake up on the drain fd, stop accepting, cut short the
+ * idle time of their connections and return once they are all closed.
+ * Unless the listen sockets have been handed over to a new process, they
+ * are shut down, so that new connections are refused instead of waiting
+ * in the backlog.
+ *
+ **************************************************************************
+ */
+static void
+httpd_drain(bool handedOver)
+{
+    Log("\nhttpd draining, for up to %d seconds\n", svrArgs.drainTimeout);
+    __atomic_store_n(&draining, true, __ATOMIC_SEQ_CST);
+    if (eventfd_write(drainFd, 1) < 0) {
+        perror("Failed to wake up the engine");
+        exit(EXIT_FAILURE);
+    }
+    if (!handedOver) {
+        handoff_stop_listening();
+    }
+    httpd_watch_drain();
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief The signal thread function.
+ *
+ * SIGTERM and SIGINT drain the server; SIGUSR2 first starts a new
+ * process to take over the listen sockets, and drains only if it did.
+ * Once the drain timeout is over, or on another SIGTERM or SIGINT, the
+ * process exits with whatever connections are left.
+ *
+ **************************************************************************
+ */
+static void *
+httpd_signal_thread(void *arg)
+{
+    const sigset_t *set = arg;
+    long long deadline = LLONG_MAX;
+
+    while (1) {
+        struct timespec ts;
+        int sig;
+
+        if (deadline != LLONG_MAX) {
+            long long left = deadline - NowMs();
+
+            if (left <= 0) {
+                Log("\nhttpd drain timed out, closing the connections "
+                    "left\n");
+                exit(EXIT_FAILURE);
+            }
+            ts.tv_sec  = left / 1000;
+            ts.tv_nsec = (left % 1000) * 1000000L;
+        }
+        sig = sigtimedwait(set, NULL, deadline != LLONG_MAX ? &ts : NULL);
+        if (sig < 0) {
+            continue;   /* the deadline, or EINTR */
+        }
+
+        if (deadline != LLONG_MAX) {
+            if (sig != SIGUSR2) {
+                Log("\nhttpd stopping on %s while draining\n",
+                    strsignal(sig));
+                exit(EXIT_FAILURE);
+            }
+            Log("httpd: Already draining, %s ignored\n", strsignal(sig));
+        } else if (sig == SIGUSR2) {
+            if (handoff_upgrade()) {
+                httpd_drain(true);
+                deadline = NowMs() + svrArgs.drainTimeout * 1000LL;
+            }
+        } else {
+            Log("\nhttpd got %s\n", strsignal(sig));
+            httpd_drain(false);
+            deadline = NowMs() + svrArgs.drainTimeout * 1000LL;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Start handling the signals that stop or upgrade the server.
+ *
+ * They must already be blocked in every thread, so that only the signal
+ * thread takes them.
+ *
+ **************************************************************************
+ */
+static void
+httpd_init_signals(const sigset_t *set)
+{
+    pthread_t tid;
+
+    drainFd = eventfd(0, EFD_CLOEXEC);
+    if (drainFd < 0) {
+        perror("Failed to create the drain eventfd");
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_create(&tid, NULL, httpd_signal_thread, (void *)set) != 0) {
+        perror("Failed to create the signal thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(tid);
 }
 
 
+/**
+ * The connection engines selectable with "-m".
+ */
+static HttpdEngine engines[] = {
+    { "thread", ServerListenerLoop },
+    { "epoll",  EventListenerLoop  },
+    { "pool",   PoolListenerLoop   },
+    { "uring",  UringListenerLoop  },
+};
+
+
 /**
  **************************************************************************
  *
@@ -432,7 +1973,57 @@ static void
 Usage(const char *prog) // IN
 {
     Log("Usage:\n");
-    Log("    %s port /path/to/htdoc\n", prog);
+    Log("    %s [-m thread|epoll|pool|uring] [-n loops] [-p [-i]] [-b backlog] "
+        "[-q queue]\n        [-t timeout] [-H timeout] [-s timeout] "
+        "[-w bytes_per_sec] [-r requests]\n        [-D timeout] "
+        "[-c cache_mb] [-l drop|block] [-M mime.types] [-R routes]\n"
+        "        port /path/to/htdoc\n",
+        prog);
+    Log("\n");
+    Log("    The htdoc may also be a pack file made by 207pack, to serve "
+        "from memory.\n");
+    Log("    The server's metrics are at %s, in the Prometheus text "
+        "format.\n", METRICS_URL);
+    Log("    SIGTERM or SIGINT stops accepting and lets the responses in "
+        "flight finish;\n    SIGUSR2 first hands the listen sockets to "
+        "the server binary started again.\n");
+    Log("\n");
+    Log("    -m  connection engine (default: thread)\n");
+    Log("          thread: one blocking thread per connection\n");
+    Log("          epoll:  non-blocking edge-triggered event loops\n");
+    Log("          pool:   fixed pool of blocking worker threads\n");
+    Log("          uring:  io_uring completion loops, or epoll if the kernel "
+        "lacks io_uring\n");
+    Log("    -n  number of event/io_uring loops or pool workers "
+        "(default: number of cores)\n");
+    Log("    -p  epoll: a SO_REUSEPORT listen socket per loop, "
+        "each loop pinned to a core\n");
+    Log("    -i  with -p: steer connections to loops with SO_INCOMING_CPU\n");
+    Log("    -b  listen backlog (default: %d)\n", DEFAULT_BACKLOG);
+    Log("    -q  pool connections waiting for a worker before accepting pauses "
+        "(default: %d per worker)\n", DEFAULT_QUEUE_PER_WORKER);
+    Log("    -t  keep-alive idle timeout in seconds (default: %d)\n",
+        DEFAULT_KEEPALIVE_TIMEOUT);
+    Log("    -H  seconds from accepting a connection, or from the first byte "
+        "after an\n        idle time, to receive the whole request "
+        "(default: %d)\n", DEFAULT_HEADER_TIMEOUT);
+    Log("    -s  seconds a response may go without the client taking any "
+        "of it (default: %d)\n", DEFAULT_SEND_TIMEOUT);
+    Log("    -w  minimum bytes per second a response must be taken at, past "
+        "the -s\n        grace time, 0 for none (default: %d)\n",
+        DEFAULT_MIN_RATE);
+    Log("    -r  maximum requests per connection (default: %d)\n",
+        DEFAULT_MAX_REQUESTS);
+    Log("    -D  seconds to finish the connections once stopping "
+        "(default: %d)\n", DEFAULT_DRAIN_TIMEOUT);
+    Log("    -c  file cache memory ceiling in MB, 0 to disable (default: %d)\n",
+        DEFAULT_FILECACHE_MB);
+    Log("    -l  when a thread's log buffer is full, drop messages or wait "
+        "(default: drop)\n");
+    Log("    -M  MIME types and their policies (default: %s if readable, "
+        "else built-in)\n", DEFAULT_MIME_TYPES);
+    Log("    -R  URL routes, reloaded on SIGHUP (default: /images/ to "
+        "/img/)\n");
     exit(EXIT_FAILURE);
 }
 
@@ -449,11 +2040,104 @@ ParseArgs(int argc,            // IN
           char *argv[],        // IN
           ServerArgs *svrArgs) // OUT
 {
-    if (argc != 3) {
+    int opt;
+    int i;
+
+    svrArgs->engine   = &engines[0];
+    svrArgs->backlog  = DEFAULT_BACKLOG;
+    svrArgs->numLoops = sysconf(_SC_NPROCESSORS_ONLN);
+    svrArgs->keepAliveTimeout = DEFAULT_KEEPALIVE_TIMEOUT;
+    svrArgs->headerTimeout    = DEFAULT_HEADER_TIMEOUT;
+    svrArgs->sendTimeout      = DEFAULT_SEND_TIMEOUT;
+    svrArgs->minRate          = DEFAULT_MIN_RATE;
+    svrArgs->maxRequests      = DEFAULT_MAX_REQUESTS;
+    svrArgs->drainTimeout     = DEFAULT_DRAIN_TIMEOUT;
+    svrArgs->cacheMB          = DEFAULT_FILECACHE_MB;
+    svrArgs->logOverflow      = LOG_OVERFLOW_DROP;
+
+    while ((opt = getopt(argc, argv, "m:n:pib:q:t:H:s:w:r:D:c:l:M:R:")) != -1) {
+        switch (opt) {
+            case 'm':
+                for (i = 0; i < ARRAYSIZE(engines); i++) {
+                    if (strcmp(optarg, engines[i].name) == 0) {
+                        break;
+                    }
+                }
+                if (i == ARRAYSIZE(engines)) {
+                    Usage(argv[0]);
+                }
+                svrArgs->engine = &engines[i];
+                break;
+            case 'n':
+                svrArgs->numLoops = atoi(optarg);
+                break;
+            case 'p':
+                svrArgs->reusePort = true;
+                break;
+            case 'i':
+                svrArgs->incomingCpu = true;
+                break;
+            case 'b':
+                svrArgs->backlog = atoi(optarg);
+                break;
+            case 'q':
+                svrArgs->maxQueued = atoi(optarg);
+                break;
+            case 't':
+                svrArgs->keepAliveTimeout = atoi(optarg);
+                break;
+            case 'H':
+                svrArgs->headerTimeout = atoi(optarg);
+                break;
+            case 's':
+                svrArgs->sendTimeout = atoi(optarg);
+                break;
+            case 'w':
+                svrArgs->minRate = atoi(optarg);
+                break;
+            case 'r':
+                svrArgs->maxRequests = atoi(optarg);
+                break;
+            case 'D':
+                svrArgs->drainTimeout = atoi(optarg);
+                break;
+            case 'c':
+                svrArgs->cacheMB = atoi(optarg);
+                break;
+            case 'l':
+                if (strcmp(optarg, "drop") == 0) {
+                    svrArgs->logOverflow = LOG_OVERFLOW_DROP;
+                } else if (strcmp(optarg, "block") == 0) {
+                    svrArgs->logOverflow = LOG_OVERFLOW_BLOCK;
+                } else {
+                    Usage(argv[0]);
+                }
+                break;
+            case 'M':
+                svrArgs->mimeTypes = optarg;
+                break;
+            case 'R':
+                svrArgs->routes = optarg;
+                break;
+            default:
+                Usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || svrArgs->numLoops <= 0 ||
+        svrArgs->keepAliveTimeout <= 0 || svrArgs->headerTimeout <= 0 ||
+        svrArgs->sendTimeout <= 0 || svrArgs->minRate < 0 ||
+        svrArgs->maxRequests <= 0 || svrArgs->drainTimeout <= 0 ||
+        svrArgs->cacheMB < 0 || svrArgs->maxQueued < 0 ||
+        svrArgs->backlog <= 0 ||
+        (svrArgs->reusePort && svrArgs->engine->func != EventListenerLoop) ||
+        (svrArgs->incomingCpu && !svrArgs->reusePort)) {
         Usage(argv[0]);
     }
-    svrArgs->listenPort = atoi(argv[1]);
-    svrArgs->htdocRoot  = argv[2];
+    if (svrArgs->maxQueued == 0) {
+        svrArgs->maxQueued = svrArgs->numLoops * DEFAULT_QUEUE_PER_WORKER;
+    }
+    svrArgs->listenPort = atoi(argv[optind]);
+    svrArgs->htdocRoot  = argv[optind + 1];
     if (svrArgs->listenPort == 0) {
         Usage(argv[0]);
     }
@@ -469,16 +2153,65 @@ ParseArgs(int argc,            // IN
 int
 main(int argc, char *argv[])
 {
+    static sigset_t stopSignals;
+    struct stat st;
     int msock;
 
     ParseArgs(argc, argv, &svrArgs);
 
+    /*
+     * Before any thread starts, so that only the reload and signal
+     * threads get them.
+     */
+    if (svrArgs.routes != NULL) {
+        sigset_t set;
+
+        sigemptyset(&set);
+        sigaddset(&set, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+    }
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGTERM);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+
+    LogInit(svrArgs.logOverflow);
+    handoff_init(argv);
+
+    /* A client closing early must not kill the server in sendfile(). */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (svrArgs.mimeTypes != NULL) {
+        if (!mime_load(svrArgs.mimeTypes)) {
+            perror("Failed to read the MIME types");
+            exit(EXIT_FAILURE);
+        }
+    } else if (!mime_load(DEFAULT_MIME_TYPES)) {
+        mime_load(NULL);
+    }
+    filecache_init((size_t)svrArgs.cacheMB * 1024 * 1024);
+    if (stat(svrArgs.htdocRoot, &st) == 0 && S_ISREG(st.st_mode) &&
+        !pack_open(svrArgs.htdocRoot)) {
+        perror("Failed to open the pack file");
+        exit(EXIT_FAILURE);
+    }
+    if (!route_load(svrArgs.routes)) {
+        perror("Failed to read the routes");
+        exit(EXIT_FAILURE);
+    }
+    if (svrArgs.routes != NULL) {
+        route_watch(svrArgs.routes);
+    }
+
     msock = CreatePassiveTCP(svrArgs.listenPort);
+    handoff_ready();
+    httpd_init_signals(&stopSignals);
 
-    Log("\nhttpd started at port %u, htdoc=%s\n",
-        svrArgs.listenPort, svrArgs.htdocRoot);
+    Log("\nhttpd started at port %u, htdoc=%s, engine=%s\n",
+        svrArgs.listenPort, svrArgs.htdocRoot, svrArgs.engine->name);
 
-    ServerListenerLoop(msock);
+    svrArgs.engine->func(msock);
 
     close(msock);
 
@@ -0,0 +1,1032 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "hdrhist.h"
+
+#define MAX_PIPELINE      64
+#define MAX_URL_LEN       1024
+#define MAX_HEADERS_LEN   512                /* extra headers, from -H */
+#define MAX_REQUEST_LEN   (MAX_URL_LEN + MAX_HEADERS_LEN + 256)
+#define RESP_BUF_SIZE     (64 * 1024)
+#define MAX_EVENTS        256
+#define RECONNECT_DELAY   (10 * 1000000LL)   /* ns after a failed connect */
+
+#define DEFAULT_CONNS     10
+#define DEFAULT_DURATION  10
+
+/**
+ * A URL in the request mix.
+ */
+typedef struct LoadUrl {
+    char   request[MAX_REQUEST_LEN];   /* the formatted GET request */
+    int    requestLen;
+    double cumWeight;                  /* running total, for picking */
+} LoadUrl;
+
+/**
+ * The command line arguments.
+ */
+typedef struct LoadArgs {
+    struct sockaddr_in svrAddr;
+    const char        *svrHost;
+    int                numConns;
+    int                numThreads;
+    int                duration;        /* seconds */
+    int                pipeline;        /* requests in flight per conn */
+    double             rate;            /* req/s; 0 for closed loop */
+    bool               keepAlive;
+    bool               json;
+    char               headers[MAX_HEADERS_LEN];   /* CRLF-terminated */
+    LoadUrl           *urls;
+    int                numUrls;
+    double             totalWeight;
+} LoadArgs;
+
+typedef enum LoadConnState {
+    LCONN_IDLE,         /* not connected; reconnects at "retryAt" */
+    LCONN_CONNECTING,
+    LCONN_CONNECTED,
+} LoadConnState;
+
+/**
+ * A client connection.
+ *
+ * Requests in flight are answered in order, so their start times are
+ * kept in a ring and the oldest one is matched with each response.
+ */
+typedef struct LoadConn {
+    int           fd;
+    LoadConnState state;
+    long long     retryAt;
+    long long     startNs[MAX_PIPELINE];
+    int           head;
+    int           inflight;
+    char          out[MAX_PIPELINE * MAX_REQUEST_LEN];
+    int           outOff;
+    int           outLen;
+    bool          wantOut;          /* EPOLLOUT is being watched */
+    bool          inBody;
+    long long     bodyLeft;
+    bool          closeAfter;       /* "Connection: close" in the response */
+    int           status;
+    int           inLen;
+    char          in[RESP_BUF_SIZE];
+} LoadConn;
+
+/**
+ * A load generating thread with its own connections and statistics.
+ *
+ * In open-loop mode, the k-th request of the thread is due at
+ * "startNs + k * intervalNs" whether or not a connection is free to
+ * send it, and its latency is measured from then: a server that stalls
+ * is charged for the requests it kept from being sent. Requests still
+ * unsent or unanswered at the end of the run count as taking until then.
+ */
+typedef struct LoadThread {
+    int                id;
+    pthread_t          thread;
+    int                epfd;
+    int                timerFd;       /* wakes it when the next event is due */
+    long long          timerAt;       /* when "timerFd" is armed for */
+    LoadConn          *conns;
+    int                numConns;
+    int                nextConn;      /* where the search for a slot starts */
+    unsigned           seed;
+    long long          startNs;
+    long long          endNs;
+    double             intervalNs;
+    long long          arrived;       /* requests due so far */
+    long long          dispatched;    /* requests sent so far */
+    long long          completed;
+    long long          unanswered;    /* in flight at the end of the run */
+    long long          bytes;
+    long long          status[6];     /* by class: 1xx..5xx, 0 for other */
+    long long          connErrors;
+    long long          sockErrors;    /* requests lost to closed sockets */
+    HdrHist            hist;
+} LoadThread;
+
+static LoadArgs args;
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Add a URL to the request mix.
+ *
+ **************************************************************************
+ */
+static void
+AddUrl(const char *path, double weight)
+{
+    LoadUrl *url;
+
+    if (weight <= 0) {
+        return;
+    }
+    if (strlen(path) >= MAX_URL_LEN) {
+        Error("URL is too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    args.urls = realloc(args.urls, (args.numUrls + 1) * sizeof *args.urls);
+    if (args.urls == NULL) {
+        perror("Failed to allocate the URL mix");
+        exit(EXIT_FAILURE);
+    }
+    url = &args.urls[args.numUrls++];
+    url->requestLen = snprintf(url->request, sizeof url->request,
+                               "GET %s%s HTTP/1.1\r\nHost: %s\r\n%s%s\r\n",
+                               path[0] == '/' ? "" : "/", path, args.svrHost,
+                               args.keepAlive ? "" : "Connection: close\r\n",
+                               args.headers);
+    args.totalWeight += weight;
+    url->cumWeight    = args.totalWeight;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Read a URL mix file of "weight path" lines.
+ *
+ **************************************************************************
+ */
+static void
+AddUrlFile(const char *fname)
+{
+    char line[MAX_URL_LEN + 64];
+    FILE *fp = fopen(fname, "r");
+
+    if (fp == NULL) {
+        perror("Failed to open the URL mix file");
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(line, sizeof line, fp) != NULL) {
+        char path[MAX_URL_LEN];
+        double weight;
+
+        if (line[0] == '#' || sscanf(line, "%lf %1023s", &weight, path) != 2) {
+            continue;
+        }
+        AddUrl(path, weight);
+    }
+    fclose(fp);
+}
+
+
+/**
+ * The htdoc root being walked by AddHtdocFile().
+ */
+static const char *htdocRoot;
+
+/**
+ **************************************************************************
+ *
+ * \brief Add a file of the htdoc tree to the mix, with weight 1.
+ *
+ **************************************************************************
+ */
+static int
+AddHtdocFile(const char *fpath, const struct stat *sb, int typeflag,
+             struct FTW *ftwbuf)
+{
+    if (typeflag == FTW_F) {
+        AddUrl(fpath + strlen(htdocRoot), 1.0);
+    }
+    return 0;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Pick a URL of the mix at random, according to the weights.
+ *
+ **************************************************************************
+ */
+static const LoadUrl *
+PickUrl(LoadThread *th)
+{
+    double r = rand_r(&th->seed) / ((double)RAND_MAX + 1) * args.totalWeight;
+    int lo = 0;
+    int hi = args.numUrls - 1;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (args.urls[mid].cumWeight > r) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return &args.urls[lo];
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Watch a connection for writability only while it has output.
+ *
+ **************************************************************************
+ */
+static void
+ConnWatch(LoadThread *th, LoadConn *conn, bool wantOut, int op)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events   = EPOLLIN | (wantOut ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    if (epoll_ctl(th->epfd, op, conn->fd, &ev) < 0) {
+        perror("Failed to watch a connection");
+        exit(EXIT_FAILURE);
+    }
+    conn->wantOut = wantOut;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Start a non-blocking connect.
+ *
+ **************************************************************************
+ */
+static void
+ConnOpen(LoadThread *th, LoadConn *conn)
+{
+    int one = 1;
+
+    conn->head     = 0;
+    conn->inflight = 0;
+    conn->outOff   = 0;
+    conn->outLen   = 0;
+    conn->inLen    = 0;
+    conn->inBody   = false;
+
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0) {
+        perror("Failed to allocate a socket");
+        exit(EXIT_FAILURE);
+    }
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    if (connect(conn->fd, (struct sockaddr *)&args.svrAddr,
+                sizeof args.svrAddr) < 0 && errno != EINPROGRESS) {
+        th->connErrors++;
+        close(conn->fd);
+        conn->state   = LCONN_IDLE;
+        conn->retryAt = NowNs() + RECONNECT_DELAY;
+        return;
+    }
+    conn->state = LCONN_CONNECTING;
+    ConnWatch(th, conn, true, EPOLL_CTL_ADD);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Close a connection, and reopen it unless the run is over.
+ *
+ * In open-loop mode the requests in flight are due again, so that the
+ * schedule keeps its rate; in closed-loop mode they are resent anyway
+ * once the new connection is up.
+ *
+ **************************************************************************
+ */
+static void
+ConnClose(LoadThread *th, LoadConn *conn, bool error)
+{
+    if (error) {
+        th->sockErrors += conn->inflight;
+    }
+    if (args.rate > 0) {
+        th->dispatched -= conn->inflight;
+    }
+    close(conn->fd);
+    conn->state   = LCONN_IDLE;
+    conn->retryAt = error ? NowNs() + RECONNECT_DELAY : 0;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Write out as much of the pending requests as the socket takes.
+ *
+ * Returns false if the connection failed.
+ *
+ **************************************************************************
+ */
+static bool
+ConnFlush(LoadThread *th, LoadConn *conn)
+{
+    while (conn->outOff < conn->outLen) {
+        ssize_t n = send(conn->fd, conn->out + conn->outOff,
+                         conn->outLen - conn->outOff, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (n < 0) {
+            return false;
+        }
+        conn->outOff += n;
+    }
+    if (conn->outOff == conn->outLen) {
+        conn->outOff = 0;
+        conn->outLen = 0;
+    }
+    if (conn->wantOut != (conn->outLen > 0)) {
+        ConnWatch(th, conn, conn->outLen > 0, EPOLL_CTL_MOD);
+    }
+    return true;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Queue a request on a connection that has a free pipeline slot.
+ *
+ * "startNs" is when the request counts as started: now in closed-loop
+ * mode, or when it was due in open-loop mode.
+ *
+ **************************************************************************
+ */
+static void
+ConnSend(LoadThread *th, LoadConn *conn, long long startNs)
+{
+    const LoadUrl *url = PickUrl(th);
+
+    if (conn->outOff > 0) {
+        memmove(conn->out, conn->out + conn->outOff,
+                conn->outLen - conn->outOff);
+        conn->outLen -= conn->outOff;
+        conn->outOff  = 0;
+    }
+    memcpy(conn->out + conn->outLen, url->request, url->requestLen);
+    conn->outLen += url->requestLen;
+    conn->startNs[(conn->head + conn->inflight) % MAX_PIPELINE] = startNs;
+    conn->inflight++;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Parse a response header.
+ *
+ * Returns the length of the header, 0 if it is not complete yet, or -1
+ * if it is malformed.
+ *
+ **************************************************************************
+ */
+static int
+ParseHeader(LoadConn *conn)
+{
+    char *end;
+    char *p;
+
+    conn->in[conn->inLen] = '\0';
+    end = strstr(conn->in, "\r\n\r\n");
+    if (end == NULL) {
+        return conn->inLen >= RESP_BUF_SIZE - 1 ? -1 : 0;
+    }
+    *end = '\0';
+
+    if (strncmp(conn->in, "HTTP/1.", 7) != 0 ||
+        sscanf(conn->in + 8, " %d", &conn->status) != 1) {
+        return -1;
+    }
+    conn->bodyLeft   = 0;
+    conn->closeAfter = false;
+    for (p = strstr(conn->in, "\r\n"); p != NULL; p = strstr(p + 2, "\r\n")) {
+        if (strncasecmp(p + 2, "Content-Length:", 15) == 0) {
+            conn->bodyLeft = atoll(p + 17);
+        } else if (strncasecmp(p + 2, "Connection:", 11) == 0 &&
+                   strcasestr(p + 13, "close") != NULL) {
+            conn->closeAfter = true;
+        }
+    }
+    if (conn->status / 100 == 1 || conn->status == 204 ||
+        conn->status == 304) {
+        conn->bodyLeft = 0;   /* never has a body */
+    }
+    return end + 4 - conn->in;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Account for a complete response.
+ *
+ **************************************************************************
+ */
+static void
+ConnResponseDone(LoadThread *th, LoadConn *conn, long long now)
+{
+    int cls = conn->status / 100;
+
+    if (now < th->endNs) {
+        th->completed++;
+        th->status[cls >= 1 && cls <= 5 ? cls : 0]++;
+        hdrhist_record(&th->hist, now - conn->startNs[conn->head]);
+    } else {
+        th->unanswered++;
+        hdrhist_record(&th->hist, th->endNs - conn->startNs[conn->head]);
+    }
+    conn->head = (conn->head + 1) % MAX_PIPELINE;
+    conn->inflight--;
+
+    /* Closed loop: every response makes room for the next request. */
+    if (args.rate == 0 && now < th->endNs && !conn->closeAfter) {
+        ConnSend(th, conn, now);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Read and parse the responses that have arrived.
+ *
+ * Returns false if the connection was closed.
+ *
+ **************************************************************************
+ */
+static bool
+ConnRead(LoadThread *th, LoadConn *conn)
+{
+    while (1) {
+        long long now;
+        ssize_t n;
+        int off = 0;
+
+        n = recv(conn->fd, conn->in + conn->inLen,
+                 RESP_BUF_SIZE - 1 - conn->inLen, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        } else if (n <= 0) {
+            ConnClose(th, conn, conn->inflight > 0 || n < 0);
+            return false;
+        }
+        conn->inLen += n;
+        th->bytes   += n;
+        now = NowNs();
+
+        while (off < conn->inLen) {
+            if (!conn->inBody) {
+                int hdrLen;
+                memmove(conn->in, conn->in + off, conn->inLen - off);
+                conn->inLen -= off;
+                off = 0;
+                hdrLen = ParseHeader(conn);
+                if (hdrLen == 0) {
+                    break;
+                } else if (hdrLen < 0 || conn->inflight == 0) {
+                    ConnClose(th, conn, true);
+                    return false;
+                }
+                off = hdrLen;
+                conn->inBody = true;
+            }
+            if (conn->bodyLeft > conn->inLen - off) {
+                conn->bodyLeft -= conn->inLen - off;
+                off = conn->inLen;
+                break;
+            }
+            off += conn->bodyLeft;
+            conn->inBody = false;
+            ConnResponseDone(th, conn, now);
+            if (conn->closeAfter) {
+                ConnClose(th, conn, false);
+                return false;
+            }
+        }
+        if (off == conn->inLen) {
+            conn->inLen = 0;
+        } else if (off > 0) {
+            memmove(conn->in, conn->in + off, conn->inLen - off);
+            conn->inLen -= off;
+        }
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Handle an event on a connection.
+ *
+ **************************************************************************
+ */
+static void
+ConnHandleEvent(LoadThread *th, LoadConn *conn, unsigned events)
+{
+    if (conn->state == LCONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof err;
+
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            th->connErrors++;
+            ConnClose(th, conn, true);
+            return;
+        }
+        conn->state = LCONN_CONNECTED;
+        if (args.rate == 0) {
+            long long now = NowNs();
+            while (conn->inflight < args.pipeline) {
+                ConnSend(th, conn, now);
+            }
+        }
+    }
+    if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !ConnRead(th, conn)) {
+        return;
+    }
+    if (conn->outLen > 0 && !ConnFlush(th, conn)) {
+        ConnClose(th, conn, true);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Send the open-loop requests that are due, as slots allow.
+ *
+ **************************************************************************
+ */
+static void
+DispatchDue(LoadThread *th, long long now)
+{
+    long long due = (long long)((now - th->startNs) / th->intervalNs) + 1;
+    int scanned = 0;
+
+    if (now < th->endNs && due > th->arrived) {
+        th->arrived = due;
+    }
+    while (th->dispatched < th->arrived && scanned < th->numConns) {
+        LoadConn *conn = &th->conns[th->nextConn];
+        if (conn->state == LCONN_CONNECTED &&
+            conn->inflight < args.pipeline) {
+            long long startNs = th->startNs +
+                                (long long)(th->dispatched * th->intervalNs);
+            ConnSend(th, conn, startNs);
+            th->dispatched++;
+            if (!ConnFlush(th, conn)) {
+                ConnClose(th, conn, true);
+            }
+            scanned = 0;
+        } else {
+            scanned++;
+        }
+        th->nextConn = (th->nextConn + 1) % th->numConns;
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Arm the thread's timer for a time in ns, unless it already is.
+ *
+ **************************************************************************
+ */
+static void
+ArmTimer(LoadThread *th, long long at)
+{
+    struct itimerspec its;
+
+    if (at == th->timerAt) {
+        return;
+    }
+    memset(&its, 0, sizeof its);
+    its.it_value.tv_sec  = at / 1000000000LL;
+    its.it_value.tv_nsec = at % 1000000000LL;
+    if (timerfd_settime(th->timerFd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        perror("Failed to arm the timer");
+        exit(EXIT_FAILURE);
+    }
+    th->timerAt = at;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief The load generating thread function.
+ *
+ **************************************************************************
+ */
+static void *
+LoadThreadRun(void *arg)
+{
+    LoadThread *th = arg;
+    struct epoll_event events[MAX_EVENTS];
+    long long now;
+    long long k;
+    int i;
+
+    /* Wake up when the requests are due, not up to 50us later. */
+    prctl(PR_SET_TIMERSLACK, 1UL);
+
+    for (i = 0; i < th->numConns; i++) {
+        ConnOpen(th, &th->conns[i]);
+    }
+
+    while ((now = NowNs()) < th->endNs) {
+        long long wakeAt = th->endNs;
+        int n;
+
+        if (args.rate > 0) {
+            long long dueAt;
+
+            DispatchDue(th, now);
+            dueAt = th->startNs + (long long)(th->arrived * th->intervalNs);
+            if (dueAt < wakeAt) {
+                wakeAt = dueAt;
+            }
+        }
+        for (i = 0; i < th->numConns; i++) {
+            LoadConn *conn = &th->conns[i];
+            if (conn->state == LCONN_IDLE && conn->retryAt < wakeAt) {
+                wakeAt = conn->retryAt;
+            }
+        }
+        if (wakeAt > now) {
+            ArmTimer(th, wakeAt);
+        }
+
+        n = epoll_wait(th->epfd, events, MAX_EVENTS, wakeAt > now ? -1 : 0);
+        if (n < 0 && errno != EINTR) {
+            perror("Failed to wait for events");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            LoadConn *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                unsigned long long expirations;
+                if (read(th->timerFd, &expirations, sizeof expirations) > 0) {
+                    th->timerAt = 0;
+                }
+            } else if (conn->state != LCONN_IDLE) {
+                ConnHandleEvent(th, conn, events[i].events);
+            }
+        }
+
+        now = NowNs();
+        for (i = 0; i < th->numConns; i++) {
+            LoadConn *conn = &th->conns[i];
+            if (conn->state == LCONN_IDLE && conn->retryAt <= now) {
+                ConnOpen(th, conn);
+            }
+        }
+    }
+
+    /* Whatever was not answered in time took the rest of the run at least. */
+    for (i = 0; i < th->numConns; i++) {
+        LoadConn *conn = &th->conns[i];
+
+        if (conn->state == LCONN_IDLE) {
+            continue;
+        }
+        for (k = 0; k < conn->inflight; k++) {
+            long long startNs = conn->startNs[(conn->head + k) % MAX_PIPELINE];
+            th->unanswered++;
+            hdrhist_record(&th->hist, th->endNs - startNs);
+        }
+        close(conn->fd);
+    }
+    for (k = th->dispatched; k < th->arrived; k++) {
+        long long dueNs = th->startNs + (long long)(k * th->intervalNs);
+        hdrhist_record(&th->hist, th->endNs - dueNs);
+    }
+    return NULL;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Print the results, human-readable or as JSON.
+ *
+ **************************************************************************
+ */
+static void
+Report(const LoadThread *total, double elapsed, long long unsent)
+{
+    static const double pcts[] = { 50, 90, 99, 99.9, 99.99 };
+    static const char *pctNames[] = { "p50", "p90", "p99", "p99.9",
+                                      "p99.99" };
+    const HdrHist *h = &total->hist;
+    int i;
+
+    if (args.json) {
+        printf("{\"mode\":\"%s\",\"rate\":%.1f,\"connections\":%d,"
+               "\"threads\":%d,\"pipeline\":%d,\"keepalive\":%s,"
+               "\"duration_s\":%.3f,\"requests\":%lld,\"rps\":%.1f,"
+               "\"bytes\":%lld,\"status\":{\"1xx\":%lld,\"2xx\":%lld,"
+               "\"3xx\":%lld,\"4xx\":%lld,\"5xx\":%lld,\"other\":%lld},"
+               "\"errors\":{\"connect\":%lld,\"socket\":%lld},"
+               "\"unsent\":%lld,\"unanswered\":%lld,\"latency_us\":{",
+               args.rate > 0 ? "open" : "closed", args.rate,
+               args.numConns, args.numThreads, args.pipeline,
+               args.keepAlive ? "true" : "false", elapsed,
+               total->completed, total->completed / elapsed, total->bytes,
+               total->status[1], total->status[2], total->status[3],
+               total->status[4], total->status[5], total->status[0],
+               total->connErrors, total->sockErrors, unsent,
+               total->unanswered);
+        for (i = 0; i < ARRAYSIZE(pcts); i++) {
+            printf("\"%s\":%.1f,", pctNames[i],
+                   hdrhist_percentile(h, pcts[i]) / 1000.0);
+        }
+        printf("\"min\":%.1f,\"mean\":%.1f,\"max\":%.1f}}\n",
+               h->min / 1000.0, hdrhist_mean(h) / 1000.0, h->max / 1000.0);
+        return;
+    }
+
+    printf("%s loop, %d connections, %d threads, pipeline %d, %s\n",
+           args.rate > 0 ? "Open" : "Closed", args.numConns, args.numThreads,
+           args.pipeline, args.keepAlive ? "keep-alive" : "no keep-alive");
+    if (args.rate > 0) {
+        printf("Target rate:  %.1f req/s, %lld requests never sent\n",
+               args.rate, unsent);
+    }
+    printf("Requests:     %lld in %.2f s, %.1f req/s, %.2f MB/s\n",
+           total->completed, elapsed, total->completed / elapsed,
+           total->bytes / elapsed / (1024 * 1024));
+    printf("Status:       2xx %lld, 3xx %lld, 4xx %lld, 5xx %lld, other %lld\n",
+           total->status[2], total->status[3], total->status[4],
+           total->status[5], total->status[0] + total->status[1]);
+    printf("Errors:       connect %lld, socket %lld\n",
+           total->connErrors, total->sockErrors);
+    printf("Unanswered:   %lld in flight at the end\n", total->unanswered);
+    printf("Latency (us): ");
+    for (i = 0; i < ARRAYSIZE(pcts); i++) {
+        printf("%s %.1f, ", pctNames[i],
+               hdrhist_percentile(h, pcts[i]) / 1000.0);
+    }
+    printf("max %.1f, mean %.1f\n", h->max / 1000.0, hdrhist_mean(h) / 1000.0);
+    if (total->unanswered + unsent > 0) {
+        printf("              (with the unanswered and unsent requests as "
+               "taking until the end)\n");
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Show the usage message and exit the program.
+ *
+ **************************************************************************
+ */
+static void
+Usage(const char *prog) // IN
+{
+    Log("Usage:\n");
+    Log("    %s [-c conns] [-t threads] [-d secs] [-p depth] [-R rate] [-C] "
+        "[-J]\n        [-H header] [-f mixfile] [-D htdoc] host port "
+        "[path ...]\n", prog);
+    Log("\n");
+    Log("    -c  connections, spread over the threads (default: %d)\n",
+        DEFAULT_CONNS);
+    Log("    -t  threads (default: number of cores)\n");
+    Log("    -d  duration in seconds (default: %d)\n", DEFAULT_DURATION);
+    Log("    -p  requests pipelined per connection (default: 1)\n");
+    Log("    -R  open loop at this many requests per second in total, with\n"
+        "        latency measured from when each request was due "
+        "(default: closed loop)\n");
+    Log("    -C  close the connection after each request\n");
+    Log("    -J  print the results as JSON\n");
+    Log("    -H  add a header line to every request, e.g. "
+        "\"If-None-Match: ...\"\n");
+    Log("    -f  add the \"weight path\" lines of a file to the URL mix\n");
+    Log("    -D  add every file under an htdoc directory to the URL mix\n");
+    Log("    path  add a URL to the mix with weight 1\n");
+    exit(EXIT_FAILURE);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Parse command line arguments.
+ *
+ **************************************************************************
+ */
+static void
+ParseArgs(int argc,      // IN
+          char *argv[])  // IN
+{
+    const char *mixFile = NULL;
+    const char *htdoc   = NULL;
+    struct hostent *phe;
+    size_t len;
+    int opt;
+    int i;
+
+    args.numConns   = DEFAULT_CONNS;
+    args.numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    args.duration   = DEFAULT_DURATION;
+    args.pipeline   = 1;
+    args.keepAlive  = true;
+
+    while ((opt = getopt(argc, argv, "c:t:d:p:R:CJH:f:D:")) != -1) {
+        switch (opt) {
+            case 'c':
+                args.numConns = atoi(optarg);
+                break;
+            case 't':
+                args.numThreads = atoi(optarg);
+                break;
+            case 'd':
+                args.duration = atoi(optarg);
+                break;
+            case 'p':
+                args.pipeline = atoi(optarg);
+                break;
+            case 'R':
+                args.rate = atof(optarg);
+                break;
+            case 'C':
+                args.keepAlive = false;
+                break;
+            case 'J':
+                args.json = true;
+                break;
+            case 'H':
+                len = strlen(args.headers);
+                if (snprintf(args.headers + len, sizeof args.headers - len,
+                             "%s\r\n", optarg) >= sizeof args.headers - len) {
+                    Error("Too many headers: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                mixFile = optarg;
+                break;
+            case 'D':
+                htdoc = optarg;
+                break;
+            default:
+                Usage(argv[0]);
+        }
+    }
+    if (argc - optind < 2 || args.numConns <= 0 || args.numThreads <= 0 ||
+        args.duration <= 0 || args.pipeline <= 0 ||
+        args.pipeline > MAX_PIPELINE || args.rate < 0 ||
+        (!args.keepAlive && args.pipeline > 1)) {
+        Usage(argv[0]);
+    }
+    if (args.numThreads > args.numConns) {
+        args.numThreads = args.numConns;
+    }
+
+    args.svrHost = argv[optind];
+    memset(&args.svrAddr, 0, sizeof args.svrAddr);
+    args.svrAddr.sin_family = AF_INET;
+    args.svrAddr.sin_port   = htons(atoi(argv[optind + 1]));
+    phe = gethostbyname(args.svrHost);
+    if (phe == NULL) {
+        Error("Failed to look up hostname %s\n", args.svrHost);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&args.svrAddr.sin_addr, phe->h_addr_list[0], phe->h_length);
+
+    for (i = optind + 2; i < argc; i++) {
+        AddUrl(argv[i], 1.0);
+    }
+    if (mixFile != NULL) {
+        AddUrlFile(mixFile);
+    }
+    if (htdoc != NULL) {
+        htdocRoot = htdoc;
+        if (nftw(htdoc, AddHtdocFile, 16, FTW_PHYS) < 0) {
+            perror("Failed to walk the htdoc directory");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (args.numUrls == 0) {
+        AddUrl("/", 1.0);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Main entry point.
+ *
+ **************************************************************************
+ */
+int
+main(int argc, char *argv[])
+{
+    LoadThread *threads;
+    LoadThread *total;
+    struct epoll_event ev;
+    long long startNs;
+    long long unsent = 0;
+    int i;
+    int j;
+
+    ParseArgs(argc, argv);
+
+    threads = calloc(args.numThreads, sizeof *threads);
+    total   = calloc(1, sizeof *total);
+    if (threads == NULL || total == NULL) {
+        perror("Failed to allocate the threads");
+        exit(EXIT_FAILURE);
+    }
+
+    startNs = NowNs();
+    for (i = 0; i < args.numThreads; i++) {
+        LoadThread *th = &threads[i];
+
+        th->id       = i;
+        th->seed     = i + 1;
+        th->startNs  = startNs;
+        th->endNs    = startNs + args.duration * 1000000000LL;
+        th->numConns = args.numConns / args.numThreads +
+                       (i < args.numConns % args.numThreads);
+        if (args.rate > 0) {
+            th->intervalNs = 1e9 * args.numThreads / args.rate;
+            /* Stagger the threads' schedules over one interval. */
+            th->startNs += (long long)(th->intervalNs * i / args.numThreads);
+        }
+        hdrhist_init(&th->hist);
+        th->conns = calloc(th->numConns, sizeof *th->conns);
+        th->epfd  = epoll_create1(EPOLL_CLOEXEC);
+        th->timerFd = timerfd_create(CLOCK_MONOTONIC,
+                                     TFD_NONBLOCK | TFD_CLOEXEC);
+        if (th->conns == NULL || th->epfd < 0 || th->timerFd < 0) {
+            perror("Failed to set up a load thread");
+            exit(EXIT_FAILURE);
+        }
+        memset(&ev, 0, sizeof ev);
+        ev.events   = EPOLLIN;
+        ev.data.ptr = NULL;   /* the timer, unlike the connections */
+        if (epoll_ctl(th->epfd, EPOLL_CTL_ADD, th->timerFd, &ev) < 0) {
+            perror("Failed to watch the timer");
+            exit(EXIT_FAILURE);
+        }
+        if (pthread_create(&th->thread, NULL, LoadThreadRun, th) != 0) {
+            perror("Failed to create a load thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    hdrhist_init(&total->hist);
+    for (i = 0; i < args.numThreads; i++) {
+        LoadThread *th = &threads[i];
+
+        pthread_join(th->thread, NULL);
+        total->completed  += th->completed;
+        total->unanswered += th->unanswered;
+        total->bytes      += th->bytes;
+        total->connErrors += th->connErrors;
+        total->sockErrors += th->sockErrors;
+        for (j = 0; j < ARRAYSIZE(th->status); j++) {
+            total->status[j] += th->status[j];
+        }
+        hdrhist_merge(&total->hist, &th->hist);
+        unsent += th->arrived - th->dispatched;
+        close(th->epfd);
+        close(th->timerFd);
+        free(th->conns);
+    }
+
+    Report(total, (NowNs() - startNs) / 1e9, unsent);
+
+    free(total);
+    free(threads);
+    free(args.urls);
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "filecache.h"
+#include "mime.h"
+#include "pack.h"
+
+/**
+ **************************************************************************
+ *
+ * \brief Show the usage message and exit the program.
+ *
+ **************************************************************************
+ */
+static void
+Usage(const char *prog) // IN
+{
+    Log("Usage:\n");
+    Log("    %s [-M mime.types] /path/to/htdoc htdoc.pack\n", prog);
+    Log("\n");
+    Log("    Packs the files under htdoc, with their br and gzip variants,\n"
+        "    for \"207httpd port htdoc.pack\" to serve.\n");
+    Log("\n");
+    Log("    -M  MIME types and their policies (default: %s if readable, "
+        "else built-in)\n", DEFAULT_MIME_TYPES);
+    exit(EXIT_FAILURE);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Main entry point.
+ *
+ **************************************************************************
+ */
+int
+main(int argc, char *argv[])
+{
+    const char *mimeTypes = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "M:")) != -1) {
+        switch (opt) {
+            case 'M':
+                mimeTypes = optarg;
+                break;
+            default:
+                Usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2) {
+        Usage(argv[0]);
+    }
+
+    if (mimeTypes != NULL) {
+        if (!mime_load(mimeTypes)) {
+            perror("Failed to read the MIME types");
+            exit(EXIT_FAILURE);
+        }
+    } else if (!mime_load(DEFAULT_MIME_TYPES)) {
+        mime_load(NULL);
+    }
+    /* Enabled, for the gzip variants to be made. */
+    filecache_init((size_t)DEFAULT_FILECACHE_MB * 1024 * 1024);
+
+    if (!pack_build(argv[optind], argv[optind + 1])) {
+        perror("Failed to pack the htdoc directory");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+/**
+ * The heap calls of the program this is preloaded into, with LD_PRELOAD.
+ *
+ * On SIGUSR1 they are appended as "allocations frees" to the file named
+ * by ALLOCCOUNT_OUT, so that a test can take them before and after a run
+ * of load and tell whether the program allocated in between.
+ */
+static unsigned long allocs;
+static unsigned long frees;
+static int           outFd = -1;
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Count a call that allocates.
+ *
+ **************************************************************************
+ */
+static void
+allocount_alloc(void)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief The allocation functions: counted, then passed on to glibc's.
+ *
+ **************************************************************************
+ */
+void *
+malloc(size_t size)
+{
+    allocount_alloc();
+    return __libc_malloc(size);
+}
+
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    allocount_alloc();
+    return __libc_calloc(nmemb, size);
+}
+
+
+void *
+realloc(void *ptr, size_t size)
+{
+    allocount_alloc();
+    return __libc_realloc(ptr, size);
+}
+
+
+void *
+memalign(size_t alignment, size_t size)
+{
+    allocount_alloc();
+    return __libc_memalign(alignment, size);
+}
+
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+    allocount_alloc();
+    return __libc_memalign(alignment, size);
+}
+
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    allocount_alloc();
+    p = __libc_memalign(alignment, size);
+    if (p == NULL) {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+}
+
+
+void
+free(void *ptr)
+{
+    if (ptr != NULL) {
+        __atomic_add_fetch(&frees, 1, __ATOMIC_RELAXED);
+    }
+    __libc_free(ptr);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Format a number into the end of a buffer, without stdio.
+ *
+ * Returns where the digits start.
+ *
+ **************************************************************************
+ */
+static char *
+allocount_format(char *end, unsigned long n)
+{
+    do {
+        *--end = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    return end;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Append the counts to the output file, on SIGUSR1.
+ *
+ * Only async-signal-safe calls, and no allocation of its own.
+ *
+ **************************************************************************
+ */
+static void
+allocount_report(int sig)
+{
+    char buf[64];
+    char *end = buf + sizeof buf;
+    char *p;
+    int savedErrno = errno;
+
+    *--end = '\n';
+    p = allocount_format(end, __atomic_load_n(&frees, __ATOMIC_RELAXED));
+    *--p = ' ';
+    p = allocount_format(p, __atomic_load_n(&allocs, __ATOMIC_RELAXED));
+    if (write(outFd, p, buf + sizeof buf - p) < 0) {
+        /* Nothing to do about it here. */
+    }
+    errno = savedErrno;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Open the output file and install the SIGUSR1 handler, before
+ *        the program starts.
+ *
+ **************************************************************************
+ */
+static void __attribute__((constructor))
+allocount_init(void)
+{
+    const char *path = getenv("ALLOCCOUNT_OUT");
+    struct sigaction sa;
+
+    if (path == NULL) {
+        return;
+    }
+    outFd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (outFd < 0) {
+        return;
+    }
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = allocount_report;
+    sa.sa_flags   = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #include "common.h"
@@ -19,7 +20,7 @@ Log(const char *fmt, ...)
     va_list arg;
 
     va_start(arg, fmt);
-    vfprintf(stderr, fmt, arg);
+    LogWriteV(stderr, fmt, arg);
     va_end(arg);
 }
 
@@ -37,7 +38,7 @@ Error(const char *fmt, ...)
     va_list arg;
 
     va_start(arg, fmt);
-    vfprintf(stderr, fmt, arg);
+    LogWriteV(stderr, fmt, arg);
     va_end(arg);
 }
 
@@ -82,3 +83,37 @@ timeval_sub(const struct timeval *tvEnd, const struct timeval *tvStart)
    }
    return secs * 1000000 + usecs;
 }
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the current monotonic time in milliseconds.
+ *
+ **************************************************************************
+ */
+long long
+NowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the current monotonic time in nanoseconds.
+ *
+ **************************************************************************
+ */
+long long
+NowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
@@ -6,6 +6,8 @@
 #include <arpa/inet.h>
 #include <sys/time.h>
 
+#include "log.h"
+
 #define ARRAYSIZE(_x)    (sizeof(_x) / sizeof((_x)[0]))
 
 #define PORT_STRLEN      6
@@ -18,5 +20,7 @@ void SocketAddrToString(const struct sockaddr_in *addr, char *addrStr,
                         int addrStrLen);
 
 int timeval_sub(const struct timeval *tvEnd, const struct timeval *tvStart);
+long long NowMs(void);
+long long NowNs(void);
 
 #endif
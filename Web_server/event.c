@@ -0,0 +1,607 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "common.h"
+#include "httpd.h"
+#include "recvbuf.h"
+#include "slab.h"
+#include "timer.h"
+#include "metrics.h"
+#include "handoff.h"
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+#define MAX_EVENTS       256
+#define CONNS_PER_CHUNK  64     /* connections added to a loop's slab */
+
+/**
+ * The state of a connection.
+ */
+typedef enum ConnState {
+    CONN_READ_HEADERS,
+    CONN_SEND_HEADER,
+    CONN_SEND_BODY,
+    CONN_DONE,
+} ConnState;
+
+/**
+ * A client connection driven by an event loop.
+ *
+ * Its timer holds the deadline of what it is doing: waiting for a
+ * request, receiving one, or sending a response.
+ *
+ * Connections are recycled through their loop's slab; the fields before
+ * "req" are cleared for each new connection, and the rest is initialized
+ * by its module.
+ */
+typedef struct Conn {
+    int           sock;
+    ConnState     state;
+    int           numRequests;
+    bool          idle;           /* no byte of the next request yet */
+    Timer         timer;
+    HttpSendClock send;
+    HttpRequest   req;
+    RecvBuf       rb;
+    HttpResponse  resp;
+} Conn;
+
+/**
+ * An event loop, run by its own thread.
+ *
+ * "now" is read once per wakeup, and is what the connections' deadlines
+ * are set from. Once "draining", the loop accepts no more connections,
+ * and returns when it has none left.
+ */
+typedef struct EventLoop {
+    int        id;
+    int        epfd;
+    int        msock;
+    bool       draining;
+    long long  now;           /* msecs */
+    TimerWheel timers;
+    Slab       connSlab;
+    pthread_t  thread;
+} EventLoop;
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Put a socket into non-blocking mode.
+ *
+ **************************************************************************
+ */
+static int
+SetNonBlocking(int sock)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Start the deadline of a connection waiting for a request.
+ *
+ * A connection with part of a request already received is held to the
+ * header timeout, and an idle one to the keep-alive timeout until it
+ * sends something. The request's clock starts with the header timeout.
+ *
+ **************************************************************************
+ */
+static void
+ConnWaitRequest(EventLoop *loop, Conn *conn)
+{
+    conn->idle = recvbuf_pending(&conn->rb) == 0;
+    timer_set(&loop->timers, &conn->timer,
+              conn->idle ? httpd_idle_deadline(loop->now) :
+                           loop->now + svrArgs.headerTimeout * 1000LL);
+    if (!conn->idle) {
+        conn->req.startNs = NowNs();
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Close a connection and release its resources.
+ *
+ **************************************************************************
+ */
+static void
+ConnClose(EventLoop *loop, Conn *conn)
+{
+    LogDebug("loop-%d: Closing (ssock=%u, requests=%d)\n",
+        loop->id, conn->sock, conn->numRequests);
+    timer_del(&loop->timers, &conn->timer);
+    httpd_release_response(&conn->resp);
+    close(conn->sock);   /* also removes it from the epoll set */
+    metrics_closed();
+    slab_free(&loop->connSlab, conn);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Read and parse request lines until the end of the headers.
+ *
+ * Each line is handed to httpd_parse_get_request() as soon as it is
+ * complete, the same way the thread engine does with httpd_readline().
+ *
+ * Returns 1 once the request is parsed and a response prepared,
+ *         0 if more data is needed, or
+ *        -1 if there is an error, EOF, or no valid GET line.
+ *
+ **************************************************************************
+ */
+static int
+ConnReadRequest(EventLoop *loop, Conn *conn)
+{
+    while (1) {
+        char *line;
+        int n = recvbuf_getline(&conn->rb, &line);
+
+        if (n < 0) {
+            n = recvbuf_fill(&conn->rb, conn->sock);
+            if (n > 0) {
+                if (conn->idle) {
+                    /* The request has begun: it must now arrive in time. */
+                    conn->idle = false;
+                    timer_set(&loop->timers, &conn->timer,
+                              loop->now + svrArgs.headerTimeout * 1000LL);
+                    conn->req.startNs = NowNs();
+                }
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return 0;    /* wait for more */
+            } else {
+                return -1;   /* EOF, error, or line too long */
+            }
+        }
+        if (n == 0) {
+            break;   /* end of headers */
+        }
+
+        LogDebug("loop-%d: HEADER: %s\n", loop->id, line);
+        if (httpd_parse_get_request(line, &conn->req) < 0) {
+            return -1;
+        }
+    }
+    if (!conn->req.gotURL) {
+        return -1;
+    }
+    if (++conn->numRequests >= svrArgs.maxRequests) {
+        conn->req.keepAlive = false;
+    }
+    httpd_prepare_response(&conn->req, &conn->resp);
+    timer_set(&loop->timers, &conn->timer,
+              httpd_send_begin(&conn->send, &conn->resp, loop->now));
+    return 1;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get a kept-alive connection ready for its next request.
+ *
+ **************************************************************************
+ */
+static void
+ConnNextRequest(EventLoop *loop, Conn *conn)
+{
+    httpd_release_response(&conn->resp);
+    httpd_request_init(&conn->req);
+    conn->state = CONN_READ_HEADERS;
+    ConnWaitRequest(loop, conn);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Advance a connection's state machine as far as the socket allows.
+ *
+ * A kept-alive connection goes back to reading headers after each
+ * response; a pipelined request already in the receive buffer is then
+ * served right away without waiting for another event.
+ *
+ **************************************************************************
+ */
+static void
+ConnHandleEvent(EventLoop *loop, Conn *conn)
+{
+    int rc = 1;
+
+    while (rc > 0 && conn->state != CONN_DONE) {
+        switch (conn->state) {
+            case CONN_READ_HEADERS:
+                rc = ConnReadRequest(loop, conn);
+                if (rc > 0) {
+                    conn->state = CONN_SEND_HEADER;
+                }
+                break;
+            case CONN_SEND_HEADER:
+                rc = httpd_send_header(conn->sock, &conn->resp);
+                if (rc > 0) {
+                    conn->state = CONN_SEND_BODY;
+                }
+                break;
+            case CONN_SEND_BODY:
+                rc = httpd_send_body(conn->sock, &conn->resp);
+                if (rc > 0 && conn->resp.keepAlive) {
+                    ConnNextRequest(loop, conn);
+                } else if (rc > 0) {
+                    conn->state = CONN_DONE;
+                }
+                break;
+            default:
+                rc = -1;
+        }
+    }
+    if (rc < 0 || conn->state == CONN_DONE) {
+        ConnClose(loop, conn);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Accept all pending connections and add them to the loop.
+ *
+ **************************************************************************
+ */
+static void
+EventLoopAccept(EventLoop *loop)
+{
+    while (1) {
+        int ssock;
+        Conn *conn;
+        struct epoll_event ev;
+        struct sockaddr_in cliAddr;
+        socklen_t cliAddrLen;
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+        char cliName[INET_ADDRSTRLEN + PORT_STRLEN];
+#endif
+
+        cliAddrLen = sizeof cliAddr;
+        ssock = accept4(loop->msock, (struct sockaddr *)&cliAddr, &cliAddrLen,
+                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (ssock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                !httpd_draining()) {
+                perror("Failed to accept a connection");
+            }
+            return;
+        }
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+        /* Formatted only for debug builds: this is the accept fast path. */
+        SocketAddrToString(&cliAddr, cliName, sizeof cliName);
+        LogDebug("loop-%d: Accepted client %s (ssock=%u)\n",
+            loop->id, cliName, ssock);
+#endif
+
+        conn = slab_alloc(&loop->connSlab);
+        if (conn == NULL) {
+            perror("Failed to set up a new connection");
+            close(ssock);
+            continue;
+        }
+        metrics_accepted();
+        memset(conn, 0, offsetof(Conn, req));
+        conn->sock  = ssock;
+        conn->state = CONN_READ_HEADERS;
+        httpd_request_init(&conn->req);
+        httpd_response_init(&conn->resp);
+        recvbuf_init(&conn->rb);
+        timer_set(&loop->timers, &conn->timer,
+                  loop->now + svrArgs.headerTimeout * 1000LL);
+        conn->req.startNs = NowNs();
+
+        /*
+         * Edge-triggered for both directions: each notification is
+         * drained until the socket would block.
+         */
+        memset(&ev, 0, sizeof ev);
+        ev.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, ssock, &ev) < 0) {
+            perror("Failed to add a connection to the event loop");
+            ConnClose(loop, conn);
+            continue;
+        }
+
+        /* The request may already be waiting. */
+        ConnHandleEvent(loop, conn);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Close the connections whose deadline has passed.
+ *
+ * A connection sending a response gets a new deadline instead, as long
+ * as the client keeps taking it.
+ *
+ * Returns the time in milliseconds until the timers next have work to
+ * do, or -1 if there is no connection.
+ *
+ **************************************************************************
+ */
+static int
+EventLoopExpire(EventLoop *loop)
+{
+    Timer *t = timer_expire(&loop->timers, loop->now);
+
+    while (t != NULL) {
+        Conn *conn = (Conn *)((char *)t - offsetof(Conn, timer));
+
+        t = t->next;
+        if (conn->state != CONN_READ_HEADERS) {
+            long long deadline = httpd_send_deadline(&conn->send, conn->sock,
+                                                     loop->now);
+            if (deadline > loop->now) {
+                timer_set(&loop->timers, &conn->timer, deadline);
+                continue;
+            }
+        }
+        LogDebug("loop-%d: %s timeout (ssock=%u)\n", loop->id,
+                 conn->state != CONN_READ_HEADERS ? "Send" :
+                 conn->idle ? "Idle" : "Header", conn->sock);
+        ConnClose(loop, conn);
+    }
+    return timer_next_ms(&loop->timers, loop->now);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Stop accepting, and cut short the idle connections' wait.
+ *
+ * Every connection is in the wheel, so they are all taken out of it to
+ * be looked at, and filed again.
+ *
+ **************************************************************************
+ */
+static void
+EventLoopDrain(EventLoop *loop)
+{
+    long long grace = httpd_idle_deadline(loop->now);
+    Timer *t = timer_take_all(&loop->timers);
+
+    Log("loop-%d: Draining %lld connections\n",
+        loop->id, loop->connSlab.inUse);
+    loop->draining = true;
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->msock, NULL);
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, httpd_drain_fd(), NULL);
+    while (t != NULL) {
+        Conn *conn = (Conn *)((char *)t - offsetof(Conn, timer));
+
+        t = t->next;
+        if (conn->idle && conn->timer.deadline > grace) {
+            conn->timer.deadline = grace;
+        }
+        timer_set(&loop->timers, &conn->timer, conn->timer.deadline);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief The event loop thread function.
+ *
+ **************************************************************************
+ */
+static void *
+EventLoopRun(void *arg)
+{
+    EventLoop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    Log("loop-%d: Starting\n", loop->id);
+
+    loop->now = NowMs();
+    timer_init(&loop->timers, loop->now);
+    for (;;) {
+        int i;
+        int timeout = EventLoopExpire(loop);
+        int n;
+
+        /* Checked past the expiry, which may close the last connection. */
+        if (loop->draining && loop->connSlab.inUse == 0) {
+            break;
+        }
+        n = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout);
+        loop->now = NowMs();
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to wait for events");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                EventLoopAccept(loop);
+            } else if (events[i].data.ptr == loop) {
+                EventLoopDrain(loop);
+            } else {
+                ConnHandleEvent(loop, events[i].data.ptr);
+            }
+        }
+    }
+
+    Log("loop-%d: Exiting\n", loop->id);
+    return NULL;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the CPU of the n-th event loop, among the CPUs we may run on.
+ *
+ **************************************************************************
+ */
+static int
+EventLoopCpu(int n)
+{
+    cpu_set_t set;
+    int count;
+    int cpu;
+
+    if (sched_getaffinity(0, sizeof set, &set) < 0 ||
+        (count = CPU_COUNT(&set)) == 0) {
+        return -1;
+    }
+    n %= count;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set) && n-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief The epoll engine: one event loop per core.
+ *
+ * By default every loop watches the shared listen socket with
+ * EPOLLEXCLUSIVE, so a new connection wakes up only one of them, and then
+ * keeps the accepted connection for its whole lifetime.
+ *
+ * With "-p", each loop instead accepts from its own SO_REUSEPORT listen
+ * socket and runs pinned to its own core, so accepting is not serialized
+ * on one socket. With "-i", each socket also asks for the connections
+ * whose packets arrive on its loop's core (SO_INCOMING_CPU), keeping a
+ * connection on one core from the NIC queue to the response.
+ *
+ * Every loop also watches the drain fd, and returns once it is drained.
+ *
+ **************************************************************************
+ */
+void
+EventListenerLoop(int msock)
+{
+    EventLoop *loops;
+    int i;
+
+    loops = calloc(svrArgs.numLoops, sizeof *loops);
+    if (loops == NULL) {
+        perror("Failed to allocate the event loops");
+        return;
+    }
+
+    for (i = 0; i < svrArgs.numLoops; i++) {
+        EventLoop *loop = &loops[i];
+        struct epoll_event ev;
+        int cpu;
+
+        loop->id    = i;
+        loop->msock = msock;
+        slab_init(&loop->connSlab, "conn", sizeof (Conn), CONNS_PER_CHUNK);
+        if (svrArgs.reusePort) {
+            cpu = EventLoopCpu(i);
+            if (i > 0) {
+                loop->msock = CreatePassiveTCP(svrArgs.listenPort);
+            }
+            if (svrArgs.incomingCpu && cpu >= 0 &&
+                setsockopt(loop->msock, SOL_SOCKET, SO_INCOMING_CPU,
+                           &cpu, sizeof cpu) < 0) {
+                perror("Failed to set socket option SO_INCOMING_CPU");
+            }
+        }
+        if (SetNonBlocking(loop->msock) < 0) {
+            perror("Failed to set the listen socket non-blocking");
+            exit(EXIT_FAILURE);
+        }
+
+        loop->epfd  = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd < 0) {
+            perror("Failed to create an epoll instance");
+            exit(EXIT_FAILURE);
+        }
+
+        memset(&ev, 0, sizeof ev);
+        ev.events   = EPOLLIN | (svrArgs.reusePort ? 0 : EPOLLEXCLUSIVE);
+        ev.data.ptr = NULL;   /* marks the listen socket */
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->msock, &ev) < 0) {
+            perror("Failed to add the listen socket to the event loop");
+            exit(EXIT_FAILURE);
+        }
+        ev.events   = EPOLLIN;
+        ev.data.ptr = loop;   /* marks the drain fd */
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, httpd_drain_fd(), &ev) < 0) {
+            perror("Failed to add the drain fd to the event loop");
+            exit(EXIT_FAILURE);
+        }
+    }
+    handoff_close_unused();
+
+    /* Start the loops only once all the listen sockets are open. */
+    for (i = 0; i < svrArgs.numLoops; i++) {
+        EventLoop *loop = &loops[i];
+        pthread_attr_t ta;
+        int cpu;
+
+        pthread_attr_init(&ta);
+        if (svrArgs.reusePort && (cpu = EventLoopCpu(i)) >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_attr_setaffinity_np(&ta, sizeof set, &set);
+            Log("loop-%d: Pinned to CPU %d\n", i, cpu);
+        }
+        if (pthread_create(&loop->thread, &ta, EventLoopRun, loop) != 0) {
+            perror("Failed to create an event loop thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_attr_destroy(&ta);
+    }
+
+    for (i = 0; i < svrArgs.numLoops; i++) {
+        pthread_join(loops[i].thread, NULL);
+        close(loops[i].epfd);
+        if (loops[i].msock != msock) {
+            close(loops[i].msock);
+        }
+        slab_destroy(&loops[i].connSlab);
+    }
+    free(loops);
+}
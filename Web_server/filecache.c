@@ -0,0 +1,834 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "httpd.h"
+#include "filecache.h"
+#include "mime.h"
+#include "pack.h"
+#include "metrics.h"
+
+#define FILECACHE_SHARDS    16
+#define FILECACHE_BUCKETS   256   /* per shard */
+
+/**
+ * One shard of the cache.
+ *
+ * Filenames are spread over the shards by hash, and each shard has its
+ * own lock, LRU list and share of the memory ceiling, so that threads
+ * looking up different files rarely contend.
+ */
+typedef struct CacheShard {
+    pthread_mutex_t lock;
+    FileEntry      *buckets[FILECACHE_BUCKETS];
+    FileEntry      *lruHead;   /* most recently used */
+    FileEntry      *lruTail;   /* next to evict */
+    size_t          bytes;
+    int             numFds;
+} CacheShard;
+
+static CacheShard shards[FILECACHE_SHARDS];
+static size_t     shardMaxBytes;
+
+/**
+ * The content codings served, in order of preference.
+ */
+static const struct {
+    unsigned    flag;        /* HTTP_ENCODING_* */
+    const char *name;        /* Content-Encoding value */
+    const char *suffix;      /* of the precompressed sibling */
+    bool        onTheFly;    /* made when there is no sibling */
+} codings[FILECACHE_ENCODINGS] = {
+    { HTTP_ENCODING_BR,   "br",   ".br", false },
+    { HTTP_ENCODING_GZIP, "gzip", ".gz", true  },
+};
+
+/**
+ * Mark variants that do not exist, or are being loaded.
+ */
+static FileEntry noVariant;
+static FileEntry loadingVariant;
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Hash a filename (FNV-1a).
+ *
+ **************************************************************************
+ */
+static unsigned
+HashName(const char *name)
+{
+    unsigned hash = 2166136261u;
+
+    while (*name != '\0') {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Free a cache entry and close its file.
+ *
+ **************************************************************************
+ */
+static void
+EntryFree(FileEntry *entry)
+{
+    int i;
+
+    for (i = 0; i < FILECACHE_ENCODINGS; i++) {
+        FileEntry *variant = entry->variant[i];
+        if (variant != NULL && variant != &noVariant &&
+            variant != &loadingVariant) {
+            filecache_put(variant);
+        }
+    }
+    if (entry->fd >= 0) {
+        close(entry->fd);
+    }
+    free(entry->header[0]);
+    free(entry->header[1]);
+    free(entry->data);
+    free(entry->path);
+    free(entry->name);
+    free(entry);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Read a whole file into a new buffer.
+ *
+ * Returns the buffer, to be freed by the caller, or NULL on error.
+ *
+ **************************************************************************
+ */
+static char *
+ReadAll(int fd, off_t size)
+{
+    char *buf = malloc(size > 0 ? size : 1);
+    off_t off = 0;
+
+    while (buf != NULL && off < size) {
+        ssize_t n = pread(fd, buf + off, size - off, off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            free(buf);      /* error, or the file was truncated */
+            buf = NULL;
+        } else {
+            off += n;
+        }
+    }
+    return buf;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Open the entry's file, and read it into memory if it is small.
+ *
+ * Small files are served from memory and need no open file.
+ *
+ * Returns false if the file is not found or is not a regular file.
+ *
+ **************************************************************************
+ */
+static bool
+EntryOpen(FileEntry *entry)
+{
+    struct stat st;
+
+    entry->fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+    if (entry->fd < 0 || fstat(entry->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    entry->size  = st.st_size;
+    entry->mtime = st.st_mtim;
+    entry->ino   = st.st_ino;
+
+    if (entry->size <= FILECACHE_MAX_INLINE) {
+        entry->data = ReadAll(entry->fd, entry->size);
+        if (entry->data == NULL) {
+            return false;
+        }
+        close(entry->fd);
+        entry->fd = -1;
+    }
+    return true;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Render the entry's 200 header templates and account its memory.
+ *
+ **************************************************************************
+ */
+static bool
+EntryFinish(FileEntry *entry)
+{
+    char header[MAX_RESPONSE];
+    char fields[512];
+    int k;
+
+    snprintf(fields, sizeof fields,
+             "%s%s%s"
+             "Accept-Ranges: bytes\r\n"
+             "ETag: %s\r\n"
+             "Last-Modified: %s\r\n"
+             "%s%s%s",
+             entry->encoding != NULL ? "Content-Encoding: " : "",
+             entry->encoding != NULL ? entry->encoding : "",
+             entry->encoding != NULL ? "\r\n" : "",
+             entry->etag, entry->lastModified,
+             entry->cacheControl != NULL ? "Cache-Control: " : "",
+             entry->cacheControl != NULL ? entry->cacheControl : "",
+             entry->cacheControl != NULL ? "\r\n" : "");
+    if (entry->compressible) {
+        strcat(fields, "Vary: Accept-Encoding\r\n");
+    }
+    for (k = 0; k < 2; k++) {
+        entry->headerLen[k] = httpd_render_template(header, sizeof header,
+                                                    200, k, entry->mime,
+                                                    fields);
+        entry->header[k] = strdup(header);
+        if (entry->header[k] == NULL) {
+            return false;
+        }
+    }
+
+    entry->memSize = sizeof *entry + strlen(entry->name) +
+                     strlen(entry->path) + entry->headerLen[0] +
+                     entry->headerLen[1] + (entry->data ? entry->size : 0);
+    entry->refCount  = 1;
+    entry->checkedMs = NowMs();
+    return true;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Open a file and build a cache entry for it.
+ *
+ * Returns the entry with one reference held by the caller, or NULL if
+ * the file is not found or is not a regular file.
+ *
+ **************************************************************************
+ */
+static FileEntry *
+EntryLoad(const char *fname, unsigned hash)
+{
+    FileEntry *entry;
+    const MimeType *type;
+
+    entry = calloc(1, sizeof *entry);
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->fd   = -1;
+    entry->name = strdup(fname);
+    entry->path = strdup(fname);
+    if (entry->name == NULL || entry->path == NULL) {
+        EntryFree(entry);
+        return NULL;
+    }
+    if (!EntryOpen(entry)) {
+        EntryFree(entry);
+        return NULL;
+    }
+    type = mime_lookup(fname);
+    entry->mime         = type->type;
+    entry->cacheControl = type->cacheControl;
+    entry->compressible = type->compress;
+    entry->hash         = hash;
+
+    /* The validators change whenever a reload would be triggered. */
+    snprintf(entry->etag, sizeof entry->etag, "\"%llx-%llx-%lx\"",
+             (unsigned long long)entry->size,
+             (unsigned long long)entry->mtime.tv_sec, entry->mtime.tv_nsec);
+    httpd_format_date(entry->mtime.tv_sec, entry->lastModified);
+
+    if (!EntryFinish(entry)) {
+        EntryFree(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Gzip a file into the memory of its variant entry.
+ *
+ * Returns false on error, or if the file does not get any smaller.
+ *
+ **************************************************************************
+ */
+static bool
+EntryCompress(FileEntry *variant, const FileEntry *entry)
+{
+    z_stream zs;
+    char *in = entry->data;
+    uLong bound;
+    bool ok;
+
+    if (in == NULL && (in = ReadAll(entry->fd, entry->size)) == NULL) {
+        return false;
+    }
+    memset(&zs, 0, sizeof zs);
+    if (deflateInit2(&zs, FILECACHE_GZIP_LEVEL, Z_DEFLATED,
+                     15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {  /* gzip */
+        if (in != entry->data) {
+            free(in);
+        }
+        return false;
+    }
+    bound = deflateBound(&zs, entry->size);
+    variant->data = malloc(bound);
+
+    zs.next_in   = (Bytef *)in;
+    zs.avail_in  = entry->size;
+    zs.next_out  = (Bytef *)variant->data;
+    zs.avail_out = bound;
+    ok = variant->data != NULL &&
+         deflate(&zs, Z_FINISH) == Z_STREAM_END &&
+         zs.total_out < entry->size;
+    variant->size = zs.total_out;
+    deflateEnd(&zs);
+    if (in != entry->data) {
+        free(in);
+    }
+    if (ok) {
+        char *data = realloc(variant->data, variant->size);
+        if (data != NULL) {
+            variant->data = data;
+        }
+    }
+    return ok;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Build a content-encoded variant of a cache entry.
+ *
+ * A precompressed sibling file is used if there is one. Otherwise, a
+ * gzip variant is made in memory, provided that the cache is enabled to
+ * hold it, as it would be remade for every request if not.
+ *
+ * Returns the variant with one reference held by the caller, or NULL if
+ * there is none.
+ *
+ **************************************************************************
+ */
+static FileEntry *
+VariantLoad(const FileEntry *entry, int enc)
+{
+    FileEntry *variant;
+    char *quote;
+
+    variant = calloc(1, sizeof *variant);
+    if (variant == NULL) {
+        return NULL;
+    }
+    variant->fd   = -1;
+    variant->name = strdup(entry->name);
+    if (variant->name == NULL ||
+        asprintf(&variant->path, "%s%s", entry->path,
+                 codings[enc].suffix) < 0) {
+        variant->path = NULL;
+        EntryFree(variant);
+        return NULL;
+    }
+
+    if (!EntryOpen(variant)) {
+        if (variant->fd >= 0) {
+            close(variant->fd);
+            variant->fd = -1;
+        }
+        if (!codings[enc].onTheFly || shardMaxBytes == 0 ||
+            entry->size > FILECACHE_MAX_COMPRESS ||
+            !EntryCompress(variant, entry)) {
+            EntryFree(variant);
+            return NULL;
+        }
+        Log("thread-%u: CACHE: %s gzipped from %lld to %lld bytes\n",
+            pthread_self(), entry->name, (long long)entry->size,
+            (long long)variant->size);
+    }
+
+    /* The validators are the file's, told apart by the coding. */
+    variant->mtime        = entry->mtime;
+    variant->mime         = entry->mime;
+    variant->cacheControl = entry->cacheControl;
+    variant->encoding     = codings[enc].name;
+    variant->compressible = true;
+    strcpy(variant->lastModified, entry->lastModified);
+    strcpy(variant->etag, entry->etag);
+    quote = strrchr(variant->etag, '"');
+    snprintf(quote, variant->etag + sizeof variant->etag - quote,
+             "-%s\"", codings[enc].name);
+
+    if (!EntryFinish(variant)) {
+        EntryFree(variant);
+        return NULL;
+    }
+    return variant;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Check whether the file has changed since it was cached.
+ *
+ **************************************************************************
+ */
+static bool
+EntryIsStale(const FileEntry *entry)
+{
+    struct stat st;
+
+    if (stat(entry->path, &st) < 0) {
+        return true;
+    }
+    return st.st_ino != entry->ino ||
+           st.st_size != entry->size ||
+           st.st_mtim.tv_sec != entry->mtime.tv_sec ||
+           st.st_mtim.tv_nsec != entry->mtime.tv_nsec;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Count the files an entry and its variants hold open.
+ *
+ **************************************************************************
+ */
+static int
+EntryNumFds(const FileEntry *entry)
+{
+    int n = entry->fd >= 0;
+    int i;
+
+    for (i = 0; i < FILECACHE_ENCODINGS; i++) {
+        FileEntry *variant = entry->variant[i];
+        n += variant != NULL && variant != &noVariant &&
+             variant != &loadingVariant && variant->fd >= 0;
+    }
+    return n;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Find a filename in a shard. The shard lock must be held.
+ *
+ **************************************************************************
+ */
+static FileEntry *
+ShardLookup(CacheShard *shard, const char *fname, unsigned hash)
+{
+    FileEntry *entry = shard->buckets[(hash / FILECACHE_SHARDS) %
+                                      FILECACHE_BUCKETS];
+
+    while (entry != NULL &&
+           (entry->hash != hash || strcmp(entry->name, fname) != 0)) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Move an entry to the most recently used end of the LRU list.
+ *
+ **************************************************************************
+ */
+static void
+ShardLruRemove(CacheShard *shard, FileEntry *entry)
+{
+    if (entry->lruPrev != NULL) {
+        entry->lruPrev->lruNext = entry->lruNext;
+    } else {
+        shard->lruHead = entry->lruNext;
+    }
+    if (entry->lruNext != NULL) {
+        entry->lruNext->lruPrev = entry->lruPrev;
+    } else {
+        shard->lruTail = entry->lruPrev;
+    }
+}
+
+static void
+ShardLruPush(CacheShard *shard, FileEntry *entry)
+{
+    entry->lruPrev = NULL;
+    entry->lruNext = shard->lruHead;
+    if (shard->lruHead != NULL) {
+        shard->lruHead->lruPrev = entry;
+    } else {
+        shard->lruTail = entry;
+    }
+    shard->lruHead = entry;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Add an entry to a shard. The shard lock must be held.
+ *
+ * The shard takes over the caller's extra reference.
+ *
+ **************************************************************************
+ */
+static void
+ShardLink(CacheShard *shard, FileEntry *entry)
+{
+    FileEntry **bucket = &shard->buckets[(entry->hash / FILECACHE_SHARDS) %
+                                         FILECACHE_BUCKETS];
+
+    entry->next = *bucket;
+    *bucket     = entry;
+    ShardLruPush(shard, entry);
+    shard->bytes  += entry->memSize;
+    shard->numFds += EntryNumFds(entry);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Remove an entry from a shard and drop the shard's reference.
+ *
+ * The shard lock must be held.
+ *
+ **************************************************************************
+ */
+static void
+ShardUnlink(CacheShard *shard, FileEntry *entry)
+{
+    FileEntry **pp = &shard->buckets[(entry->hash / FILECACHE_SHARDS) %
+                                     FILECACHE_BUCKETS];
+
+    while (*pp != entry) {
+        pp = &(*pp)->next;
+    }
+    *pp = entry->next;
+    ShardLruRemove(shard, entry);
+    shard->bytes  -= entry->memSize;
+    shard->numFds -= EntryNumFds(entry);
+    filecache_put(entry);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Initialize the file cache.
+ *
+ * "maxBytes" is the memory ceiling for cached files and headers; 0
+ * disables caching, so every lookup opens the file again.
+ *
+ **************************************************************************
+ */
+void
+filecache_init(size_t maxBytes)
+{
+    int i;
+
+    for (i = 0; i < FILECACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+    shardMaxBytes = maxBytes / FILECACHE_SHARDS;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Look up a file, loading it into the cache on a miss.
+ *
+ * A hit is revalidated against the file's mtime, size and inode at most
+ * once every FILECACHE_REVALIDATE_MS, by whichever thread finds it due.
+ *
+ * A file under the pack being served is only looked up in the pack.
+ * A lookup answered from memory counts as a hit in the metrics, and
+ * one that goes to the file system as a miss.
+ *
+ * Returns the entry with a reference held for the caller, to be dropped
+ * with filecache_put(), or NULL if the file is not found.
+ *
+ **************************************************************************
+ */
+FileEntry *
+filecache_get(const char *fname)
+{
+    unsigned hash;
+    CacheShard *shard;
+    FileEntry *entry;
+    FileEntry *fresh;
+    bool revalidate = false;
+    long long now;
+
+    if (pack_lookup(fname, &entry)) {
+        metrics_cache_lookup(entry != NULL);
+        return entry;
+    }
+    hash  = HashName(fname);
+    shard = &shards[hash % FILECACHE_SHARDS];
+    now   = NowMs();
+    pthread_mutex_lock(&shard->lock);
+    entry = ShardLookup(shard, fname, hash);
+    if (entry != NULL) {
+        __atomic_add_fetch(&entry->refCount, 1, __ATOMIC_RELAXED);
+        ShardLruRemove(shard, entry);
+        ShardLruPush(shard, entry);
+        if (now - entry->checkedMs >= FILECACHE_REVALIDATE_MS) {
+            entry->checkedMs = now;
+            revalidate = true;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (entry != NULL) {
+        if (!revalidate || !EntryIsStale(entry)) {
+            metrics_cache_lookup(true);
+            return entry;
+        }
+        Log("thread-%u: CACHE: %s changed, reloading\n",
+            pthread_self(), fname);
+        pthread_mutex_lock(&shard->lock);
+        if (ShardLookup(shard, fname, hash) == entry) {
+            ShardUnlink(shard, entry);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        filecache_put(entry);
+    }
+
+    metrics_cache_lookup(false);
+    fresh = EntryLoad(fname, hash);
+    if (fresh == NULL || shardMaxBytes == 0) {
+        return fresh;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    entry = ShardLookup(shard, fname, hash);
+    if (entry != NULL) {
+        /* Another thread loaded it first. */
+        __atomic_add_fetch(&entry->refCount, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&shard->lock);
+        filecache_put(fresh);
+        return entry;
+    }
+    fresh->refCount++;   /* the shard's reference */
+    ShardLink(shard, fresh);
+    while ((shard->bytes > shardMaxBytes ||
+            shard->numFds > FILECACHE_MAX_FDS / FILECACHE_SHARDS) &&
+           shard->lruTail != fresh) {
+        ShardUnlink(shard, shard->lruTail);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return fresh;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Load a variant of an entry and publish it in the entry.
+ *
+ * Returns the variant with a reference held for the caller, or NULL if
+ * the coding has none.
+ *
+ **************************************************************************
+ */
+static FileEntry *
+VariantPublish(CacheShard *shard, FileEntry *entry, int enc)
+{
+    FileEntry *fresh = VariantLoad(entry, enc);
+
+    pthread_mutex_lock(&shard->lock);
+    __atomic_store_n(&entry->variant[enc], fresh != NULL ? fresh : &noVariant,
+                     __ATOMIC_RELEASE);
+    if (fresh != NULL) {
+        fresh->refCount++;   /* the caller's reference */
+        if (ShardLookup(shard, entry->name, entry->hash) == entry) {
+            /* Account it to the entry, which the shard holds. */
+            entry->memSize += fresh->memSize;
+            shard->bytes   += fresh->memSize;
+            shard->numFds  += fresh->fd >= 0;
+            while (shard->bytes > shardMaxBytes &&
+                   shard->lruTail != entry) {
+                ShardUnlink(shard, shard->lruTail);
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return fresh;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the preferred content-encoded variant of a cached file.
+ *
+ * "encodings" holds the HTTP_ENCODING_* flags the client accepts. A
+ * variant is loaded once per entry, by the first thread to need it;
+ * until it is ready, other requests get the file as is rather than
+ * wait or compress it again. A coding that has no variant is
+ * remembered as such.
+ *
+ * Returns the variant with a reference held for the caller, or NULL if
+ * the file is to be sent as is.
+ *
+ **************************************************************************
+ */
+FileEntry *
+filecache_get_variant(FileEntry *entry, unsigned encodings)
+{
+    CacheShard *shard = &shards[entry->hash % FILECACHE_SHARDS];
+    int i;
+
+    if (!entry->compressible) {
+        return NULL;
+    }
+    if (entry->packed) {
+        for (i = 0; i < FILECACHE_ENCODINGS; i++) {
+            if ((encodings & codings[i].flag) && entry->variant[i] != NULL) {
+                return entry->variant[i];
+            }
+        }
+        return NULL;
+    }
+    for (i = 0; i < FILECACHE_ENCODINGS; i++) {
+        FileEntry *variant;
+        bool claimed = false;
+
+        if (!(encodings & codings[i].flag)) {
+            continue;
+        }
+        variant = __atomic_load_n(&entry->variant[i], __ATOMIC_ACQUIRE);
+        if (variant == NULL) {
+            pthread_mutex_lock(&shard->lock);
+            variant = entry->variant[i];
+            if (variant == NULL) {
+                entry->variant[i] = &loadingVariant;
+                claimed = true;
+            }
+            pthread_mutex_unlock(&shard->lock);
+        }
+
+        if (claimed) {
+            variant = VariantPublish(shard, entry, i);
+            if (variant != NULL) {
+                return variant;
+            }
+        } else if (variant != &noVariant && variant != &loadingVariant) {
+            /* The entry's reference keeps it alive meanwhile. */
+            __atomic_add_fetch(&variant->refCount, 1, __ATOMIC_RELAXED);
+            return variant;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Drop a reference to a cache entry.
+ *
+ **************************************************************************
+ */
+void
+filecache_put(FileEntry *entry)
+{
+    if (entry->packed) {
+        return;
+    }
+    if (__atomic_sub_fetch(&entry->refCount, 1, __ATOMIC_ACQ_REL) == 0) {
+        EntryFree(entry);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief List the cached files, least recently used first in each shard.
+ *
+ * Each line holds the HTTP_ENCODING_* flags of the variants loaded for a
+ * file, in hex, then its name. It is what a new process is handed to
+ * warm its own cache with (see handoff_upgrade()), which loading the
+ * files in that order leaves in the same LRU order.
+ *
+ * Returns the list, to be freed by the caller, or NULL on error.
+ *
+ **************************************************************************
+ */
+char *
+filecache_list(size_t *len)   // OUT
+{
+    char *text = NULL;
+    FILE *f;
+    int i;
+
+    f = open_memstream(&text, len);
+    if (f == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < FILECACHE_SHARDS; i++) {
+        CacheShard *shard = &shards[i];
+        FileEntry *entry;
+
+        pthread_mutex_lock(&shard->lock);
+        for (entry = shard->lruTail; entry != NULL; entry = entry->lruPrev) {
+            unsigned encodings = 0;
+            int enc;
+
+            for (enc = 0; enc < FILECACHE_ENCODINGS; enc++) {
+                FileEntry *variant = entry->variant[enc];
+                if (variant != NULL && variant != &noVariant &&
+                    variant != &loadingVariant) {
+                    encodings |= codings[enc].flag;
+                }
+            }
+            fprintf(f, "%x %s\n", encodings, entry->name);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    if (fclose(f) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
@@ -0,0 +1,70 @@
+#ifndef _FILECACHE_H_
+#define _FILECACHE_H_
+
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "httpd.h"
+
+#define DEFAULT_FILECACHE_MB     64
+#define FILECACHE_MAX_INLINE     (64 * 1024)  /* files held in memory */
+#define FILECACHE_MAX_FDS        1024         /* open files held */
+#define FILECACHE_REVALIDATE_MS  1000
+#define FILECACHE_ETAG_LEN       48
+#define FILECACHE_MAX_COMPRESS   (8 * 1024 * 1024)  /* gzipped on the fly */
+#define FILECACHE_GZIP_LEVEL     6
+#define FILECACHE_ENCODINGS      2            /* br, gzip */
+
+/**
+ * A cached file, keyed by the file path that the URL is routed to.
+ *
+ * Small files are held in memory and served from "data"; larger ones
+ * are kept open and served from "fd". An entry is reference counted, so
+ * it stays valid for the responses using it even after it is evicted or
+ * invalidated.
+ *
+ * The content-encoded variants of a compressible file hang off its
+ * entry, and are loaded the first time a client accepts them: from a
+ * ".br" or ".gz" sibling if there is one, or else gzipped once in
+ * memory. They count towards the memory ceiling, and are dropped along
+ * with the entry when it is evicted or the file changes.
+ *
+ * Entries for the files of a pack file (see pack_open()) point into
+ * the mapped pack instead, and are neither reference counted nor
+ * revalidated.
+ */
+typedef struct FileEntry {
+    char             *name;
+    char             *path;
+    int               fd;             /* open file, or -1 if in memory */
+    char             *data;           /* whole file, or NULL */
+    off_t             size;
+    struct timespec   mtime;
+    ino_t             ino;
+    const char       *mime;
+    const char       *encoding;       /* Content-Encoding, or NULL */
+    const char       *cacheControl;   /* of the MIME type, or NULL */
+    bool              compressible;   /* has variants; sent with Vary */
+    bool              packed;         /* served from the pack file */
+    char              etag[FILECACHE_ETAG_LEN];      /* quoted */
+    char              lastModified[HTTP_DATE_LEN + 1];
+    char             *header[2];      /* 200 template, by keep-alive */
+    int               headerLen[2];
+    size_t            memSize;
+    int               refCount;
+    long long         checkedMs;      /* last mtime revalidation */
+    struct FileEntry *variant[FILECACHE_ENCODINGS];   /* NULL until loaded */
+    unsigned          hash;
+    struct FileEntry *next;           /* hash chain */
+    struct FileEntry *lruPrev;
+    struct FileEntry *lruNext;
+} FileEntry;
+
+void filecache_init(size_t maxBytes);
+FileEntry *filecache_get(const char *fname);
+FileEntry *filecache_get_variant(FileEntry *entry, unsigned encodings);
+void filecache_put(FileEntry *entry);
+char *filecache_list(size_t *len);
+
+#endif
@@ -0,0 +1,544 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "httpd.h"
+#include "filecache.h"
+#include "handoff.h"
+
+extern char **environ;
+
+/**
+ * The listen sockets, and those handed over by the old process.
+ *
+ * Every listen socket the server opens or takes over is recorded, so that
+ * an upgrade can hand them all to the new process. The ones handed over
+ * wait in "inherited" until CreatePassiveTCP() takes them, in the order
+ * the old process opened them.
+ */
+static struct {
+    pthread_mutex_t lock;
+    int             socks[HANDOFF_MAX_SOCKS];
+    int             numSocks;
+    int             inherited[HANDOFF_MAX_SOCKS];
+    int             numInherited;
+    int             nextInherited;
+    int             fd;              /* to the old process, or -1 */
+    char           *files;           /* its cached files, or NULL */
+    char          **argv;
+    char            exePath[PATH_MAX];   /* or "" if unknown */
+} handoff = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .fd   = -1,
+};
+
+/**
+ * The control message carrying the listen sockets.
+ */
+typedef union HandoffControl {
+    char           buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_SOCKS)];
+    struct cmsghdr align;
+} HandoffControl;
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Receive the listen sockets and the cached files from the old
+ *        process.
+ *
+ * Returns true on success, or false with errno set.
+ *
+ **************************************************************************
+ */
+static bool
+HandoffReceive(int fd)
+{
+    HandoffControl ctl;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char *files = NULL;
+    size_t size = 0;
+    size_t len = 0;
+    ssize_t n;
+    int count;
+
+    iov.iov_base = &count;
+    iov.iov_len  = sizeof count;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof ctl.buf;
+    n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n != sizeof count) {
+        if (n >= 0) {
+            errno = EPROTO;
+        }
+        return false;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS || (msg.msg_flags & MSG_CTRUNC) ||
+        count <= 0 || count > HANDOFF_MAX_SOCKS ||
+        cmsg->cmsg_len != CMSG_LEN(count * sizeof(int))) {
+        errno = EPROTO;
+        return false;
+    }
+    memcpy(handoff.inherited, CMSG_DATA(cmsg), count * sizeof(int));
+    handoff.numInherited = count;
+
+    /* Then the cached files, up to EOF. */
+    while (1) {
+        if (len + 1 >= size) {
+            char *bigger;
+
+            size   = size == 0 ? 4096 : size * 2;
+            bigger = realloc(files, size);
+            if (bigger == NULL) {
+                free(files);
+                return false;
+            }
+            files = bigger;
+        }
+        n = read(fd, files + len, size - len - 1);
+        if (n == 0) {
+            break;
+        } else if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(files);
+            return false;
+        }
+        len += n;
+    }
+    files[len] = '\0';
+    handoff.files = files;
+    return true;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Set up the handoff, at startup.
+ *
+ * The path of the running binary is kept for an upgrade to start it
+ * again, so that a binary replaced in place is the one that comes up.
+ * A process started by an upgrade finds its end of the Unix socket to
+ * the old process in HANDOFF_ENV, and takes the listen sockets and the
+ * list of cached files from it.
+ *
+ **************************************************************************
+ */
+void
+handoff_init(char *argv[])   // IN: kept for an upgrade
+{
+    const char *env = getenv(HANDOFF_ENV);
+    ssize_t n;
+
+    handoff.argv = argv;
+    n = readlink("/proc/self/exe", handoff.exePath,
+                 sizeof handoff.exePath - 1);
+    handoff.exePath[n > 0 ? n : 0] = '\0';
+
+    if (env == NULL) {
+        return;
+    }
+    handoff.fd = atoi(env);
+    unsetenv(HANDOFF_ENV);
+    if (fcntl(handoff.fd, F_SETFD, FD_CLOEXEC) < 0 ||
+        !HandoffReceive(handoff.fd)) {
+        perror("Failed to take over from the old process");
+        exit(EXIT_FAILURE);
+    }
+    Log("handoff: Took over %d listen sockets from pid %d\n",
+        handoff.numInherited, getppid());
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Record a listen socket, to be handed over on an upgrade.
+ *
+ **************************************************************************
+ */
+void
+handoff_add_socket(int sock)
+{
+    pthread_mutex_lock(&handoff.lock);
+    if (handoff.numSocks < HANDOFF_MAX_SOCKS) {
+        handoff.socks[handoff.numSocks++] = sock;
+    } else {
+        Log("handoff: Too many listen sockets, sock %d stays behind on "
+            "an upgrade\n", sock);
+    }
+    pthread_mutex_unlock(&handoff.lock);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Take the next listen socket handed over by the old process.
+ *
+ * One that is not on "port" is closed.
+ *
+ * Returns the socket, recorded for the next upgrade, or -1 if there is
+ * none left.
+ *
+ **************************************************************************
+ */
+int
+handoff_take_socket(unsigned port)
+{
+    int sock = -1;
+
+    pthread_mutex_lock(&handoff.lock);
+    while (sock < 0 && handoff.nextInherited < handoff.numInherited) {
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof addr;
+
+        sock = handoff.inherited[handoff.nextInherited++];
+        if (getsockname(sock, (struct sockaddr *)&addr, &addrLen) < 0 ||
+            addr.sin_family != AF_INET || ntohs(addr.sin_port) != port) {
+            Log("handoff: Closing a listen socket not on port %u\n", port);
+            close(sock);
+            sock = -1;
+        }
+    }
+    pthread_mutex_unlock(&handoff.lock);
+
+    if (sock >= 0) {
+        handoff_add_socket(sock);
+    }
+    return sock;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Close the listen sockets handed over but not taken.
+ *
+ * That happens when the new process runs fewer loops with "-p" than the
+ * old one did; the connections waiting on those sockets are reset.
+ *
+ **************************************************************************
+ */
+void
+handoff_close_unused(void)
+{
+    pthread_mutex_lock(&handoff.lock);
+    if (handoff.nextInherited < handoff.numInherited) {
+        Log("handoff: Closing %d unused listen sockets\n",
+            handoff.numInherited - handoff.nextInherited);
+    }
+    while (handoff.nextInherited < handoff.numInherited) {
+        close(handoff.inherited[handoff.nextInherited++]);
+    }
+    pthread_mutex_unlock(&handoff.lock);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Load the files the old process had cached into the file cache.
+ *
+ * The variants it had loaded are loaded too, as compressing them again
+ * on the first requests is what would cost the most.
+ *
+ * Returns the number of files loaded.
+ *
+ **************************************************************************
+ */
+static int
+HandoffWarm(char *files)
+{
+    char *line = files;
+    int count = 0;
+
+    while (*line != '\0') {
+        char *end = strchr(line, '\n');
+        char *name;
+        unsigned encodings;
+        FileEntry *entry;
+
+        if (end == NULL) {
+            break;
+        }
+        *end = '\0';
+        encodings = strtoul(line, &name, 16);
+        if (*name == ' ' && (entry = filecache_get(name + 1)) != NULL) {
+            unsigned flag;
+
+            for (flag = 1; flag != 0 && flag <= encodings; flag <<= 1) {
+                FileEntry *variant;
+
+                if ((encodings & flag) &&
+                    (variant = filecache_get_variant(entry, flag)) != NULL) {
+                    filecache_put(variant);
+                }
+            }
+            filecache_put(entry);
+            count++;
+        }
+        line = end + 1;
+    }
+    return count;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Tell the old process that this one is ready to take over.
+ *
+ * Called once the listen sockets are taken and everything else is set
+ * up, only the engine being left to start: the file cache is warmed
+ * first, so that the first requests are not all misses. Connections
+ * that come meanwhile wait in the listen backlog.
+ *
+ **************************************************************************
+ */
+void
+handoff_ready(void)
+{
+    char ready = 1;
+
+    if (handoff.fd < 0) {
+        return;
+    }
+    Log("handoff: Warmed the file cache with %d files\n",
+        HandoffWarm(handoff.files));
+    free(handoff.files);
+    handoff.files = NULL;
+
+    if (write(handoff.fd, &ready, 1) != 1) {
+        perror("Failed to tell the old process to stop");
+        exit(EXIT_FAILURE);
+    }
+    close(handoff.fd);
+    handoff.fd = -1;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Write a whole buffer to a blocking socket.
+ *
+ **************************************************************************
+ */
+static bool
+HandoffWriteAll(int sock, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(sock, buf, len);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Send the listen sockets and the cached files to the new process.
+ *
+ * The sockets go in one message, with their number as its data; the
+ * list of cached files follows, up to EOF.
+ *
+ **************************************************************************
+ */
+static bool
+HandoffSend(int sock)
+{
+    HandoffControl ctl;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char *files;
+    size_t len;
+    int count;
+    bool ok;
+
+    memset(&ctl, 0, sizeof ctl);
+    memset(&msg, 0, sizeof msg);
+    iov.iov_base    = &count;
+    iov.iov_len     = sizeof count;
+    msg.msg_iov     = &iov;
+    msg.msg_iovlen  = 1;
+    msg.msg_control = ctl.buf;
+
+    pthread_mutex_lock(&handoff.lock);
+    count = handoff.numSocks;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), handoff.socks, count * sizeof(int));
+    pthread_mutex_unlock(&handoff.lock);
+
+    if (sendmsg(sock, &msg, 0) != sizeof count) {
+        return false;
+    }
+
+    /* A cache that cannot be listed is not worth failing the upgrade. */
+    files = filecache_list(&len);
+    ok = files == NULL || HandoffWriteAll(sock, files, len);
+    free(files);
+    return ok;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Build the environment of the new process.
+ *
+ * "var" is a buffer for HANDOFF_ENV, which is added to ours.
+ *
+ * Returns the environment, to be freed by the caller, or NULL.
+ *
+ **************************************************************************
+ */
+static char **
+HandoffEnv(char *var, size_t size, int fd)
+{
+    char **envp;
+    int n = 0;
+
+    while (environ[n] != NULL) {
+        n++;
+    }
+    envp = malloc((n + 2) * sizeof *envp);
+    if (envp == NULL) {
+        return NULL;
+    }
+    memcpy(envp, environ, n * sizeof *envp);
+    snprintf(var, size, "%s=%d", HANDOFF_ENV, fd);
+    envp[n]     = var;
+    envp[n + 1] = NULL;
+    return envp;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Start the server binary again and hand it the listen sockets.
+ *
+ * The new process is started from the same path, with the same
+ * arguments, and gets the listen sockets and the list of cached files
+ * over a Unix socket (SCM_RIGHTS). Both processes accept on the same
+ * sockets until the new one is ready, so no connection is refused
+ * meanwhile; the old one is then left to drain.
+ *
+ * Returns true once the new process has taken over, or false if it
+ * failed or took longer than HANDOFF_TIMEOUT, in which case it is
+ * killed and this process goes on serving.
+ *
+ **************************************************************************
+ */
+bool
+handoff_upgrade(void)
+{
+    struct timeval tv = { HANDOFF_TIMEOUT, 0 };
+    char var[sizeof HANDOFF_ENV + 16];
+    char **envp;
+    char ready;
+    pid_t pid;
+    int sv[2];
+    bool ok;
+
+    if (handoff.exePath[0] == '\0') {
+        Error("handoff: Cannot upgrade, the server binary is unknown\n");
+        return false;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        Error("handoff: Failed to create a socket pair: %s\n",
+              strerror(errno));
+        return false;
+    }
+    envp = HandoffEnv(var, sizeof var, sv[1]);
+    pid  = envp != NULL ? fork() : -1;
+    if (pid == 0) {
+        /* Only async-signal-safe calls until the exec. */
+        fcntl(sv[1], F_SETFD, 0);
+        execve(handoff.exePath, handoff.argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(sv[1]);
+    if (pid < 0) {
+        Error("handoff: Failed to start %s: %s\n",
+              handoff.exePath, strerror(errno));
+        close(sv[0]);
+        return false;
+    }
+    Log("\nhttpd upgrading: started %s (pid %d)\n", handoff.exePath, pid);
+
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    ok = HandoffSend(sv[0]) && shutdown(sv[0], SHUT_WR) == 0 &&
+         read(sv[0], &ready, 1) == 1;
+    close(sv[0]);
+    if (!ok) {
+        Error("handoff: pid %d did not take over, still serving\n", pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return false;
+    }
+    Log("handoff: pid %d took over\n", pid);
+    return true;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Stop listening, so that new connections are refused rather than
+ *        left in the backlog.
+ *
+ * Not for an upgrade: the sockets are shared with the new process.
+ *
+ **************************************************************************
+ */
+void
+handoff_stop_listening(void)
+{
+    int i;
+
+    pthread_mutex_lock(&handoff.lock);
+    for (i = 0; i < handoff.numSocks; i++) {
+        shutdown(handoff.socks[i], SHUT_RD);
+    }
+    pthread_mutex_unlock(&handoff.lock);
+}
@@ -0,0 +1,18 @@
+#ifndef _HANDOFF_H_
+#define _HANDOFF_H_
+
+#include <stdbool.h>
+
+#define HANDOFF_ENV          "HTTPD_HANDOFF_FD"   /* set for a new process */
+#define HANDOFF_MAX_SOCKS    253    /* SCM_MAX_FD: one message's worth */
+#define HANDOFF_TIMEOUT      30     /* seconds for the new process to be up */
+
+void handoff_init(char *argv[]);
+int handoff_take_socket(unsigned port);
+void handoff_add_socket(int sock);
+void handoff_close_unused(void);
+void handoff_ready(void);
+bool handoff_upgrade(void);
+void handoff_stop_listening(void);
+
+#endif
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hdrhist.h"
+
+#define HALF_SUB_BUCKETS   (HDRHIST_SUB_BUCKETS / 2)
+#define SUB_BUCKET_BITS    11    /* log2(HDRHIST_SUB_BUCKETS) */
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the power-of-2 bucket of a value.
+ *
+ **************************************************************************
+ */
+static int
+BucketOf(unsigned long long value)
+{
+    int msb = 63 - __builtin_clzll(value | (HDRHIST_SUB_BUCKETS - 1));
+    return msb - (SUB_BUCKET_BITS - 1);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Initialize an empty histogram.
+ *
+ **************************************************************************
+ */
+void
+hdrhist_init(HdrHist *h)
+{
+    memset(h, 0, sizeof *h);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Record a value; larger ones than fit are recorded as the largest.
+ *
+ **************************************************************************
+ */
+void
+hdrhist_record(HdrHist *h, long long value)
+{
+    int bucket;
+
+    if (value < 0) {
+        value = 0;
+    }
+    if (h->count == 0 || value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+    h->count++;
+    h->sum += value;
+
+    bucket = BucketOf(value);
+    if (bucket >= HDRHIST_BUCKETS) {
+        bucket = HDRHIST_BUCKETS - 1;
+        value  = ((long long)HDRHIST_SUB_BUCKETS << bucket) - 1;
+    }
+    h->counts[bucket * HALF_SUB_BUCKETS + (value >> bucket)]++;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Add the values recorded in one histogram to another.
+ *
+ **************************************************************************
+ */
+void
+hdrhist_merge(HdrHist *dst, const HdrHist *src)
+{
+    int i;
+
+    if (src->count == 0) {
+        return;
+    }
+    if (dst->count == 0 || src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+    dst->count += src->count;
+    dst->sum   += src->sum;
+    for (i = 0; i < HDRHIST_COUNTS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the value at a percentile (0-100).
+ *
+ * Returns the largest value that falls into the same sub-bucket as the
+ * value at the percentile, capped to the largest recorded value.
+ *
+ **************************************************************************
+ */
+long long
+hdrhist_percentile(const HdrHist *h, double pct)
+{
+    long long target;
+    long long seen = 0;
+    int i;
+
+    if (h->count == 0) {
+        return 0;
+    }
+    target = (long long)(pct / 100.0 * h->count + 0.5);
+    if (target < 1) {
+        target = 1;
+    } else if (target > h->count) {
+        target = h->count;
+    }
+
+    for (i = 0; i < HDRHIST_COUNTS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            int bucket = i < HDRHIST_SUB_BUCKETS ? 0 :
+                         i / HALF_SUB_BUCKETS - 1;
+            long long sub = i - bucket * HALF_SUB_BUCKETS;
+            long long value = ((sub + 1) << bucket) - 1;
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the mean of the recorded values.
+ *
+ **************************************************************************
+ */
+double
+hdrhist_mean(const HdrHist *h)
+{
+    return h->count > 0 ? h->sum / h->count : 0.0;
+}
@@ -0,0 +1,30 @@
+#ifndef _HDRHIST_H_
+#define _HDRHIST_H_
+
+#define HDRHIST_SUB_BUCKETS   2048   /* 3 significant decimal digits */
+#define HDRHIST_BUCKETS       32     /* values up to 2^42, e.g. 73 min in ns */
+#define HDRHIST_COUNTS        ((HDRHIST_BUCKETS + 1) * HDRHIST_SUB_BUCKETS / 2)
+
+/**
+ * A high dynamic range histogram of non-negative values.
+ *
+ * Values are kept with 3 significant digits over their whole range: each
+ * power of 2 above HDRHIST_SUB_BUCKETS is split into the same number of
+ * linear sub-buckets, so recording is a couple of shifts and percentiles
+ * are within 0.1% of the recorded values.
+ */
+typedef struct HdrHist {
+    long long count;
+    long long min;
+    long long max;
+    double    sum;
+    long long counts[HDRHIST_COUNTS];
+} HdrHist;
+
+void hdrhist_init(HdrHist *h);
+void hdrhist_record(HdrHist *h, long long value);
+void hdrhist_merge(HdrHist *dst, const HdrHist *src);
+long long hdrhist_percentile(const HdrHist *h, double pct);
+double hdrhist_mean(const HdrHist *h);
+
+#endif
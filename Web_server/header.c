@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "httpd.h"
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the status line of a response status.
+ *
+ * Returns NULL for a status that the server does not send.
+ *
+ **************************************************************************
+ */
+const char *
+httpd_status_line(int status)
+{
+    switch (status) {
+        case 200: return "HTTP/1.1 200 OK";
+        case 204: return "HTTP/1.1 204 No Content";
+        case 206: return "HTTP/1.1 206 Partial Content";
+        case 301: return "HTTP/1.1 301 Moved Permanently";
+        case 302: return "HTTP/1.1 302 Found";
+        case 303: return "HTTP/1.1 303 See Other";
+        case 304: return "HTTP/1.1 304 Not Modified";
+        case 307: return "HTTP/1.1 307 Temporary Redirect";
+        case 308: return "HTTP/1.1 308 Permanent Redirect";
+        case 403: return "HTTP/1.1 403 Forbidden";
+        case 404: return "HTTP/1.1 404 Not Found";
+        case 410: return "HTTP/1.1 410 Gone";
+        case 416: return "HTTP/1.1 416 Range Not Satisfiable";
+        case 503: return "HTTP/1.1 503 Service Unavailable";
+        default:  return NULL;
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Render a response header template into a buffer.
+ *
+ * The template holds everything up to the value of the "Date:" field;
+ * httpd_finish_header() appends the date and the Content-Length.
+ * "fields" holds any further header lines, each ending with CRLF, and
+ * the "Content-Type:" field is left out if "mime" is NULL.
+ *
+ * Returns the length of the template.
+ *
+ **************************************************************************
+ */
+int
+httpd_render_template(char *buf, int size, int status, bool keepAlive,
+                      const char *mime, const char *fields)
+{
+    snprintf(buf, size,
+             "%s\r\n"
+             "Server: 207httpd/0.0.1\r\n"
+             "Connection: %s\r\n"
+             "%s%s%s"
+             "%s"
+             "Date: ",
+             httpd_status_line(status),
+             keepAlive ? "keep-alive" : "close",
+             mime != NULL ? "Content-Type: " : "",
+             mime != NULL ? mime : "",
+             mime != NULL ? "\r\n" : "",
+             fields);
+    return strlen(buf);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Format a time as an HTTP date of HTTP_DATE_LEN characters.
+ *
+ **************************************************************************
+ */
+void
+httpd_format_date(time_t t,     // IN
+                  char *buf)    // OUT: HTTP_DATE_LEN + 1 bytes
+{
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    strftime(buf, HTTP_DATE_LEN + 1, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
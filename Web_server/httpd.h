@@ -0,0 +1,166 @@
+#ifndef _HTTPD_H_
+#define _HTTPD_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "log.h"
+
+#define MAX_FILENAME   4096
+#define MAX_REQUEST    4096
+#define MAX_RESPONSE   4096
+
+#define HTTP_DATE_LEN  29    /* "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define MAX_RANGE      64    /* longest "Range:" value handled */
+#define MAX_VALIDATOR  256   /* longest "If-Range:"/"If-None-Match:" value */
+#define MAX_FIXED      1024  /* longest redirect location or fixed body */
+
+#define HTTP_ENCODING_BR     0x1   /* accepted content codings */
+#define HTTP_ENCODING_GZIP   0x2
+
+#define DEFAULT_KEEPALIVE_TIMEOUT   15    /* seconds */
+#define DEFAULT_HEADER_TIMEOUT      10    /* seconds */
+#define DEFAULT_SEND_TIMEOUT        30    /* seconds */
+#define DEFAULT_MIN_RATE            1024  /* bytes per second */
+#define DEFAULT_MAX_REQUESTS        100
+#define DEFAULT_QUEUE_PER_WORKER    16    /* pool admission limit */
+#define DEFAULT_BACKLOG             1024  /* capped by net.core.somaxconn */
+#define DEFAULT_DRAIN_TIMEOUT       30    /* seconds */
+#define DRAIN_IDLE_MS               1000  /* left to idle connections */
+
+/**
+ * A connection engine: takes over the listen socket and serves clients.
+ */
+typedef struct HttpdEngine {
+    const char  *name;
+    void       (*func)(int msock);
+} HttpdEngine;
+
+/**
+ * The server command line arguments.
+ */
+typedef struct ServerArgs {
+    unsigned short     listenPort;
+    int                backlog;
+    bool               reusePort;          /* a listen socket per loop */
+    bool               incomingCpu;        /* with SO_INCOMING_CPU */
+    const char        *htdocRoot;
+    const HttpdEngine *engine;
+    int                numLoops;           /* event loops or pool workers */
+    int                maxQueued;
+    int                keepAliveTimeout;
+    int                headerTimeout;      /* to receive a whole request */
+    int                sendTimeout;        /* without any progress */
+    int                minRate;            /* response bytes/s, after that */
+    int                maxRequests;
+    int                drainTimeout;       /* to finish, once stopping */
+    int                cacheMB;
+    LogOverflow        logOverflow;
+    const char        *mimeTypes;          /* mime.types file, or NULL */
+    const char        *routes;             /* routes file, or NULL */
+} ServerArgs;
+
+/**
+ * A request parsed from the client.
+ *
+ * The conditional and range headers are kept as received, since they
+ * can only be evaluated against the file once it is looked up. A value
+ * too long to keep is dropped, which at worst sends the whole file.
+ *
+ * A URL routed to a redirect or a fixed response has "fixedStatus" set
+ * instead of a file path, with the location or body in "fixedText", and
+ * the metrics URL (METRICS_URL) has "metrics" set.
+ */
+typedef struct HttpRequest {
+    bool      gotURL;
+    bool      keepAlive;
+    bool      metrics;
+    long long startNs;                     /* when its first byte came */
+    char      fname[MAX_FILENAME];         /* file path, under its root */
+    int       nameOff;                     /* where the root ends in it */
+    int       fixedStatus;                 /* or 0 */
+    char      fixedText[MAX_FIXED];
+    char      range[MAX_RANGE];            /* or "" */
+    char      ifRange[MAX_VALIDATOR];      /* or "" */
+    char      ifNoneMatch[MAX_VALIDATOR];  /* or "" */
+    time_t    ifModifiedSince;             /* or -1 */
+    unsigned  acceptEncoding;              /* HTTP_ENCODING_* flags */
+} HttpRequest;
+
+/**
+ * A response being sent to the client.
+ *
+ * The header and an in-memory body are gathered in "iov", and a file
+ * body is sent from "fd"; both are sent incrementally, so that a
+ * non-blocking socket can resume where it left off.
+ *
+ * A body rendered per response, too large for "body", is allocated in
+ * "text" instead.
+ */
+typedef struct HttpResponse {
+    int               status;
+    bool              keepAlive;
+    struct FileEntry *entry;        /* file cache reference, or NULL */
+    struct iovec      iov[2];       /* header, in-memory body */
+    int               iovIdx;       /* first iov not completely sent */
+    int               iovCnt;
+    int               fd;           /* file body, or -1 */
+    off_t             fileOff;      /* next file byte to send */
+    off_t             fileEnd;
+    int               pipefd[2];    /* splice() fallback, or -1 */
+    int               pipeLen;      /* bytes waiting in the pipe */
+    char             *text;         /* allocated body, or NULL */
+    off_t             length;       /* header and body */
+    long long         startNs;      /* of the request, for the metrics */
+    long long         preparedNs;   /* or 0 if not prepared */
+    char              header[MAX_RESPONSE];
+    char              body[MAX_RESPONSE];
+} HttpResponse;
+
+/**
+ * How the client is taking the response being sent, for its timeouts.
+ *
+ * Progress is measured by what the client acknowledges, not by what the
+ * server manages to queue, which socket buffers and large sends would
+ * hide. It is only looked at when a deadline comes.
+ */
+typedef struct HttpSendClock {
+    long long start;      /* msecs, when the response was prepared */
+    long long base;       /* bytes of the earlier responses */
+    long long total;      /* bytes of this response */
+    long long acked;      /* bytes acknowledged on the connection */
+    long long ackedAt;    /* msecs, when "acked" last grew */
+} HttpSendClock;
+
+extern ServerArgs svrArgs;
+
+const char *httpd_status_line(int status);
+void httpd_format_date(time_t t, char *buf);
+int httpd_render_template(char *buf, int size, int status, bool keepAlive,
+                          const char *mime, const char *fields);
+void httpd_request_init(HttpRequest *req);
+int httpd_parse_get_request(char *line, HttpRequest *req);
+void httpd_response_init(HttpResponse *resp);
+void httpd_prepare_response(const HttpRequest *req, HttpResponse *resp);
+void httpd_release_response(HttpResponse *resp);
+bool httpd_advance_iov(HttpResponse *resp, size_t n);
+off_t httpd_response_remaining(const HttpResponse *resp);
+long long httpd_send_begin(HttpSendClock *sc, const HttpResponse *resp,
+                           long long now);
+long long httpd_send_deadline(HttpSendClock *sc, int sock, long long now);
+int httpd_send_header(int sock, HttpResponse *resp);
+int httpd_send_body(int sock, HttpResponse *resp);
+void httpd_serve_connection(int sock);
+bool httpd_draining(void);
+int httpd_drain_fd(void);
+long long httpd_idle_deadline(long long now);
+
+int CreatePassiveTCP(unsigned port);
+void EventListenerLoop(int msock);
+void PoolListenerLoop(int msock);
+void UringListenerLoop(int msock);
+
+#endif
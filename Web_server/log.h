@@ -0,0 +1,42 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stdio.h>
+#include <stdarg.h>
+
+/*
+ * Log levels. Messages below LOG_LEVEL are compiled out entirely, so
+ * hot-path LogDebug() lines cost nothing unless the program is built
+ * with -DLOG_LEVEL=LOG_LEVEL_DEBUG.
+ */
+#define LOG_LEVEL_DEBUG  0
+#define LOG_LEVEL_INFO   1
+#define LOG_LEVEL_ERROR  2
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL        LOG_LEVEL_INFO
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LogDebug(...)    Log(__VA_ARGS__)
+#else
+#define LogDebug(...)    ((void)0)
+#endif
+
+#define LOG_RING_SIZE    (32 * 1024)   /* per thread, a power of 2 */
+#define LOG_MAX_STRLEN   1024          /* longer %s arguments are cut */
+
+/**
+ * What a thread does when its log ring is full.
+ */
+typedef enum LogOverflow {
+    LOG_OVERFLOW_DROP,    /* drop the message and count it */
+    LOG_OVERFLOW_BLOCK,   /* wait for the flusher to make room */
+} LogOverflow;
+
+void LogInit(LogOverflow overflow);
+void LogShutdown(void);
+void LogWriteV(FILE *stream, const char *fmt, va_list args);
+unsigned long LogDropped(void);
+
+#endif
@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "httpd.h"
+#include "metrics.h"
+
+#define METRICS_ALIGN   64
+
+/* Counters are only written by their thread, and read by a scrape. */
+#define METRICS_ADD(_c, _n)                                             \
+    __atomic_store_n(&(_c), __atomic_load_n(&(_c), __ATOMIC_RELAXED) +  \
+                     (_n), __ATOMIC_RELAXED)
+
+/**
+ * A latency histogram, in buckets of powers of 2 microseconds.
+ *
+ * Each bucket counts the values above the previous bound up to its own,
+ * and is only made cumulative when rendered; the count is their sum.
+ */
+typedef struct MetricsHist {
+    uint64_t sumNs;
+    uint64_t buckets[METRICS_BUCKETS];
+} MetricsHist;
+
+/**
+ * The counters of a thread.
+ *
+ * They are all uint64_t, so that a scrape can sum them as an array.
+ * Connections are counted as opened and closed, by whichever thread
+ * does it, and the open ones only worked out when rendered.
+ */
+typedef struct MetricsCounters {
+    uint64_t    accepted;
+    uint64_t    closed;
+    uint64_t    cacheHits;
+    uint64_t    cacheMisses;
+    uint64_t    bytesSent;
+    uint64_t    responses[METRICS_STATUSES];   /* by statusIndex[] */
+    MetricsHist requests;
+    MetricsHist phases[METRICS_PHASES];
+} MetricsCounters;
+
+/**
+ * A thread's counters, on cache lines of their own.
+ *
+ * A thread claims a block on its first count, and gives it back when it
+ * exits, for the next thread to carry on counting in: counters are only
+ * ever added to, so their sums stay right whichever thread adds to them.
+ * Blocks are never freed, so a scrape walks the list without a lock.
+ */
+typedef struct ThreadMetrics {
+    MetricsCounters       c;
+    bool                  inUse;   /* under metricsLock */
+    struct ThreadMetrics *next;    /* only ever prepended to */
+} __attribute__((aligned(METRICS_ALIGN))) ThreadMetrics;
+
+static ThreadMetrics   *metricsHead;
+static pthread_mutex_t  metricsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t    metricsKey;
+static pthread_once_t   metricsOnce = PTHREAD_ONCE_INIT;
+static __thread ThreadMetrics *myMetrics;
+
+/* The index of each status in "responses", 0 for the others. */
+static unsigned char    statusIndex[600];
+static int              statusCodes[METRICS_STATUSES];
+
+static const char *phaseNames[METRICS_PHASES] = {
+    "receive", "prepare", "send",
+};
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Give the block of an exiting thread back.
+ *
+ **************************************************************************
+ */
+static void
+MetricsRelease(void *arg)
+{
+    ThreadMetrics *m = arg;
+
+    pthread_mutex_lock(&metricsLock);
+    m->inUse = false;
+    pthread_mutex_unlock(&metricsLock);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Number the statuses that the server sends.
+ *
+ **************************************************************************
+ */
+static void
+MetricsInit(void)
+{
+    int numStatuses = 1;
+    int status;
+
+    for (status = 100; status < ARRAYSIZE(statusIndex); status++) {
+        if (httpd_status_line(status) != NULL &&
+            numStatuses < METRICS_STATUSES) {
+            statusIndex[status] = numStatuses;
+            statusCodes[numStatuses++] = status;
+        }
+    }
+    pthread_key_create(&metricsKey, MetricsRelease);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the calling thread's counters, claiming a block on first use.
+ *
+ * Returns NULL if there is no memory for one; that thread's counts are
+ * then dropped.
+ *
+ **************************************************************************
+ */
+static ThreadMetrics *
+MetricsSelf(void)
+{
+    ThreadMetrics *m;
+
+    if (myMetrics != NULL) {
+        return myMetrics;
+    }
+
+    pthread_once(&metricsOnce, MetricsInit);
+    pthread_mutex_lock(&metricsLock);
+    for (m = metricsHead; m != NULL; m = m->next) {
+        if (!m->inUse) {
+            break;
+        }
+    }
+    if (m == NULL) {
+        m = aligned_alloc(METRICS_ALIGN, sizeof *m);
+        if (m != NULL) {
+            memset(m, 0, sizeof *m);
+            m->next = metricsHead;
+            __atomic_store_n(&metricsHead, m, __ATOMIC_RELEASE);
+        }
+    }
+    if (m != NULL) {
+        m->inUse = true;
+    }
+    pthread_mutex_unlock(&metricsLock);
+
+    if (m != NULL) {
+        pthread_setspecific(metricsKey, m);
+        myMetrics = m;
+    }
+    return m;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Record a time in a histogram.
+ *
+ **************************************************************************
+ */
+static void
+MetricsRecord(MetricsHist *h, long long ns)
+{
+    int idx = 0;
+
+    if (ns < 0) {
+        ns = 0;
+    }
+    if (ns > 1000) {
+        idx = 64 - __builtin_clzll((unsigned long long)(ns - 1) / 1000);
+        if (idx > METRICS_BUCKETS - 1) {
+            idx = METRICS_BUCKETS - 1;
+        }
+    }
+    METRICS_ADD(h->buckets[idx], 1);
+    METRICS_ADD(h->sumNs, ns);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Count a connection accepted.
+ *
+ **************************************************************************
+ */
+void
+metrics_accepted(void)
+{
+    ThreadMetrics *m = MetricsSelf();
+
+    if (m != NULL) {
+        METRICS_ADD(m->c.accepted, 1);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Count an accepted connection closed.
+ *
+ **************************************************************************
+ */
+void
+metrics_closed(void)
+{
+    ThreadMetrics *m = MetricsSelf();
+
+    if (m != NULL) {
+        METRICS_ADD(m->c.closed, 1);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Count a file cache lookup, as a hit if it needed no file system
+ *        access.
+ *
+ **************************************************************************
+ */
+void
+metrics_cache_lookup(bool hit)
+{
+    ThreadMetrics *m = MetricsSelf();
+
+    if (m != NULL) {
+        METRICS_ADD(*(hit ? &m->c.cacheHits : &m->c.cacheMisses), 1);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Record the time a request spent in one of its phases.
+ *
+ **************************************************************************
+ */
+void
+metrics_phase(MetricsPhase phase, long long ns)
+{
+    ThreadMetrics *m = MetricsSelf();
+
+    if (m != NULL) {
+        MetricsRecord(&m->c.phases[phase], ns);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Count a response once it is done with, and the time its
+ *        request took overall.
+ *
+ **************************************************************************
+ */
+void
+metrics_response(int status,        // IN
+                 long long bytes,   // IN: sent, header included
+                 long long ns)      // IN
+{
+    ThreadMetrics *m = MetricsSelf();
+    int idx = 0;
+
+    if (m == NULL) {
+        return;
+    }
+    if (status >= 0 && status < ARRAYSIZE(statusIndex)) {
+        idx = statusIndex[status];
+    }
+    METRICS_ADD(m->c.responses[idx], 1);
+    METRICS_ADD(m->c.bytesSent, bytes);
+    MetricsRecord(&m->c.requests, ns);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Render a histogram, with cumulative buckets.
+ *
+ **************************************************************************
+ */
+static void
+MetricsPrintHist(FILE *f, const char *name, const char *labels,
+                 const MetricsHist *h)
+{
+    const char *sep = labels[0] != '\0' ? "," : "";
+    uint64_t cumulative = 0;
+    int i;
+
+    for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+        cumulative += h->buckets[i];
+        fprintf(f, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels, sep,
+                (1000ULL << i) / 1e9, (unsigned long long)cumulative);
+    }
+    /* And the count, from the same loads, for the two to agree. */
+    cumulative += h->buckets[i];
+    fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+            (unsigned long long)cumulative);
+    if (labels[0] != '\0') {
+        fprintf(f, "%s_sum{%s} %.9f\n%s_count{%s} %llu\n", name, labels,
+                h->sumNs / 1e9, name, labels, (unsigned long long)cumulative);
+    } else {
+        fprintf(f, "%s_sum %.9f\n%s_count %llu\n", name, h->sumNs / 1e9,
+                name, (unsigned long long)cumulative);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Render the metrics in the Prometheus text format.
+ *
+ * The counters of all the threads are summed up here, at scrape time,
+ * so that counting costs each request no more than adding to its own
+ * thread's counters. A thread adding to them meanwhile may be counted
+ * in some of the sums and not yet in others.
+ *
+ * Returns the text, to be freed by the caller, or NULL if out of memory.
+ *
+ **************************************************************************
+ */
+char *
+metrics_render(size_t *len)   // OUT
+{
+    MetricsCounters sum;
+    const ThreadMetrics *m;
+    uint64_t *dst = (uint64_t *)&sum;
+    uint64_t lookups;
+    char labels[32];
+    char *text;
+    FILE *f;
+    int i;
+
+    pthread_once(&metricsOnce, MetricsInit);
+    memset(&sum, 0, sizeof sum);
+    for (m = __atomic_load_n(&metricsHead, __ATOMIC_ACQUIRE); m != NULL;
+         m = m->next) {
+        const uint64_t *src = (const uint64_t *)&m->c;
+        for (i = 0; i < sizeof sum / sizeof *dst; i++) {
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    f = open_memstream(&text, len);
+    if (f == NULL) {
+        return NULL;
+    }
+    fprintf(f, "# HELP httpd_connections_accepted_total "
+            "Connections accepted.\n"
+            "# TYPE httpd_connections_accepted_total counter\n"
+            "httpd_connections_accepted_total %llu\n",
+            (unsigned long long)sum.accepted);
+    fprintf(f, "# HELP httpd_connections_active Connections open.\n"
+            "# TYPE httpd_connections_active gauge\n"
+            "httpd_connections_active %lld\n",
+            (long long)(sum.accepted - sum.closed));
+
+    fprintf(f, "# HELP httpd_responses_total Responses, by status.\n"
+            "# TYPE httpd_responses_total counter\n");
+    for (i = 1; i < METRICS_STATUSES && statusCodes[i] != 0; i++) {
+        fprintf(f, "httpd_responses_total{code=\"%d\"} %llu\n",
+                statusCodes[i], (unsigned long long)sum.responses[i]);
+    }
+    if (sum.responses[0] != 0) {
+        fprintf(f, "httpd_responses_total{code=\"other\"} %llu\n",
+                (unsigned long long)sum.responses[0]);
+    }
+    fprintf(f, "# HELP httpd_sent_bytes_total "
+            "Response bytes sent, headers included.\n"
+            "# TYPE httpd_sent_bytes_total counter\n"
+            "httpd_sent_bytes_total %llu\n",
+            (unsigned long long)sum.bytesSent);
+
+    lookups = sum.cacheHits + sum.cacheMisses;
+    fprintf(f, "# HELP httpd_filecache_lookups_total "
+            "File cache lookups, by whether the file system was spared.\n"
+            "# TYPE httpd_filecache_lookups_total counter\n"
+            "httpd_filecache_lookups_total{result=\"hit\"} %llu\n"
+            "httpd_filecache_lookups_total{result=\"miss\"} %llu\n",
+            (unsigned long long)sum.cacheHits,
+            (unsigned long long)sum.cacheMisses);
+    fprintf(f, "# HELP httpd_filecache_hit_ratio "
+            "File cache hits over lookups, since the start.\n"
+            "# TYPE httpd_filecache_hit_ratio gauge\n"
+            "httpd_filecache_hit_ratio %g\n",
+            lookups > 0 ? (double)sum.cacheHits / lookups : 0.0);
+
+    fprintf(f, "# HELP httpd_request_duration_seconds "
+            "Time from the first byte of a request to the end of its "
+            "response.\n"
+            "# TYPE httpd_request_duration_seconds histogram\n");
+    MetricsPrintHist(f, "httpd_request_duration_seconds", "",
+                     &sum.requests);
+    fprintf(f, "# HELP httpd_request_phase_seconds "
+            "Time spent in each phase of a request.\n"
+            "# TYPE httpd_request_phase_seconds histogram\n");
+    for (i = 0; i < METRICS_PHASES; i++) {
+        snprintf(labels, sizeof labels, "phase=\"%s\"", phaseNames[i]);
+        MetricsPrintHist(f, "httpd_request_phase_seconds", labels,
+                         &sum.phases[i]);
+    }
+
+    fprintf(f, "# HELP httpd_log_dropped_total "
+            "Log messages dropped for a full buffer.\n"
+            "# TYPE httpd_log_dropped_total counter\n"
+            "httpd_log_dropped_total %lu\n", LogDropped());
+
+    if (fclose(f) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
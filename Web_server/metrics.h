@@ -0,0 +1,28 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define METRICS_URL        "/__metrics"   /* reserved, served the metrics */
+#define METRICS_STATUSES   32     /* response statuses counted apart */
+#define METRICS_BUCKETS    24     /* 1us, 2us, 4us ... 4.2s, and +Inf */
+
+/**
+ * The phases of a request, timed apart.
+ */
+typedef enum MetricsPhase {
+    METRICS_RECEIVE,     /* from its first byte to the end of its header */
+    METRICS_PREPARE,     /* routing, file lookup and response header */
+    METRICS_SEND,        /* until the whole response is sent */
+    METRICS_PHASES,
+} MetricsPhase;
+
+void metrics_accepted(void);
+void metrics_closed(void);
+void metrics_cache_lookup(bool hit);
+void metrics_phase(MetricsPhase phase, long long ns);
+void metrics_response(int status, long long bytes, long long ns);
+char *metrics_render(size_t *len);
+
+#endif
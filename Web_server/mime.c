@@ -0,0 +1,514 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+#include "common.h"
+#include "mime.h"
+
+#define MIME_MAX_SEED       (1 << 16)   /* seeds tried per bucket */
+#define MIME_MAX_POLICY     256
+
+/**
+ * The types used when no mime.types file can be read.
+ */
+static const char builtinTypes[] =
+    "text/html                 html htm\n"
+    "text/plain                txt text\n"
+    "text/css                  css\n"
+    "text/javascript           js mjs\n"
+    "application/json          json\n"
+    "application/xml           xml\n"
+    "image/svg+xml             svg\n"
+    "image/jpeg                jpg jpeg\n"
+    "image/gif                 gif\n"
+    "image/png                 png\n"
+    "image/webp                webp\n"
+    "image/x-icon              ico\n"
+    "font/woff2                woff2\n"
+    "application/pdf           pdf\n";
+
+/**
+ * A registered file extension.
+ */
+typedef struct MimeExt {
+    char           *ext;       /* lowercase, without the dot */
+    const MimeType *type;
+    int             order;     /* registration order; the last one wins */
+    unsigned        bucket;
+} MimeExt;
+
+/**
+ * The extension registry, compiled into a perfect hash.
+ *
+ * An extension is hashed to one of "numBuckets" buckets, and then with
+ * its bucket's seed to a slot of the table. The seeds are searched for
+ * when the registry is built, largest bucket first, so that every
+ * extension gets a slot of its own: a lookup costs two hashes and a
+ * single comparison, whether the extension is known or not.
+ */
+typedef struct MimeRegistry {
+    MimeType  **types;
+    int         numTypes;
+    MimeExt    *slots;         /* "ext" is NULL in a free slot */
+    unsigned    numSlots;
+    unsigned   *seeds;
+    unsigned    numBuckets;
+} MimeRegistry;
+
+static MimeRegistry registry;
+
+static const MimeType defaultType = {
+    "application/octet-stream", false, NULL
+};
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Hash an extension case-insensitively, with the given seed.
+ *
+ **************************************************************************
+ */
+static unsigned
+HashExt(const char *ext, unsigned seed)
+{
+    unsigned hash = 2166136261u ^ (seed * 0x9e3779b9u);
+
+    while (*ext != '\0') {
+        hash ^= (unsigned char)tolower((unsigned char)*ext++);
+        hash *= 16777619u;
+    }
+    /* FNV-1a mixes poorly into the low bits; finish as in MurmurHash3. */
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Tell whether a type is worth compressing, by default.
+ *
+ **************************************************************************
+ */
+static bool
+DefaultCompress(const char *type)
+{
+    const char *plus = strrchr(type, '+');
+
+    return strncmp(type, "text/", 5) == 0 ||
+           strcmp(type, "application/javascript") == 0 ||
+           strcmp(type, "application/json") == 0 ||
+           strcmp(type, "application/xml") == 0 ||
+           (plus != NULL && (strcmp(plus, "+xml") == 0 ||
+                             strcmp(plus, "+json") == 0));
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Apply the policy words that follow the ";" of a line.
+ *
+ * "compress" and "identity" override whether the type is compressed;
+ * Cache-Control directives ("max-age=N", "no-cache", "no-store",
+ * "public", "private", "immutable") are sent with every file of the
+ * type.
+ *
+ * Returns false if a word is not understood.
+ *
+ **************************************************************************
+ */
+static bool
+ParsePolicy(char *policy, MimeType *type)
+{
+    char cacheControl[MIME_MAX_POLICY] = "";
+    char *word;
+    char *save;
+
+    for (word = strtok_r(policy, " \t\r\n", &save); word != NULL;
+         word = strtok_r(NULL, " \t\r\n", &save)) {
+        char *end;
+
+        if (strcmp(word, "compress") == 0) {
+            type->compress = true;
+            continue;
+        } else if (strcmp(word, "identity") == 0) {
+            type->compress = false;
+            continue;
+        } else if (strncmp(word, "max-age=", 8) == 0) {
+            if (strtol(word + 8, &end, 10) < 0 || end == word + 8 ||
+                *end != '\0') {
+                return false;
+            }
+        } else if (strcmp(word, "no-cache") != 0 &&
+                   strcmp(word, "no-store") != 0 &&
+                   strcmp(word, "public") != 0 &&
+                   strcmp(word, "private") != 0 &&
+                   strcmp(word, "immutable") != 0) {
+            return false;
+        }
+        if (strlen(cacheControl) + strlen(word) + 3 > sizeof cacheControl) {
+            return false;
+        }
+        if (cacheControl[0] != '\0') {
+            strcat(cacheControl, ", ");
+        }
+        strcat(cacheControl, word);
+    }
+
+    if (cacheControl[0] != '\0') {
+        type->cacheControl = strdup(cacheControl);
+        if (type->cacheControl == NULL) {
+            perror("Failed to allocate a MIME type");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return true;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Add the type and extensions of a mime.types line.
+ *
+ * A line is a type followed by its extensions, optionally followed by
+ * ";" and policy words, e.g. "text/css css ; compress max-age=86400".
+ * Blank lines and "#" comments are skipped.
+ *
+ **************************************************************************
+ */
+static void
+ParseLine(char *line, const char *source, int lineNo,
+          MimeExt **exts, int *numExts)
+{
+    MimeType *type;
+    char *policy;
+    char *word;
+    char *save;
+
+    line[strcspn(line, "#")] = '\0';
+    policy = strchr(line, ';');
+    if (policy != NULL) {
+        *policy++ = '\0';
+    }
+    word = strtok_r(line, " \t\r\n", &save);
+    if (word == NULL) {
+        return;
+    }
+
+    type = calloc(1, sizeof *type);
+    registry.types = realloc(registry.types,
+                             (registry.numTypes + 1) * sizeof *registry.types);
+    if (type == NULL || registry.types == NULL ||
+        (type->type = strdup(word)) == NULL) {
+        perror("Failed to allocate a MIME type");
+        exit(EXIT_FAILURE);
+    }
+    registry.types[registry.numTypes++] = type;
+    type->compress = DefaultCompress(type->type);
+    if (strchr(type->type, '/') == NULL ||
+        (policy != NULL && !ParsePolicy(policy, type))) {
+        Error("%s:%d: Invalid MIME type line, skipped\n", source, lineNo);
+        return;
+    }
+
+    while ((word = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        MimeExt *ext;
+        char *p;
+
+        *exts = realloc(*exts, (*numExts + 1) * sizeof **exts);
+        if (*exts == NULL) {
+            perror("Failed to allocate a MIME extension");
+            exit(EXIT_FAILURE);
+        }
+        ext = &(*exts)[*numExts];
+        ext->ext   = strdup(word);
+        ext->type  = type;
+        ext->order = (*numExts)++;
+        if (ext->ext == NULL) {
+            perror("Failed to allocate a MIME extension");
+            exit(EXIT_FAILURE);
+        }
+        for (p = ext->ext; *p != '\0'; p++) {
+            *p = tolower((unsigned char)*p);
+        }
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Order extensions by name, and then by registration order.
+ *
+ **************************************************************************
+ */
+static int
+CompareExtName(const void *a, const void *b)
+{
+    const MimeExt *x = a;
+    const MimeExt *y = b;
+    int cmp = strcmp(x->ext, y->ext);
+
+    return cmp != 0 ? cmp : x->order - y->order;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Order extensions by the size of their bucket, largest first.
+ *
+ **************************************************************************
+ */
+static int
+CompareExtBucket(const void *a, const void *b, void *arg)
+{
+    const MimeExt *x = a;
+    const MimeExt *y = b;
+    const int *sizes = arg;
+
+    if (sizes[x->bucket] != sizes[y->bucket]) {
+        return sizes[y->bucket] - sizes[x->bucket];
+    }
+    return (x->bucket > y->bucket) - (x->bucket < y->bucket);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Find a seed per bucket that puts each extension in a free slot.
+ *
+ * "exts" must be grouped by bucket, largest bucket first.
+ *
+ * Returns false if a bucket cannot be placed, so that the caller can
+ * try again with more slots.
+ *
+ **************************************************************************
+ */
+static bool
+PlaceBuckets(MimeExt *exts, int numExts, unsigned *tried)
+{
+    int start = 0;
+
+    while (start < numExts) {
+        unsigned bucket = exts[start].bucket;
+        unsigned seed;
+        int end = start;
+        int i;
+        int j;
+
+        while (end < numExts && exts[end].bucket == bucket) {
+            end++;
+        }
+        for (seed = 1; seed < MIME_MAX_SEED; seed++) {
+            for (i = start; i < end; i++) {
+                tried[i - start] = HashExt(exts[i].ext, seed) %
+                                   registry.numSlots;
+                if (registry.slots[tried[i - start]].ext != NULL) {
+                    break;
+                }
+                for (j = 0; j < i - start; j++) {
+                    if (tried[j] == tried[i - start]) {
+                        break;
+                    }
+                }
+                if (j < i - start) {
+                    break;
+                }
+            }
+            if (i == end) {
+                break;
+            }
+        }
+        if (seed == MIME_MAX_SEED) {
+            return false;
+        }
+
+        registry.seeds[bucket] = seed;
+        for (i = start; i < end; i++) {
+            registry.slots[tried[i - start]] = exts[i];
+        }
+        start = end;
+    }
+    return true;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Compile the registered extensions into the perfect hash.
+ *
+ * An extension registered more than once maps to its last type.
+ *
+ **************************************************************************
+ */
+static void
+BuildRegistry(MimeExt *exts, int numExts)
+{
+    unsigned *tried;
+    int *sizes;
+    int n = 0;
+    int i;
+
+    qsort(exts, numExts, sizeof *exts, CompareExtName);
+    for (i = 0; i < numExts; i++) {
+        if (i + 1 < numExts && strcmp(exts[i].ext, exts[i + 1].ext) == 0) {
+            free(exts[i].ext);
+        } else {
+            exts[n++] = exts[i];
+        }
+    }
+    numExts = n;
+
+    registry.numBuckets = numExts / 4 + 1;
+    registry.numSlots   = numExts + numExts / 4 + 1;
+    while (1) {
+        registry.seeds = calloc(registry.numBuckets, sizeof *registry.seeds);
+        registry.slots = calloc(registry.numSlots, sizeof *registry.slots);
+        sizes = calloc(registry.numBuckets, sizeof *sizes);
+        tried = calloc(numExts + 1, sizeof *tried);
+        if (registry.seeds == NULL || registry.slots == NULL ||
+            sizes == NULL || tried == NULL) {
+            perror("Failed to allocate the MIME registry");
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < numExts; i++) {
+            exts[i].bucket = HashExt(exts[i].ext, 0) % registry.numBuckets;
+            sizes[exts[i].bucket]++;
+        }
+        qsort_r(exts, numExts, sizeof *exts, CompareExtBucket, sizes);
+        if (PlaceBuckets(exts, numExts, tried)) {
+            break;
+        }
+
+        free(registry.seeds);
+        free(registry.slots);
+        free(sizes);
+        free(tried);
+        registry.numSlots *= 2;
+    }
+    free(sizes);
+    free(tried);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Load the MIME types from a mime.types file, or the built-in
+ *        ones if "path" is NULL.
+ *
+ * Must be called once, before any lookup.
+ *
+ * Returns false if the file cannot be read.
+ *
+ **************************************************************************
+ */
+bool
+mime_load(const char *path)
+{
+    MimeExt *exts = NULL;
+    int numExts = 0;
+    int lineNo = 0;
+
+    if (path != NULL) {
+        FILE *fp = fopen(path, "r");
+        char *line = NULL;
+        size_t cap = 0;
+
+        if (fp == NULL) {
+            return false;
+        }
+        while (getline(&line, &cap, fp) >= 0) {
+            ParseLine(line, path, ++lineNo, &exts, &numExts);
+        }
+        free(line);
+        fclose(fp);
+    } else {
+        char *types = strdup(builtinTypes);
+        char *line;
+        char *save;
+
+        if (types == NULL) {
+            perror("Failed to allocate the MIME types");
+            exit(EXIT_FAILURE);
+        }
+        for (line = strtok_r(types, "\n", &save); line != NULL;
+             line = strtok_r(NULL, "\n", &save)) {
+            ParseLine(line, "built-in", ++lineNo, &exts, &numExts);
+        }
+        free(types);
+    }
+
+    BuildRegistry(exts, numExts);
+    free(exts);
+    Log("mime: %d types, %u slots, %u buckets from %s\n",
+        registry.numTypes, registry.numSlots, registry.numBuckets,
+        path != NULL ? path : "built-in table");
+    return true;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Find an extension in the registry.
+ *
+ **************************************************************************
+ */
+static const MimeType *
+FindExt(const char *ext)
+{
+    unsigned bucket = HashExt(ext, 0) % registry.numBuckets;
+    unsigned seed = registry.seeds[bucket];
+    const MimeExt *slot = &registry.slots[HashExt(ext, seed) %
+                                          registry.numSlots];
+
+    if (slot->ext == NULL || strcasecmp(slot->ext, ext) != 0) {
+        return NULL;
+    }
+    return slot->type;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the MIME type of a file by its extension.
+ *
+ * Extensions are matched regardless of case, and the longest registered
+ * one wins, so that "a.tar.gz" can be told apart from "a.gz". A file
+ * with no registered extension is "application/octet-stream".
+ *
+ **************************************************************************
+ */
+const MimeType *
+mime_lookup(const char *fname)
+{
+    const char *base = strrchr(fname, '/');
+    const char *ext;
+
+    if (registry.numSlots == 0) {
+        return &defaultType;
+    }
+    base = base != NULL ? base + 1 : fname;
+    for (ext = strchr(base, '.'); ext != NULL; ext = strchr(ext + 1, '.')) {
+        const MimeType *type = FindExt(ext + 1);
+        if (type != NULL) {
+            return type;
+        }
+    }
+    return &defaultType;
+}
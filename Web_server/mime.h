@@ -0,0 +1,20 @@
+#ifndef _MIME_H_
+#define _MIME_H_
+
+#include <stdbool.h>
+
+#define DEFAULT_MIME_TYPES   "/etc/mime.types"
+
+/**
+ * A MIME type, and the policies for serving files of that type.
+ */
+typedef struct MimeType {
+    char *type;
+    bool  compress;        /* worth sending content-encoded */
+    char *cacheControl;    /* Cache-Control value, or NULL */
+} MimeType;
+
+bool mime_load(const char *path);
+const MimeType *mime_lookup(const char *fname);
+
+#endif
@@ -0,0 +1,570 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "pack.h"
+
+#define PACK_COPY_SIZE   (64 * 1024)
+
+/**
+ * The content codings of FileEntry.variant[], in order.
+ */
+static const unsigned packCodings[FILECACHE_ENCODINGS] = {
+    HTTP_ENCODING_BR, HTTP_ENCODING_GZIP,
+};
+
+/**
+ * A pack file being written.
+ */
+typedef struct PackWriter {
+    int          fd;
+    off_t        off;          /* end of the bodies written */
+    PackRecord  *files;
+    int          numFiles;
+    PackRecord  *variants;
+    int          numVariants;
+    char        *strings;
+    size_t       stringsLen;
+    size_t       stringsCap;
+} PackWriter;
+
+/**
+ * The files found under the htdoc directory being packed.
+ */
+static char **walkNames;
+static int    numWalkNames;
+static int    walkRootLen;
+
+/**
+ * The pack being served, mapped into memory.
+ */
+static char       *packMap;
+static size_t      packSize;
+static FileEntry  *packEntries;     /* by record */
+static int         packFiles;
+static const char *packRoot;
+static int         packRootLen;
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Collect a regular file found under the htdoc directory.
+ *
+ **************************************************************************
+ */
+static int
+AddWalkName(const char *fpath, const struct stat *sb, int type,
+            struct FTW *ftw)
+{
+    if (type != FTW_F || !S_ISREG(sb->st_mode)) {
+        return 0;
+    }
+    walkNames = realloc(walkNames, (numWalkNames + 1) * sizeof *walkNames);
+    if (walkNames == NULL ||
+        (walkNames[numWalkNames] = strdup(fpath)) == NULL) {
+        perror("Failed to allocate a file name");
+        exit(EXIT_FAILURE);
+    }
+    numWalkNames++;
+    return 0;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Order file paths by the names that they are served as.
+ *
+ **************************************************************************
+ */
+static int
+CompareWalkNames(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a + walkRootLen,
+                  *(char * const *)b + walkRootLen);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Add a string to the pack, and get its offset into the strings.
+ *
+ * A NULL string gets offset 0, where the strings start with an empty
+ * one.
+ *
+ **************************************************************************
+ */
+static uint64_t
+AddString(PackWriter *w, const char *str)
+{
+    size_t len;
+    uint64_t off;
+
+    if (str == NULL) {
+        return 0;
+    }
+    len = strlen(str) + 1;
+    while (w->stringsLen + len > w->stringsCap) {
+        w->stringsCap = w->stringsCap * 2 + PACK_COPY_SIZE;
+        w->strings = realloc(w->strings, w->stringsCap);
+        if (w->strings == NULL) {
+            perror("Failed to allocate the pack strings");
+            exit(EXIT_FAILURE);
+        }
+    }
+    off = w->stringsLen;
+    memcpy(w->strings + off, str, len);
+    w->stringsLen += len;
+    return off;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Write all of a buffer at an offset of the pack file.
+ *
+ **************************************************************************
+ */
+static bool
+WriteAt(int fd, const void *buf, size_t len, off_t off)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, off);
+        if (n < 0) {
+            return false;
+        }
+        p   += n;
+        len -= n;
+        off += n;
+    }
+    return true;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Write a body to the pack, page-aligned after the last one.
+ *
+ * Returns the offset of the body, or -1 on error.
+ *
+ **************************************************************************
+ */
+static off_t
+WriteBody(PackWriter *w, const FileEntry *entry)
+{
+    off_t start = (w->off + PACK_ALIGN - 1) & ~(off_t)(PACK_ALIGN - 1);
+    off_t done = 0;
+    char *buf;
+
+    if (entry->data != NULL) {
+        if (!WriteAt(w->fd, entry->data, entry->size, start)) {
+            return -1;
+        }
+        w->off = start + entry->size;
+        return start;
+    }
+
+    buf = malloc(PACK_COPY_SIZE);
+    if (buf == NULL) {
+        return -1;
+    }
+    while (done < entry->size) {
+        ssize_t n = pread(entry->fd, buf, PACK_COPY_SIZE, done);
+        if (n <= 0 || !WriteAt(w->fd, buf, n, start + done)) {
+            free(buf);
+            return -1;
+        }
+        done += n;
+    }
+    free(buf);
+    w->off = start + done;
+    return start;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Write a cache entry's body to the pack, and record it.
+ *
+ **************************************************************************
+ */
+static bool
+RecordEntry(PackWriter *w, PackRecord *rec, const FileEntry *entry,
+            const char *name)
+{
+    off_t dataOff = WriteBody(w, entry);
+    int i;
+    int k;
+
+    if (dataOff < 0) {
+        return false;
+    }
+    memset(rec, 0, sizeof *rec);
+    rec->dataOff         = dataOff;
+    rec->size            = entry->size;
+    rec->mtimeSec        = entry->mtime.tv_sec;
+    rec->mtimeNsec       = entry->mtime.tv_nsec;
+    rec->nameOff         = AddString(w, name);
+    rec->mimeOff         = AddString(w, entry->mime);
+    rec->encodingOff     = AddString(w, entry->encoding);
+    rec->cacheControlOff = AddString(w, entry->cacheControl);
+    rec->compressible    = entry->compressible;
+    for (k = 0; k < 2; k++) {
+        rec->headerOff[k] = AddString(w, entry->header[k]);
+        rec->headerLen[k] = entry->headerLen[k];
+    }
+    for (i = 0; i < FILECACHE_ENCODINGS; i++) {
+        rec->variant[i] = -1;
+    }
+    strcpy(rec->etag, entry->etag);
+    strcpy(rec->lastModified, entry->lastModified);
+    return true;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Pack a file and its content-encoded variants.
+ *
+ * The file is loaded through the file cache, so that the pack holds the
+ * header templates, validators and variants that it would have served.
+ * The variants are numbered among themselves until all the files are
+ * packed.
+ *
+ **************************************************************************
+ */
+static bool
+PackFile(PackWriter *w, const char *path, const char *name)
+{
+    FileEntry *entry = filecache_get(path);
+    PackRecord *rec;
+    int i;
+
+    if (entry == NULL) {
+        Error("pack: Failed to load %s, skipped\n", path);
+        return true;
+    }
+    w->files = realloc(w->files, (w->numFiles + 1) * sizeof *w->files);
+    if (w->files == NULL) {
+        perror("Failed to allocate a pack record");
+        exit(EXIT_FAILURE);
+    }
+    rec = &w->files[w->numFiles];
+    if (!RecordEntry(w, rec, entry, name)) {
+        filecache_put(entry);
+        return false;
+    }
+    w->numFiles++;
+
+    for (i = 0; i < FILECACHE_ENCODINGS; i++) {
+        FileEntry *variant = filecache_get_variant(entry, packCodings[i]);
+        bool ok;
+
+        if (variant == NULL) {
+            continue;
+        }
+        w->variants = realloc(w->variants,
+                              (w->numVariants + 1) * sizeof *w->variants);
+        if (w->variants == NULL) {
+            perror("Failed to allocate a pack record");
+            exit(EXIT_FAILURE);
+        }
+        ok = RecordEntry(w, &w->variants[w->numVariants], variant, name);
+        filecache_put(variant);
+        if (!ok) {
+            filecache_put(entry);
+            return false;
+        }
+        w->files[w->numFiles - 1].variant[i] = w->numVariants++;
+    }
+    filecache_put(entry);
+    return true;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Pack an htdoc directory into a pack file.
+ *
+ * Every regular file under "htdoc" is packed under the name that a URL
+ * maps it to, such as "/img/a.jpg", with the br and gzip variants that
+ * the file cache would make for it. The file cache must be initialized,
+ * and enabled for gzip variants to be made.
+ *
+ * Returns false on error.
+ *
+ **************************************************************************
+ */
+bool
+pack_build(const char *htdoc,    // IN
+           const char *path)     // IN
+{
+    PackWriter w;
+    PackHeader hdr;
+    bool ok = true;
+    int i;
+
+    memset(&w, 0, sizeof w);
+    walkRootLen = strlen(htdoc);
+    while (walkRootLen > 1 && htdoc[walkRootLen - 1] == '/') {
+        walkRootLen--;
+    }
+    if (nftw(htdoc, AddWalkName, 16, 0) < 0) {
+        return false;
+    }
+    qsort(walkNames, numWalkNames, sizeof *walkNames, CompareWalkNames);
+
+    w.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w.fd < 0) {
+        return false;
+    }
+    w.off = sizeof hdr;
+    AddString(&w, "");
+    for (i = 0; i < numWalkNames && ok; i++) {
+        ok = PackFile(&w, walkNames[i], walkNames[i] + walkRootLen);
+    }
+
+    /* The variants follow the files, renumbered to match. */
+    for (i = 0; i < w.numFiles; i++) {
+        int j;
+        for (j = 0; j < FILECACHE_ENCODINGS; j++) {
+            if (w.files[i].variant[j] >= 0) {
+                w.files[i].variant[j] += w.numFiles;
+            }
+        }
+    }
+    memset(&hdr, 0, sizeof hdr);
+    memcpy(hdr.magic, PACK_MAGIC, sizeof hdr.magic);
+    hdr.version    = PACK_VERSION;
+    hdr.recordSize = sizeof (PackRecord);
+    hdr.numFiles   = w.numFiles;
+    hdr.numRecords = w.numFiles + w.numVariants;
+    hdr.recordsOff = (w.off + 7) & ~(off_t)7;
+    hdr.stringsOff = hdr.recordsOff + hdr.numRecords * sizeof (PackRecord);
+    hdr.stringsLen = w.stringsLen;
+    ok = ok &&
+         WriteAt(w.fd, w.files, w.numFiles * sizeof (PackRecord),
+                 hdr.recordsOff) &&
+         WriteAt(w.fd, w.variants, w.numVariants * sizeof (PackRecord),
+                 hdr.recordsOff + w.numFiles * sizeof (PackRecord)) &&
+         WriteAt(w.fd, w.strings, w.stringsLen, hdr.stringsOff) &&
+         WriteAt(w.fd, &hdr, sizeof hdr, 0);
+    if (close(w.fd) < 0) {
+        ok = false;
+    }
+
+    if (ok) {
+        Log("pack: %d files, %d variants, %lld bytes in %s\n", w.numFiles,
+            w.numVariants, (long long)(hdr.stringsOff + hdr.stringsLen),
+            path);
+    }
+    for (i = 0; i < numWalkNames; i++) {
+        free(walkNames[i]);
+    }
+    free(walkNames);
+    free(w.files);
+    free(w.variants);
+    free(w.strings);
+    return ok;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get a string of the pack being opened, or NULL if it is invalid.
+ *
+ **************************************************************************
+ */
+static char *
+PackString(const PackHeader *hdr, uint64_t off)
+{
+    if (off >= hdr->stringsLen) {
+        return NULL;
+    }
+    return packMap + hdr->stringsOff + off;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Open a pack file, and serve the files under "path" from it.
+ *
+ * The pack is mapped into memory, and a file cache entry is set up for
+ * each record, pointing into it: the files are served from the mapping,
+ * without opening or checking anything, and never change or go away.
+ *
+ * Returns false if the pack cannot be read or is invalid.
+ *
+ **************************************************************************
+ */
+bool
+pack_open(const char *path)
+{
+    const PackHeader *hdr;
+    const PackRecord *recs;
+    struct stat st;
+    int fd;
+    uint32_t i;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < sizeof *hdr) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    packSize = st.st_size;
+    packMap  = mmap(NULL, packSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (packMap == MAP_FAILED) {
+        packMap = NULL;
+        return false;
+    }
+
+    hdr  = (const PackHeader *)packMap;
+    recs = (const PackRecord *)(packMap + hdr->recordsOff);
+    if (memcmp(hdr->magic, PACK_MAGIC, sizeof hdr->magic) != 0 ||
+        hdr->version != PACK_VERSION ||
+        hdr->recordSize != sizeof (PackRecord) ||
+        hdr->numFiles > hdr->numRecords ||
+        hdr->recordsOff % 8 != 0 ||
+        hdr->recordsOff + (uint64_t)hdr->numRecords * sizeof *recs >
+            hdr->stringsOff ||
+        hdr->stringsLen == 0 ||
+        hdr->stringsOff + hdr->stringsLen != packSize ||
+        packMap[packSize - 1] != '\0') {
+        goto invalid;
+    }
+
+    packEntries = calloc(hdr->numRecords, sizeof *packEntries);
+    if (packEntries == NULL) {
+        perror("Failed to allocate the pack entries");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < hdr->numRecords; i++) {
+        const PackRecord *rec = &recs[i];
+        FileEntry *entry = &packEntries[i];
+        int k;
+
+        if (rec->dataOff > hdr->recordsOff ||
+            rec->size > hdr->recordsOff - rec->dataOff ||
+            (entry->name = PackString(hdr, rec->nameOff)) == NULL ||
+            (entry->mime = PackString(hdr, rec->mimeOff)) == NULL ||
+            PackString(hdr, rec->encodingOff) == NULL ||
+            PackString(hdr, rec->cacheControlOff) == NULL ||
+            memchr(rec->etag, '\0', sizeof rec->etag) == NULL ||
+            memchr(rec->lastModified, '\0',
+                   sizeof rec->lastModified) == NULL) {
+            goto invalid;
+        }
+        entry->path          = entry->name;
+        entry->fd            = -1;
+        entry->data          = packMap + rec->dataOff;
+        entry->size          = rec->size;
+        entry->mtime.tv_sec  = rec->mtimeSec;
+        entry->mtime.tv_nsec = rec->mtimeNsec;
+        entry->encoding      = rec->encodingOff != 0 ?
+                               PackString(hdr, rec->encodingOff) : NULL;
+        entry->cacheControl  = rec->cacheControlOff != 0 ?
+                               PackString(hdr, rec->cacheControlOff) : NULL;
+        entry->compressible  = rec->compressible;
+        entry->refCount      = 1;
+        entry->packed        = true;
+        strcpy(entry->etag, rec->etag);
+        strcpy(entry->lastModified, rec->lastModified);
+        for (k = 0; k < 2; k++) {
+            entry->header[k] = PackString(hdr, rec->headerOff[k]);
+            if (entry->header[k] == NULL ||
+                rec->headerLen[k] != strlen(entry->header[k])) {
+                goto invalid;
+            }
+            entry->headerLen[k] = rec->headerLen[k];
+        }
+        for (k = 0; k < FILECACHE_ENCODINGS; k++) {
+            int32_t v = rec->variant[k];
+            if (v >= 0 && (i >= hdr->numFiles || v < hdr->numFiles ||
+                           v >= hdr->numRecords)) {
+                goto invalid;
+            }
+            entry->variant[k] = v >= 0 ? &packEntries[v] : NULL;
+        }
+    }
+
+    packFiles   = hdr->numFiles;
+    packRoot    = path;
+    packRootLen = strlen(path);
+    Log("pack: %d files, %d variants from %s\n", packFiles,
+        hdr->numRecords - packFiles, path);
+    return true;
+
+invalid:
+    free(packEntries);
+    packEntries = NULL;
+    munmap(packMap, packSize);
+    packMap = NULL;
+    errno = EINVAL;
+    return false;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Look up a file path in the pack being served.
+ *
+ * Returns false if the path is not under the pack, which is not being
+ * served then. Otherwise, returns true with the packed file's entry, or
+ * NULL if it is not in the pack. Packed entries are not reference
+ * counted, as they last as long as the server.
+ *
+ **************************************************************************
+ */
+bool
+pack_lookup(const char *fname,     // IN
+            FileEntry **entry)     // OUT
+{
+    const char *name = fname + packRootLen;
+    int lo = 0;
+    int hi = packFiles - 1;
+
+    if (packEntries == NULL || strncmp(fname, packRoot, packRootLen) != 0 ||
+        *name != '/') {
+        return false;
+    }
+    *entry = NULL;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(name, packEntries[mid].name);
+
+        if (cmp == 0) {
+            *entry = &packEntries[mid];
+            break;
+        }
+        if (cmp > 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return true;
+}
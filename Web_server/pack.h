@@ -0,0 +1,61 @@
+#ifndef _PACK_H_
+#define _PACK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "httpd.h"
+#include "filecache.h"
+
+#define PACK_MAGIC      "207PACK\0"
+#define PACK_VERSION    1
+#define PACK_ALIGN      4096      /* of the file bodies */
+
+/**
+ * The header at the start of a pack file.
+ *
+ * The bodies follow it, each page-aligned, and then the records and the
+ * strings that they point to. The first "numFiles" records are the
+ * files, sorted by name; the content-encoded variants come after them.
+ * Offsets are from the start of the pack file, which is only readable
+ * on the architecture that wrote it.
+ */
+typedef struct PackHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t recordSize;      /* sizeof (PackRecord) */
+    uint32_t numFiles;
+    uint32_t numRecords;
+    uint64_t recordsOff;
+    uint64_t stringsOff;
+    uint64_t stringsLen;
+} PackHeader;
+
+/**
+ * A packed file, or a content-encoded variant of one.
+ *
+ * The header templates are those a FileEntry of the file would have,
+ * rendered when the pack is built. String offsets of 0 are NULL.
+ */
+typedef struct PackRecord {
+    uint64_t dataOff;
+    uint64_t size;
+    int64_t  mtimeSec;
+    int64_t  mtimeNsec;
+    uint64_t nameOff;
+    uint64_t mimeOff;
+    uint64_t encodingOff;
+    uint64_t cacheControlOff;
+    uint64_t headerOff[2];
+    uint32_t headerLen[2];
+    int32_t  variant[FILECACHE_ENCODINGS];   /* record index, or -1 */
+    uint32_t compressible;
+    char     etag[FILECACHE_ETAG_LEN];
+    char     lastModified[HTTP_DATE_LEN + 1];
+} PackRecord;
+
+bool pack_build(const char *htdoc, const char *path);
+bool pack_open(const char *path);
+bool pack_lookup(const char *fname, FileEntry **entry);
+
+#endif
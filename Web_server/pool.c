@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "httpd.h"
+#include "metrics.h"
+
+#define POOL_REPORT_MS    10000  /* how often the pool stats are logged */
+#define POOL_FULL_WAIT_MS 100    /* how often a full pool checks draining */
+
+/**
+ * A worker's deque of accepted sockets.
+ *
+ * The acceptor pushes at the bottom; the owner pops from the bottom too,
+ * taking the newest connection whose data is most likely still hot, while
+ * idle workers steal the oldest one from the top. As pushes come from the
+ * acceptor rather than the owner, a lock-free owner-only deque does not
+ * apply, so each deque has its own lock: contention is limited to the
+ * acceptor, the owner and an occasional thief.
+ */
+typedef struct WorkDeque {
+    pthread_mutex_t lock;
+    int            *socks;     /* ring of "cap" sockets */
+    int             cap;
+    unsigned        top;       /* oldest */
+    unsigned        bottom;    /* one past the newest */
+} WorkDeque;
+
+/**
+ * A pool worker thread.
+ */
+typedef struct Worker {
+    int                id;
+    pthread_t          thread;
+    WorkDeque          deque;
+    unsigned           seed;       /* picks the first steal victim */
+    unsigned long long served;     /* connections served */
+    unsigned long long stolen;     /* of which taken from other deques */
+} Worker;
+
+/**
+ * The worker pool.
+ *
+ * "queued" counts the accepted connections not yet taken by a worker. The
+ * acceptor stops accepting while it is at "maxQueued", so excess clients
+ * wait in the kernel's listen backlog instead of costing a thread each.
+ */
+typedef struct WorkerPool {
+    Worker            *workers;
+    int                numWorkers;
+    pthread_mutex_t    lock;
+    pthread_cond_t     workCond;     /* signaled when a socket is queued */
+    pthread_cond_t     roomCond;     /* signaled when a socket is taken */
+    int                queued;
+    int                peakQueued;
+    int                maxQueued;
+    bool               running;
+    unsigned long long accepted;
+    unsigned long long stalls;       /* times the acceptor had to wait */
+} WorkerPool;
+
+static WorkerPool pool;
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Push an accepted socket at the bottom of a deque.
+ *
+ * Returns false if the deque is full.
+ *
+ **************************************************************************
+ */
+static bool
+DequePush(WorkDeque *dq, int sock)
+{
+    bool ok = false;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom - dq->top < dq->cap) {
+        dq->socks[dq->bottom++ % dq->cap] = sock;
+        ok = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Take a socket from the bottom (owner) or top (thief) of a deque.
+ *
+ * Returns the socket, or -1 if the deque is empty.
+ *
+ **************************************************************************
+ */
+static int
+DequeTake(WorkDeque *dq, bool fromTop)
+{
+    int sock = -1;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom != dq->top) {
+        sock = fromTop ? dq->socks[dq->top++ % dq->cap] :
+                         dq->socks[--dq->bottom % dq->cap];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return sock;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the next socket for a worker, stealing if its deque is empty.
+ *
+ * Blocks until a socket is queued somewhere. Returns -1 once the pool
+ * is stopped.
+ *
+ **************************************************************************
+ */
+static int
+PoolNextSocket(Worker *w)
+{
+    while (1) {
+        int sock = DequeTake(&w->deque, false);
+        int i;
+
+        if (sock < 0) {
+            int start = rand_r(&w->seed) % pool.numWorkers;
+            for (i = 0; i < pool.numWorkers && sock < 0; i++) {
+                Worker *victim = &pool.workers[(start + i) % pool.numWorkers];
+                if (victim != w) {
+                    sock = DequeTake(&victim->deque, true);
+                }
+            }
+            if (sock >= 0) {
+                __atomic_add_fetch(&w->stolen, 1, __ATOMIC_RELAXED);
+            }
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        if (sock >= 0) {
+            if (pool.queued-- == pool.maxQueued) {
+                pthread_cond_signal(&pool.roomCond);
+            }
+            pthread_mutex_unlock(&pool.lock);
+            return sock;
+        }
+        while (pool.queued == 0 && pool.running) {
+            pthread_cond_wait(&pool.workCond, &pool.lock);
+        }
+        if (pool.queued == 0) {
+            pthread_mutex_unlock(&pool.lock);
+            return -1;   /* stopped, and nothing left to serve */
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief The pool worker thread function.
+ *
+ **************************************************************************
+ */
+static void *
+PoolWorkerRun(void *arg)
+{
+    Worker *w = arg;
+    int sock;
+
+    Log("worker-%d: Starting\n", w->id);
+    while ((sock = PoolNextSocket(w)) >= 0) {
+        httpd_serve_connection(sock);
+        __atomic_add_fetch(&w->served, 1, __ATOMIC_RELAXED);
+    }
+    Log("worker-%d: Exiting\n", w->id);
+    return NULL;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Hand an accepted socket over to the workers.
+ *
+ * The deques are tried round-robin, so that stealing is only needed to
+ * even out connections that take longer than others.
+ *
+ **************************************************************************
+ */
+static void
+PoolSubmit(int sock)
+{
+    static int next;
+    int i;
+
+    /*
+     * Queue it under the pool lock, so that no worker can take it before
+     * it is counted. A deque holds as many sockets as the admission
+     * limit, so one always has room.
+     */
+    pthread_mutex_lock(&pool.lock);
+    for (i = 0; i < pool.numWorkers; i++) {
+        Worker *w = &pool.workers[next];
+        next = (next + 1) % pool.numWorkers;
+        if (DequePush(&w->deque, sock)) {
+            break;
+        }
+    }
+    pool.accepted++;
+    if (++pool.queued > pool.peakQueued) {
+        pool.peakQueued = pool.queued;
+    }
+    pthread_cond_signal(&pool.workCond);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Log the queue depth and the per-worker counters.
+ *
+ **************************************************************************
+ */
+static void
+PoolReport(void)
+{
+    int i;
+
+    pthread_mutex_lock(&pool.lock);
+    Log("pool: queued=%d peak=%d limit=%d accepted=%llu stalls=%llu\n",
+        pool.queued, pool.peakQueued, pool.maxQueued,
+        pool.accepted, pool.stalls);
+    pool.peakQueued = pool.queued;
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < pool.numWorkers; i++) {
+        Worker *w = &pool.workers[i];
+        Log("pool: worker-%d served=%llu stolen=%llu\n",
+            w->id, __atomic_load_n(&w->served, __ATOMIC_RELAXED),
+            __atomic_load_n(&w->stolen, __ATOMIC_RELAXED));
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Wait until the pool admits another connection.
+ *
+ * Periodically logs the pool stats while waiting, for room in the queue
+ * or for connections.
+ *
+ * Returns false once the server drains, or if the listen socket failed.
+ *
+ **************************************************************************
+ */
+static bool
+PoolAdmit(int msock, long long *nextReport)
+{
+    struct pollfd pfd[2];
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.queued >= pool.maxQueued) {
+        pool.stalls++;
+    }
+    while (pool.queued >= pool.maxQueued) {
+        long long now = NowMs();
+        long long wait = *nextReport - now;
+        struct timespec ts;
+
+        if (httpd_draining()) {
+            pthread_mutex_unlock(&pool.lock);
+            return false;
+        }
+        if (wait > POOL_FULL_WAIT_MS) {
+            wait = POOL_FULL_WAIT_MS;
+        } else if (wait <= 0) {
+            pthread_mutex_unlock(&pool.lock);
+            PoolReport();
+            *nextReport = now + POOL_REPORT_MS;
+            pthread_mutex_lock(&pool.lock);
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec  += wait / 1000;
+        ts.tv_nsec += (wait % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&pool.roomCond, &pool.lock, &ts);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    pfd[0].fd     = msock;
+    pfd[0].events = POLLIN;
+    pfd[1].fd     = httpd_drain_fd();
+    pfd[1].events = POLLIN;
+    while (1) {
+        long long now = NowMs();
+        int n;
+
+        if (now >= *nextReport) {
+            PoolReport();
+            *nextReport = now + POOL_REPORT_MS;
+        }
+        n = poll(pfd, 2, *nextReport - now);
+        if (n > 0) {
+            return pfd[1].revents == 0;
+        } else if (n < 0 && errno != EINTR) {
+            perror("Failed to wait for connections");
+            return false;
+        }
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief The pool engine: a fixed number of blocking worker threads.
+ *
+ * Accepted connections are spread over the workers' deques, and a worker
+ * with nothing to do steals from the others. Each worker serves one
+ * connection at a time, so a kept-alive connection holds its worker
+ * until it closes or times out. Once the server drains, the connections
+ * already accepted are still served.
+ *
+ **************************************************************************
+ */
+void
+PoolListenerLoop(int msock)
+{
+    long long nextReport = NowMs() + POOL_REPORT_MS;
+    pthread_condattr_t ca;
+    int i;
+
+    pool.numWorkers = svrArgs.numLoops;
+    pool.maxQueued  = svrArgs.maxQueued;
+    pool.running    = true;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.workCond, NULL);
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool.roomCond, &ca);
+    pthread_condattr_destroy(&ca);
+
+    pool.workers = calloc(pool.numWorkers, sizeof *pool.workers);
+    if (pool.workers == NULL) {
+        perror("Failed to allocate the worker pool");
+        return;
+    }
+    for (i = 0; i < pool.numWorkers; i++) {
+        Worker *w = &pool.workers[i];
+
+        w->id   = i;
+        w->seed = i + 1;
+        pthread_mutex_init(&w->deque.lock, NULL);
+        w->deque.cap   = pool.maxQueued;
+        w->deque.socks = calloc(pool.maxQueued, sizeof(int));
+        if (w->deque.socks == NULL) {
+            perror("Failed to allocate a worker deque");
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* Only start the workers once every deque they may steal from is set. */
+    for (i = 0; i < pool.numWorkers; i++) {
+        Worker *w = &pool.workers[i];
+        if (pthread_create(&w->thread, NULL, PoolWorkerRun, w) != 0) {
+            perror("Failed to create a worker thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    while (PoolAdmit(msock, &nextReport)) {
+        int ssock;
+        struct sockaddr_in cliAddr;
+        socklen_t cliAddrLen;
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+        char cliName[INET_ADDRSTRLEN + PORT_STRLEN];
+#endif
+
+        cliAddrLen = sizeof cliAddr;
+        ssock = accept4(msock, (struct sockaddr *)&cliAddr, &cliAddrLen,
+                        SOCK_CLOEXEC);
+        if (ssock < 0) {
+            /* Another process may take it first, after an upgrade. */
+            if (errno == EINTR || errno == ECONNABORTED ||
+                errno == EAGAIN || errno == EWOULDBLOCK) {
+                continue;
+            }
+            if (!httpd_draining()) {
+                perror("Failed to accept a connection");
+            }
+            break;
+        }
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+        /* Formatted only for debug builds: one thread accepts for all. */
+        SocketAddrToString(&cliAddr, cliName, sizeof cliName);
+        LogDebug("Accepted client %s (ssock=%u)\n", cliName, ssock);
+#endif
+        metrics_accepted();
+        PoolSubmit(ssock);
+    }
+
+    /* Let the workers finish what is queued, then stop. */
+    pthread_mutex_lock(&pool.lock);
+    pool.running = false;
+    pthread_cond_broadcast(&pool.workCond);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < pool.numWorkers; i++) {
+        pthread_join(pool.workers[i].thread, NULL);
+        free(pool.workers[i].deque.socks);
+    }
+    PoolReport();
+    free(pool.workers);
+}
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "recvbuf.h"
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Find the first '\n' in [p, end), or NULL if there is none.
+ *
+ * Compares 32 (AVX2) or 16 (SSE2) bytes per step and finishes the tail
+ * with memchr().
+ *
+ **************************************************************************
+ */
+static const char *
+ScanNewline(const char *p, const char *end)
+{
+#if defined(__AVX2__)
+    const __m256i nl32 = _mm256_set1_epi8('\n');
+
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl32));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i nl16 = _mm_set1_epi8('\n');
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl16));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    return p < end ? memchr(p, '\n', end - p) : NULL;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Initialize an empty receive buffer.
+ *
+ **************************************************************************
+ */
+void
+recvbuf_init(RecvBuf *rb)
+{
+    rb->start = 0;
+    rb->scan  = 0;
+    rb->end   = 0;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Make room at the end of the buffer.
+ *
+ * Unconsumed bytes are moved to the front of the buffer first if there
+ * is no room left at the end, so slices returned by recvbuf_getline()
+ * are only valid until the next call.
+ *
+ * Returns the number of bytes that fit at the end, or 0 if the buffer is
+ * full of an incomplete line.
+ *
+ **************************************************************************
+ */
+int
+recvbuf_space(RecvBuf *rb)
+{
+    if (rb->end == sizeof rb->data && rb->start > 0) {
+        memmove(rb->data, rb->data + rb->start, rb->end - rb->start);
+        rb->scan -= rb->start;
+        rb->end  -= rb->start;
+        rb->start = 0;
+    } else if (rb->start == rb->end) {
+        recvbuf_init(rb);
+    }
+    return sizeof rb->data - rb->end;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Receive as much data as fits into the buffer.
+ *
+ * Returns the number of bytes received, 0 on EOF, or -1 if there is an
+ * error (errno is EAGAIN if a non-blocking socket has no data, or
+ * ENOBUFS if the buffer is full of an incomplete line).
+ *
+ **************************************************************************
+ */
+int
+recvbuf_fill(RecvBuf *rb, int sock)
+{
+    int space = recvbuf_space(rb);
+    int n;
+
+    if (space == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    do {
+        n = read(sock, rb->data + rb->end, space);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0) {
+        rb->end += n;
+    }
+    return n;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Append data received elsewhere, e.g. in an io_uring buffer.
+ *
+ * "len" must not exceed what recvbuf_space() returned.
+ *
+ **************************************************************************
+ */
+void
+recvbuf_put(RecvBuf *rb, const char *data, int len)
+{
+    memcpy(rb->data + rb->end, data, len);
+    rb->end += len;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Take the next complete line out of the buffer.
+ *
+ * On success "line" points into the buffer at the null-terminated line,
+ * with the trailing '\r' and '\n' removed. An empty line marks the end
+ * of the request headers.
+ *
+ * Returns the length of the line, or -1 if no complete line has been
+ * received yet.
+ *
+ **************************************************************************
+ */
+int
+recvbuf_getline(RecvBuf *rb, char **line)
+{
+    char *begin = rb->data + rb->start;
+    char *eol;
+    int len;
+
+    eol = (char *)ScanNewline(rb->data + rb->scan, rb->data + rb->end);
+    if (eol == NULL) {
+        rb->scan = rb->end;
+        return -1;
+    }
+
+    rb->start = eol + 1 - rb->data;
+    rb->scan  = rb->start;
+
+    len = eol - begin;
+    if (len > 0 && begin[len - 1] == '\r') {
+        len--;
+    }
+    begin[len] = '\0';
+    *line = begin;
+    return len;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the number of received bytes not consumed yet.
+ *
+ **************************************************************************
+ */
+int
+recvbuf_pending(const RecvBuf *rb)
+{
+    return rb->end - rb->start;
+}
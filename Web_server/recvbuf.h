@@ -0,0 +1,28 @@
+#ifndef _RECVBUF_H_
+#define _RECVBUF_H_
+
+#define RECVBUF_SIZE   8192
+
+/**
+ * A per-connection receive buffer.
+ *
+ * Data is read from the socket in large chunks; request lines are handed
+ * out as slices of the buffer instead of being copied. The bytes between
+ * "start" and "end" are received but not yet consumed, e.g. the next
+ * pipelined request.
+ */
+typedef struct RecvBuf {
+    int  start;   /* first unconsumed byte */
+    int  scan;    /* where the next newline scan resumes */
+    int  end;     /* end of the received data */
+    char data[RECVBUF_SIZE];
+} RecvBuf;
+
+void recvbuf_init(RecvBuf *rb);
+int recvbuf_space(RecvBuf *rb);
+int recvbuf_fill(RecvBuf *rb, int sock);
+void recvbuf_put(RecvBuf *rb, const char *data, int len);
+int recvbuf_getline(RecvBuf *rb, char **line);
+int recvbuf_pending(const RecvBuf *rb);
+
+#endif
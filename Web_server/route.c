@@ -0,0 +1,618 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "route.h"
+
+#define ROUTE_WAIT_USEC   100     /* between checks for lingering readers */
+
+/**
+ * The routes used when no routes file is given.
+ */
+static const char builtinRoutes[] =
+    "/images/        rewrite  /img/\n";
+
+/**
+ * A configured route.
+ *
+ * "target" is the rewritten URL prefix, the alias directory, the
+ * redirect location, or the fixed response body.
+ */
+typedef struct Route {
+    char        *prefix;
+    bool         exact;       /* only matches the prefix itself */
+    RouteAction  action;
+    int          status;      /* of a redirect or fixed response */
+    char        *target;
+} Route;
+
+/**
+ * A node of the radix trie.
+ *
+ * The edge into a node is labelled with a run of prefix bytes, pointing
+ * into the prefix of a route, and the children of a node are sorted by
+ * the first byte of their labels.
+ */
+typedef struct RouteNode {
+    const char        *label;
+    int                labelLen;
+    const Route       *prefixRoute;
+    const Route       *exactRoute;
+    struct RouteNode **children;
+    int                numChildren;
+} RouteNode;
+
+/**
+ * The routes compiled into a radix trie.
+ *
+ * The nodes are allocated at once: each route adds at most a leaf and
+ * the node splitting an edge for it.
+ */
+typedef struct RouteTable {
+    Route     *routes;
+    int        numRoutes;
+    RouteNode *nodes;         /* the root first */
+    int        numNodes;
+} RouteTable;
+
+/**
+ * Counters of the threads reading a routing table.
+ *
+ * Each reader counts itself in its thread's slot, in the half selected
+ * by the low bit of "readerEpoch", before it loads "current"; the slots
+ * keep threads from contending for one cache line. A table swapped out
+ * is freed once both halves have been seen empty, the half in use last
+ * after flipping the epoch, so that new readers cannot hold it up.
+ */
+typedef struct RouteReaders {
+    long count[2];
+} __attribute__((aligned(64))) RouteReaders;
+
+static RouteTable      *current;
+static unsigned         readerEpoch;
+static RouteReaders     readers[ROUTE_READER_SLOTS];
+static unsigned         nextSlot;
+static pthread_mutex_t  swapLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Parse one line of a routes file into a route.
+ *
+ * Returns true if the line holds a valid route, or false if it is
+ * empty or invalid; an invalid line is reported.
+ *
+ **************************************************************************
+ */
+static bool
+ParseLine(char *line, const char *source, int lineNo, Route *route)
+{
+    const char *status = NULL;
+    char *prefix;
+    char *action;
+    char *target;
+    char *save;
+
+    line[strcspn(line, "#\r\n")] = '\0';
+    prefix = strtok_r(line, " \t", &save);
+    if (prefix == NULL) {
+        return false;
+    }
+    action = strtok_r(NULL, " \t", &save);
+    memset(route, 0, sizeof *route);
+    if (action != NULL && strcmp(action, "redirect") == 0) {
+        route->action = ROUTE_REDIRECT;
+        status = strtok_r(NULL, " \t", &save);
+    } else if (action != NULL && strcmp(action, "respond") == 0) {
+        route->action = ROUTE_RESPOND;
+        status = strtok_r(NULL, " \t", &save);
+    } else if (action != NULL && strcmp(action, "alias") == 0) {
+        route->action = ROUTE_ALIAS;
+    } else if (action != NULL && strcmp(action, "rewrite") == 0) {
+        route->action = ROUTE_REWRITE;
+    } else {
+        goto invalid;
+    }
+
+    /* A fixed response body is the rest of the line, spaces and all. */
+    if (route->action == ROUTE_RESPOND) {
+        target = save + strspn(save, " \t");
+    } else {
+        target = strtok_r(NULL, " \t", &save);
+        if (target == NULL || strtok_r(NULL, " \t", &save) != NULL) {
+            goto invalid;
+        }
+    }
+    if (status != NULL) {
+        route->status = atoi(status);
+        bool redirect = route->status >= 300 && route->status < 400;
+
+        if (httpd_status_line(route->status) == NULL ||
+            redirect != (route->action == ROUTE_REDIRECT) ||
+            route->status == 206 || route->status == 416) {
+            goto invalid;
+        }
+    } else if (route->action == ROUTE_REDIRECT ||
+               route->action == ROUTE_RESPOND) {
+        goto invalid;
+    }
+    if (route->action == ROUTE_REWRITE && target[0] != '/') {
+        goto invalid;
+    }
+
+    route->exact = prefix[0] == '=';
+    prefix += route->exact;
+    if (prefix[0] != '/' || strlen(target) >= MAX_FIXED) {
+        goto invalid;
+    }
+    route->prefix = strdup(prefix);
+    route->target = malloc(strlen(target) + 2);
+    if (route->prefix == NULL || route->target == NULL) {
+        perror("Failed to allocate a route");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(route->target, target);
+    if (route->action == ROUTE_RESPOND && target[0] != '\0') {
+        strcat(route->target, "\n");
+    }
+    return true;
+
+invalid:
+    Error("%s:%d: Invalid route line, skipped\n", source, lineNo);
+    return false;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Find the child of a node whose label starts with a byte.
+ *
+ * Returns its index among the node's children, or -1.
+ *
+ **************************************************************************
+ */
+static int
+FindChild(const RouteNode *node, char c)
+{
+    int lo = 0;
+    int hi = node->numChildren - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        unsigned char first = node->children[mid]->label[0];
+
+        if (first == (unsigned char)c) {
+            return mid;
+        }
+        if (first < (unsigned char)c) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Add a child to a node, keeping the children sorted.
+ *
+ **************************************************************************
+ */
+static void
+AddChild(RouteNode *node, RouteNode *child)
+{
+    int i;
+
+    node->children = realloc(node->children,
+                             (node->numChildren + 1) * sizeof *node->children);
+    if (node->children == NULL) {
+        perror("Failed to allocate a route node");
+        exit(EXIT_FAILURE);
+    }
+    for (i = node->numChildren; i > 0; i--) {
+        if ((unsigned char)node->children[i - 1]->label[0] <
+            (unsigned char)child->label[0]) {
+            break;
+        }
+        node->children[i] = node->children[i - 1];
+    }
+    node->children[i] = child;
+    node->numChildren++;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Insert a route into the trie.
+ *
+ * An edge that the prefix leaves part way is split at that point. A
+ * later route for the same prefix replaces an earlier one.
+ *
+ **************************************************************************
+ */
+static void
+InsertRoute(RouteTable *table, const Route *route)
+{
+    RouteNode *node = &table->nodes[0];
+    const char *key = route->prefix;
+
+    while (*key != '\0') {
+        int idx = FindChild(node, *key);
+        RouteNode *child;
+        RouteNode *split;
+        int common = 0;
+
+        if (idx < 0) {
+            child = &table->nodes[table->numNodes++];
+            child->label    = key;
+            child->labelLen = strlen(key);
+            AddChild(node, child);
+            node = child;
+            break;
+        }
+        child = node->children[idx];
+        while (common < child->labelLen &&
+               key[common] == child->label[common]) {
+            common++;
+        }
+        if (common < child->labelLen) {
+            /* The split node takes the child's place under "node". */
+            split = &table->nodes[table->numNodes++];
+            split->label    = child->label;
+            split->labelLen = common;
+            child->label    += common;
+            child->labelLen -= common;
+            node->children[idx] = split;
+            AddChild(split, child);
+            child = split;
+        }
+        node = child;
+        key += common;
+    }
+
+    if (route->exact) {
+        node->exactRoute = route;
+    } else {
+        node->prefixRoute = route;
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Free a routing table.
+ *
+ **************************************************************************
+ */
+static void
+TableFree(RouteTable *table)
+{
+    int i;
+
+    for (i = 0; i < table->numNodes; i++) {
+        free(table->nodes[i].children);
+    }
+    for (i = 0; i < table->numRoutes; i++) {
+        free(table->routes[i].prefix);
+        free(table->routes[i].target);
+    }
+    free(table->nodes);
+    free(table->routes);
+    free(table);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Compile routes into a routing table, which takes them over.
+ *
+ **************************************************************************
+ */
+static RouteTable *
+TableBuild(Route *routes, int numRoutes)
+{
+    RouteTable *table = calloc(1, sizeof *table);
+    int i;
+
+    if (table == NULL ||
+        (table->nodes = calloc(2 * numRoutes + 1,
+                               sizeof *table->nodes)) == NULL) {
+        perror("Failed to allocate the routing table");
+        exit(EXIT_FAILURE);
+    }
+    table->routes    = routes;
+    table->numRoutes = numRoutes;
+    table->numNodes  = 1;
+    for (i = 0; i < numRoutes; i++) {
+        InsertRoute(table, &routes[i]);
+    }
+    return table;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Find the route with the longest prefix of a URL.
+ *
+ * The trie is walked down once along the URL, remembering the last node
+ * passed that has a prefix route; an exact route is only taken at the
+ * node where the URL ends. Returns the route and the length of its
+ * prefix, or NULL if no route matches.
+ *
+ **************************************************************************
+ */
+static const Route *
+TableMatch(const RouteTable *table, const char *url, int *matchLen)
+{
+    const RouteNode *node = &table->nodes[0];
+    const Route *best = NULL;
+    int pos = 0;
+
+    while (url[pos] != '\0') {
+        int idx = FindChild(node, url[pos]);
+
+        if (idx < 0) {
+            break;
+        }
+        node = node->children[idx];
+        if (strncmp(url + pos, node->label, node->labelLen) != 0) {
+            break;
+        }
+        pos += node->labelLen;
+        if (url[pos] == '\0' && node->exactRoute != NULL) {
+            *matchLen = pos;
+            return node->exactRoute;
+        }
+        if (node->prefixRoute != NULL) {
+            best = node->prefixRoute;
+            *matchLen = pos;
+        }
+    }
+    return best;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Wait for the readers counted in one half of the slots to leave.
+ *
+ **************************************************************************
+ */
+static void
+WaitReaders(unsigned half)
+{
+    int i;
+
+    for (i = 0; i < ROUTE_READER_SLOTS; i++) {
+        while (__atomic_load_n(&readers[i].count[half],
+                               __ATOMIC_SEQ_CST) != 0) {
+            usleep(ROUTE_WAIT_USEC);
+        }
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Make a routing table current, and free the one it replaces.
+ *
+ * Requests keep being mapped while the table is swapped: only the
+ * thread swapping waits, until no reader can still be using the old
+ * table.
+ *
+ **************************************************************************
+ */
+static void
+TableSwap(RouteTable *table)
+{
+    RouteTable *old;
+    unsigned half;
+
+    pthread_mutex_lock(&swapLock);
+    old  = __atomic_exchange_n(&current, table, __ATOMIC_SEQ_CST);
+    half = readerEpoch & 1;
+    WaitReaders(half ^ 1);
+    __atomic_store_n(&readerEpoch, readerEpoch + 1, __ATOMIC_SEQ_CST);
+    WaitReaders(half);
+    pthread_mutex_unlock(&swapLock);
+
+    if (old != NULL) {
+        TableFree(old);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Load the routes, and make them current.
+ *
+ * Each line of a routes file is a URL prefix, an action and its
+ * arguments:
+ *
+ *   /prefix  rewrite   /other/          the file under htdocRoot
+ *   /prefix  alias     /some/dir/       the file under another directory
+ *   /prefix  redirect  301 location     a redirect (301, 302, 303, 307
+ *                                       or 308) to the location
+ *   /prefix  respond   200 text         a fixed text/plain response
+ *
+ * The matched prefix is replaced, and the rest of the URL is appended
+ * to the rewritten URL, the directory or the location. A prefix
+ * starting with "=" only matches the URL itself. The built-in routes
+ * are used if "path" is NULL.
+ *
+ * Returns false if the routes file cannot be read, in which case the
+ * current routes are kept.
+ *
+ **************************************************************************
+ */
+bool
+route_load(const char *path)
+{
+    Route *routes = NULL;
+    int numRoutes = 0;
+    int lineNo = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    FILE *fp;
+
+    if (path != NULL) {
+        fp = fopen(path, "r");
+    } else {
+        fp = fmemopen((void *)builtinRoutes, sizeof builtinRoutes - 1, "r");
+    }
+    if (fp == NULL) {
+        return false;
+    }
+    while (getline(&line, &cap, fp) >= 0) {
+        routes = realloc(routes, (numRoutes + 1) * sizeof *routes);
+        if (routes == NULL) {
+            perror("Failed to allocate a route");
+            exit(EXIT_FAILURE);
+        }
+        if (ParseLine(line, path != NULL ? path : "built-in", ++lineNo,
+                      &routes[numRoutes])) {
+            numRoutes++;
+        }
+    }
+    free(line);
+    fclose(fp);
+
+    TableSwap(TableBuild(routes, numRoutes));
+    Log("route: %d routes from %s\n", numRoutes,
+        path != NULL ? path : "built-in table");
+    return true;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Reload the routes whenever SIGHUP is received.
+ *
+ **************************************************************************
+ */
+static void *
+ReloadThread(void *arg)
+{
+    const char *path = arg;
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    while (sigwait(&set, &sig) == 0) {
+        if (!route_load(path)) {
+            Error("route: Failed to reload %s, routes kept\n", path);
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Start reloading the routes file on SIGHUP.
+ *
+ * SIGHUP must already be blocked in every thread, so that only the
+ * reload thread takes it.
+ *
+ **************************************************************************
+ */
+void
+route_watch(const char *path)
+{
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, ReloadThread, (void *)path) != 0) {
+        perror("Failed to create the route reload thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(tid);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Map a URL by the current routes.
+ *
+ * A URL routed to a file sets the file path in "req", and the offset
+ * of the part of it that came from the URL; "index.html" is appended
+ * if the path ends with "/". A URL routed to a redirect or a fixed
+ * response sets the status, and the location or the body.
+ *
+ * Returns 0, or -1 if the result does not fit.
+ *
+ **************************************************************************
+ */
+int
+route_map(const char *url, HttpRequest *req)
+{
+    static __thread int slot = -1;
+    const RouteTable *table;
+    const Route *route;
+    const char *root = svrArgs.htdocRoot;
+    const char *prefix = "";
+    unsigned half;
+    int matchLen = 0;
+    int len;
+
+    if (slot < 0) {
+        slot = __atomic_fetch_add(&nextSlot, 1, __ATOMIC_RELAXED) %
+               ROUTE_READER_SLOTS;
+    }
+    half = __atomic_load_n(&readerEpoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_fetch_add(&readers[slot].count[half], 1, __ATOMIC_SEQ_CST);
+    table = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+
+    route = TableMatch(table, url, &matchLen);
+    if (route == NULL) {
+        matchLen = 0;
+    } else if (route->action == ROUTE_REWRITE) {
+        prefix = route->target;
+    } else if (route->action == ROUTE_ALIAS) {
+        root = route->target;
+    } else {
+        req->fixedStatus = route->status;
+        len = snprintf(req->fixedText, sizeof req->fixedText, "%s%s",
+                       route->target,
+                       route->action == ROUTE_REDIRECT ? url + matchLen : "");
+        __atomic_fetch_sub(&readers[slot].count[half], 1, __ATOMIC_RELEASE);
+        return len < sizeof req->fixedText ? 0 : -1;
+    }
+
+    len = snprintf(req->fname, sizeof req->fname, "%s%s%s",
+                   root, prefix, url + matchLen);
+    req->nameOff = strlen(root);
+    if (req->nameOff > 0 && root[req->nameOff - 1] == '/') {
+        req->nameOff--;
+    }
+    __atomic_fetch_sub(&readers[slot].count[half], 1, __ATOMIC_RELEASE);
+
+    if (len >= sizeof req->fname) {
+        return -1;
+    }
+    if (len > 0 && req->fname[len - 1] == '/') {
+        len += snprintf(req->fname + len, sizeof req->fname - len,
+                        "index.html");
+    }
+    return len < sizeof req->fname ? 0 : -1;
+}
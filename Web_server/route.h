@@ -0,0 +1,24 @@
+#ifndef _ROUTE_H_
+#define _ROUTE_H_
+
+#include <stdbool.h>
+
+#include "httpd.h"
+
+#define ROUTE_READER_SLOTS   64     /* reader counters, by thread */
+
+/**
+ * What a route does with the URLs it matches.
+ */
+typedef enum RouteAction {
+    ROUTE_REWRITE,       /* replace the prefix, under htdocRoot */
+    ROUTE_ALIAS,         /* replace the prefix with a directory */
+    ROUTE_REDIRECT,      /* send the client elsewhere */
+    ROUTE_RESPOND,       /* send a fixed response */
+} RouteAction;
+
+bool route_load(const char *path);
+void route_watch(const char *path);
+int route_map(const char *url, HttpRequest *req);
+
+#endif
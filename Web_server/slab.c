@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "slab.h"
+
+/**
+ * A chunk of slab objects; the objects follow the header.
+ */
+typedef struct SlabChunk {
+    struct SlabChunk *next;
+} __attribute__((aligned(SLAB_ALIGN))) SlabChunk;
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Initialize an empty slab of objects of a given size.
+ *
+ **************************************************************************
+ */
+void
+slab_init(Slab *slab,           // OUT
+          const char *name,     // IN
+          size_t objSize,       // IN
+          int perChunk)         // IN
+{
+    memset(slab, 0, sizeof *slab);
+    slab->name     = name;
+    slab->objSize  = (objSize + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    slab->perChunk = perChunk;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Add a chunk of objects to the free list.
+ *
+ **************************************************************************
+ */
+static void *
+SlabGrow(Slab *slab)
+{
+    SlabChunk *chunk;
+    char *obj;
+    int i;
+
+    chunk = aligned_alloc(SLAB_ALIGN,
+                          sizeof *chunk + slab->perChunk * slab->objSize);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->next  = slab->chunks;
+    slab->chunks = chunk;
+    slab->numChunks++;
+
+    /* Threaded in address order, so that the first use is sequential. */
+    obj = (char *)(chunk + 1) + (slab->perChunk - 1) * slab->objSize;
+    for (i = 0; i < slab->perChunk; i++, obj -= slab->objSize) {
+        *(void **)obj  = slab->freeList;
+        slab->freeList = obj;
+    }
+    Log("slab %s: grew to %lld objects of %zu bytes\n", slab->name,
+        slab->numChunks * slab->perChunk, slab->objSize);
+    return slab->freeList;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get an object from a slab.
+ *
+ * The object is not cleared: apart from the free list link in its first
+ * bytes, it holds whatever it held when it was freed.
+ *
+ * Returns NULL if the slab cannot grow.
+ *
+ **************************************************************************
+ */
+void *
+slab_alloc(Slab *slab)
+{
+    void *obj = slab->freeList;
+
+    if (obj == NULL && (obj = SlabGrow(slab)) == NULL) {
+        return NULL;
+    }
+    slab->freeList = *(void **)obj;
+    slab->numAllocs++;
+    slab->inUse++;
+    return obj;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Return an object to its slab.
+ *
+ **************************************************************************
+ */
+void
+slab_free(Slab *slab, void *obj)
+{
+    *(void **)obj  = slab->freeList;
+    slab->freeList = obj;
+    slab->inUse--;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Free a slab's memory, with any objects still allocated from it.
+ *
+ **************************************************************************
+ */
+void
+slab_destroy(Slab *slab)
+{
+    while (slab->chunks != NULL) {
+        SlabChunk *next = slab->chunks->next;
+        free(slab->chunks);
+        slab->chunks = next;
+    }
+    slab->freeList = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stddef.h>
+
+#define SLAB_ALIGN   64     /* objects start on a cache line */
+
+/**
+ * A pool of fixed-size objects, recycled instead of freed.
+ *
+ * Objects are carved out of chunks of "perChunk" objects each, and a
+ * freed object goes on the free list for the next allocation, so that
+ * once a slab has grown to its peak use it allocates no more memory.
+ * Chunks are only freed with the slab. A slab is not locked, and is
+ * meant to be owned by one thread, e.g. an event loop.
+ */
+typedef struct Slab {
+    const char        *name;       /* for the log */
+    size_t             objSize;    /* rounded up to SLAB_ALIGN */
+    int                perChunk;
+    void              *freeList;   /* each free object holds the next */
+    struct SlabChunk  *chunks;
+    long long          numChunks;  /* memory allocations made */
+    long long          numAllocs;
+    long long          inUse;
+} Slab;
+
+void slab_init(Slab *slab, const char *name, size_t objSize, int perChunk);
+void *slab_alloc(Slab *slab);
+void slab_free(Slab *slab, void *obj);
+void slab_destroy(Slab *slab);
+
+#endif
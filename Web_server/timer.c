@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "timer.h"
+
+#define TIMER_MASK   (TIMER_SLOTS - 1)
+
+/* The tick a deadline is due at; LLONG_MAX stands for never. */
+#define TIMER_TICK(_ms) \
+    ((_ms) / TIMER_TICK_MS + ((_ms) % TIMER_TICK_MS != 0))
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Initialize an empty timer wheel, starting at the given time.
+ *
+ * A Timer that is all zeros is not in any wheel.
+ *
+ **************************************************************************
+ */
+void
+timer_init(TimerWheel *tw,      // OUT
+           long long nowMs)     // IN
+{
+    memset(tw, 0, sizeof *tw);
+    tw->now = nowMs / TIMER_TICK_MS;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief File a timer in the slot of its "expires" tick.
+ *
+ * The level is picked by how far the tick is; a tick in the past is due
+ * at the next expiry pass, and one beyond the top level is filed at its
+ * end, to be filed again from there.
+ *
+ **************************************************************************
+ */
+static void
+TimerFile(TimerWheel *tw, Timer *t)
+{
+    long long delta;
+    int level;
+    int slot;
+
+    if (t->expires < tw->now) {
+        t->expires = tw->now;
+    }
+    delta = t->expires - tw->now;
+    for (level = 0; level < TIMER_LEVELS - 1; level++) {
+        if (delta < 1LL << (TIMER_BITS * (level + 1))) {
+            break;
+        }
+    }
+    if (delta >= 1LL << (TIMER_BITS * TIMER_LEVELS)) {
+        t->expires = tw->now + (1LL << (TIMER_BITS * TIMER_LEVELS)) - 1;
+    }
+    slot = (t->expires >> (TIMER_BITS * level)) & TIMER_MASK;
+
+    t->next = tw->slots[level][slot];
+    if (t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = &tw->slots[level][slot];
+    tw->slots[level][slot] = t;
+    tw->occupied[level] |= 1ULL << slot;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Take a timer out of its slot.
+ *
+ **************************************************************************
+ */
+static void
+TimerUnlink(TimerWheel *tw, Timer *t)
+{
+    Timer **first = &tw->slots[0][0];
+
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    /* Only the first timer of a slot points back into the slot array. */
+    if (t->pprev >= first && t->pprev < first + TIMER_LEVELS * TIMER_SLOTS &&
+        *t->pprev == NULL) {
+        int idx = t->pprev - first;
+        tw->occupied[idx / TIMER_SLOTS] &= ~(1ULL << (idx % TIMER_SLOTS));
+    }
+    t->pprev = NULL;
+    tw->count--;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Set a timer's deadline, adding it to the wheel if need be.
+ *
+ * A deadline later than the one the timer is filed for is only recorded,
+ * which is all it costs to push back the deadline of a busy connection.
+ *
+ **************************************************************************
+ */
+void
+timer_set(TimerWheel *tw,       // IN/OUT
+          Timer *t,             // IN/OUT
+          long long deadline)   // IN: msecs
+{
+    long long expires = TIMER_TICK(deadline);
+
+    t->deadline = deadline;
+    if (t->pprev != NULL) {
+        if (t->expires <= expires) {
+            return;   /* checked again when it is due */
+        }
+        TimerUnlink(tw, t);
+    }
+    t->expires = expires;
+    TimerFile(tw, t);
+    tw->count++;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Remove a timer from the wheel, if it is in it.
+ *
+ **************************************************************************
+ */
+void
+timer_del(TimerWheel *tw, Timer *t)
+{
+    if (t->pprev != NULL) {
+        TimerUnlink(tw, t);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Move the timers of a higher level slot down the wheel.
+ *
+ **************************************************************************
+ */
+static void
+TimerCascade(TimerWheel *tw, int level, int slot)
+{
+    Timer *t = tw->slots[level][slot];
+
+    tw->slots[level][slot] = NULL;
+    tw->occupied[level] &= ~(1ULL << slot);
+    while (t != NULL) {
+        Timer *next = t->next;
+        TimerFile(tw, t);
+        t = next;
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Advance the wheel to the given time, collecting expired timers.
+ *
+ * Timers whose deadline has been pushed back are filed again for it
+ * instead. The expired timers are out of the wheel, and chained through
+ * their "next" field, so that they may be reused or freed while walking
+ * the list.
+ *
+ * Returns the first expired timer, or NULL.
+ *
+ **************************************************************************
+ */
+Timer *
+timer_expire(TimerWheel *tw, long long nowMs)
+{
+    long long tick = nowMs / TIMER_TICK_MS;
+    Timer *expired = NULL;
+
+    while (tw->now <= tick && tw->count > 0) {
+        int idx = tw->now & TIMER_MASK;
+        Timer *t;
+        int level;
+
+        if (idx == 0) {
+            for (level = 1; level < TIMER_LEVELS; level++) {
+                int slot = (tw->now >> (TIMER_BITS * level)) & TIMER_MASK;
+                TimerCascade(tw, level, slot);
+                if (slot != 0) {
+                    break;
+                }
+            }
+        }
+
+        if (tw->occupied[0] == 0) {
+            /* Nothing at level 0: go straight to the next cascade. */
+            long long next = (tw->now | TIMER_MASK) + 1;
+            tw->now = next <= tick ? next : tick + 1;
+            continue;
+        }
+
+        t = tw->slots[0][idx];
+        tw->slots[0][idx] = NULL;
+        tw->occupied[0] &= ~(1ULL << idx);
+        while (t != NULL) {
+            Timer *next = t->next;
+            long long expires = TIMER_TICK(t->deadline);
+
+            if (expires > tw->now) {
+                t->expires = expires;
+                TimerFile(tw, t);
+            } else {
+                t->pprev = NULL;
+                t->next  = expired;
+                expired  = t;
+                tw->count--;
+            }
+            t = next;
+        }
+        tw->now++;
+    }
+    if (tw->now <= tick) {
+        tw->now = tick + 1;   /* empty */
+    }
+    return expired;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Take every timer out of the wheel, whether due or not.
+ *
+ * The timers are chained as timer_expire() chains the expired ones; one
+ * that is to stay may be set again for its "deadline".
+ *
+ * Returns the first timer, or NULL if the wheel is empty.
+ *
+ **************************************************************************
+ */
+Timer *
+timer_take_all(TimerWheel *tw)
+{
+    Timer *all = NULL;
+    int level;
+
+    for (level = 0; level < TIMER_LEVELS; level++) {
+        uint64_t occ = tw->occupied[level];
+
+        while (occ != 0) {
+            int slot = __builtin_ctzll(occ);
+            Timer *t = tw->slots[level][slot];
+
+            occ &= occ - 1;
+            tw->slots[level][slot] = NULL;
+            while (t != NULL) {
+                Timer *next = t->next;
+                t->pprev = NULL;
+                t->next  = all;
+                all      = t;
+                t        = next;
+            }
+        }
+        tw->occupied[level] = 0;
+    }
+    tw->count = 0;
+    return all;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the time until the wheel next has work to do.
+ *
+ * That is when the first occupied level 0 slot is due, or an occupied
+ * higher level slot moves down, whichever comes first.
+ *
+ * Returns the time in milliseconds, or -1 if the wheel is empty.
+ *
+ **************************************************************************
+ */
+int
+timer_next_ms(const TimerWheel *tw, long long nowMs)
+{
+    long long next = LLONG_MAX;
+    long long ms;
+    int level;
+
+    if (tw->count == 0) {
+        return -1;
+    }
+    for (level = 0; level < TIMER_LEVELS; level++) {
+        int shift = TIMER_BITS * level;
+        long long first = (tw->now + (1LL << shift) - 1) >> shift;
+        int rot = first & TIMER_MASK;
+        uint64_t occ = tw->occupied[level];
+        long long tick;
+
+        if (occ == 0) {
+            continue;
+        }
+        if (rot != 0) {
+            occ = (occ >> rot) | (occ << (TIMER_SLOTS - rot));
+        }
+        tick = (first + __builtin_ctzll(occ)) << shift;
+        if (tick < next) {
+            next = tick;
+        }
+    }
+    ms = next * TIMER_TICK_MS - nowMs;
+    return ms < 0 ? 0 : ms > INT_MAX ? INT_MAX : ms;
+}
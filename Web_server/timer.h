@@ -0,0 +1,49 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <stdint.h>
+
+#define TIMER_TICK_MS   50     /* resolution of the deadlines */
+#define TIMER_BITS      6
+#define TIMER_SLOTS     (1 << TIMER_BITS)
+#define TIMER_LEVELS    4      /* 64^4 ticks, over 9 days */
+
+/**
+ * A deadline kept in a timer wheel, embedded in what it times out.
+ *
+ * "deadline" may be moved later without touching the wheel: the timer
+ * stays filed under its earlier tick, and is filed again for the new
+ * deadline when that tick comes.
+ */
+typedef struct Timer {
+    long long      deadline;   /* msecs */
+    long long      expires;    /* tick it is filed under */
+    struct Timer  *next;
+    struct Timer **pprev;      /* NULL if not in the wheel */
+} Timer;
+
+/**
+ * A hierarchical timer wheel.
+ *
+ * Level 0 has a slot per tick for the next TIMER_SLOTS ticks, and each
+ * level above has slots TIMER_SLOTS times as wide, which are moved down
+ * a level when the wheel reaches them. Adding, moving and removing a
+ * timer is O(1), and an expiry pass only looks at the slots whose time
+ * has come, however many timers there are. A wheel is not locked, and is
+ * meant to be owned by one thread, e.g. an event loop.
+ */
+typedef struct TimerWheel {
+    long long  now;                   /* next tick to process */
+    int        count;
+    uint64_t   occupied[TIMER_LEVELS];
+    Timer     *slots[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+void timer_init(TimerWheel *tw, long long nowMs);
+void timer_set(TimerWheel *tw, Timer *t, long long deadline);
+void timer_del(TimerWheel *tw, Timer *t);
+Timer *timer_expire(TimerWheel *tw, long long nowMs);
+Timer *timer_take_all(TimerWheel *tw);
+int timer_next_ms(const TimerWheel *tw, long long nowMs);
+
+#endif
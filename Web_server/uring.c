@@ -0,0 +1,1031 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "httpd.h"
+#include "recvbuf.h"
+#include "slab.h"
+#include "timer.h"
+#include "metrics.h"
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup     425
+#define __NR_io_uring_enter     426
+#define __NR_io_uring_register  427
+#endif
+
+#define URING_ENTRIES     256
+#define URING_BUF_SIZE    4096         /* provided receive buffers */
+#define URING_NUM_BUFS    256          /* per loop */
+#define URING_BUF_GROUP   0
+#define URING_CHUNK       (256 * 1024) /* file bytes per linked pair */
+#define CONNS_PER_CHUNK   64           /* connections added to a slab */
+#define BUFS_PER_CHUNK    4            /* file buffers added to a slab */
+
+/**
+ * What a completion is for, kept in the low bits of its user_data next
+ * to the connection pointer.
+ */
+typedef enum UringOp {
+    UOP_ACCEPT,
+    UOP_PROVIDE,
+    UOP_RECV,
+    UOP_SEND,        /* the header and in-memory body */
+    UOP_FILE_IN,     /* file to pipe (splice) or buffer (read) */
+    UOP_FILE_OUT,    /* pipe or buffer to socket */
+    UOP_DRAIN,       /* poll on the drain fd */
+    UOP_CANCEL,      /* of the accept, once draining */
+} UringOp;
+
+#define UOP_MASK   7
+
+/**
+ * The state of a connection.
+ */
+typedef enum UringConnState {
+    UCONN_RECV,
+    UCONN_SEND_HEADER,
+    UCONN_SEND_FILE,
+    UCONN_CLOSED,
+} UringConnState;
+
+/**
+ * A client connection driven by an io_uring loop.
+ *
+ * File bodies go out in linked pairs of requests: file to pipe then pipe
+ * to socket with splice, or, if the kernel cannot splice, file to buffer
+ * then buffer to socket. Bytes that made it into the pipe or buffer but
+ * not to the socket are "staged" and sent on their own next.
+ *
+ * Connections and file buffers are recycled through their loop's slabs;
+ * the fields before "req" are cleared for each new connection.
+ */
+typedef struct UringConn {
+    int              sock;
+    UringConnState   state;
+    int              numRequests;
+    int              inflight;        /* requests the kernel still owns */
+    int              fileOps;         /* of the current linked pair */
+    bool             fileError;
+    int              pipefd[2];
+    char            *fileBuf;
+    int              chunk;           /* what the pipe or buffer holds */
+    int              staged;          /* bytes in the pipe or buffer */
+    int              stagedOff;       /* next buffer byte to send */
+    bool             idle;            /* no byte of the next request yet */
+    Timer            timer;
+    HttpSendClock    send;
+    struct msghdr    msg;
+    HttpRequest      req;
+    RecvBuf          rb;
+    HttpResponse     resp;
+} UringConn;
+
+/**
+ * An io_uring instance and its mapped rings.
+ */
+typedef struct Uring {
+    int                  fd;
+    unsigned             features;    /* IORING_FEAT_* */
+    unsigned            *sqHead;
+    unsigned            *sqTail;
+    unsigned            *sqMask;
+    unsigned            *sqArray;
+    unsigned             sqEntries;
+    unsigned             sqeTail;     /* queued, not yet submitted */
+    struct io_uring_sqe *sqes;
+    unsigned            *cqHead;
+    unsigned            *cqTail;
+    unsigned            *cqMask;
+    struct io_uring_cqe *cqes;
+    void                *sqRing;
+    size_t               sqRingSize;
+    void                *cqRing;
+    size_t               cqRingSize;
+    size_t               sqesSize;
+} Uring;
+
+/**
+ * An io_uring loop, run by its own thread.
+ *
+ * The connections' deadlines are kept in a timer wheel, which bounds how
+ * long the loop waits for completions; "now" is read once per wakeup.
+ * Once "draining", the loop accepts no more connections, and returns
+ * when it has none left.
+ */
+typedef struct UringLoop {
+    int        id;
+    int        msock;
+    bool       draining;
+    bool       multishot;     /* multishot accept still believed to work */
+    bool       useSplice;
+    long long  now;           /* msecs */
+    TimerWheel timers;
+    Uring      ring;
+    char      *bufs;          /* URING_NUM_BUFS provided buffers */
+    Slab       connSlab;
+    Slab       fileBufSlab;   /* URING_CHUNK buffers, without splice */
+    pthread_t  thread;
+} UringLoop;
+
+/**
+ * The kernel features found by UringProbe().
+ */
+static struct {
+    bool supported;
+    bool splice;
+} uringFeatures;
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Set up an io_uring instance and map its rings.
+ *
+ * Returns 0 on success, or -1 with errno set.
+ *
+ **************************************************************************
+ */
+static int
+UringInit(Uring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq;
+    char *cq;
+
+    /* Prefer the cheaper completion modes, which older kernels reject. */
+    memset(&p, 0, sizeof p);
+    p.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof p);
+        ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->features = p.features;
+
+    ring->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = p.cq_off.cqes +
+                       p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = ring->sqRingSize;
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            goto fail;
+        }
+    }
+    ring->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto fail;
+    }
+
+    sq = ring->sqRing;
+    cq = ring->cqRing;
+    ring->sqHead    = (unsigned *)(sq + p.sq_off.head);
+    ring->sqTail    = (unsigned *)(sq + p.sq_off.tail);
+    ring->sqMask    = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sqArray   = (unsigned *)(sq + p.sq_off.array);
+    ring->sqEntries = p.sq_entries;
+    ring->sqeTail   = *ring->sqTail;
+    ring->cqHead    = (unsigned *)(cq + p.cq_off.head);
+    ring->cqTail    = (unsigned *)(cq + p.cq_off.tail);
+    ring->cqMask    = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes      = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    close(ring->fd);
+    return -1;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Submit the queued requests and wait for "waitNr" completions.
+ *
+ * The wait gives up with ETIME after "timeoutMs", unless it is -1.
+ *
+ **************************************************************************
+ */
+static int
+UringSubmit(Uring *ring, unsigned waitNr, int timeoutMs)
+{
+    unsigned toSubmit = ring->sqeTail - *ring->sqTail;
+    unsigned flags = waitNr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    void *argp = NULL;
+    size_t argSize = 0;
+    int ret;
+
+    if (timeoutMs >= 0) {
+        ts.tv_sec  = timeoutMs / 1000;
+        ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+        memset(&arg, 0, sizeof arg);
+        arg.ts  = (uintptr_t)&ts;
+        flags  |= IORING_ENTER_EXT_ARG;
+        argp    = &arg;
+        argSize = sizeof arg;
+    }
+
+    __atomic_store_n(ring->sqTail, ring->sqeTail, __ATOMIC_RELEASE);
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, toSubmit, waitNr,
+                      flags, argp, argSize);
+    } while (ret < 0 && errno == EINTR && waitNr == 0);
+    return ret;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get a cleared submission queue entry, submitting if it is full.
+ *
+ **************************************************************************
+ */
+static struct io_uring_sqe *
+UringGetSqe(Uring *ring, UringConn *conn, UringOp op)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    while (ring->sqeTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >=
+           ring->sqEntries) {
+        if (UringSubmit(ring, 0, -1) < 0 && errno != EBUSY) {
+            perror("Failed to submit io_uring requests");
+            exit(EXIT_FAILURE);
+        }
+    }
+    idx = ring->sqeTail & *ring->sqMask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->user_data = (uintptr_t)conn | op;
+    ring->sqArray[idx] = idx;
+    ring->sqeTail++;
+    if (conn != NULL) {
+        conn->inflight++;
+    }
+    return sqe;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Find out whether the kernel supports everything the engine uses.
+ *
+ **************************************************************************
+ */
+static void
+UringProbe(void)
+{
+    static const int required[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG,
+        IORING_OP_PROVIDE_BUFFERS, IORING_OP_READ, IORING_OP_SEND,
+        IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL,
+    };
+    struct io_uring_probe *probe;
+    size_t probeSize = sizeof *probe + 256 * sizeof(struct io_uring_probe_op);
+    Uring ring;
+    int i;
+
+    if (UringInit(&ring, 4) < 0) {
+        Log("uring: io_uring is not available: %s\n", strerror(errno));
+        return;
+    }
+    probe = calloc(1, probeSize);
+    if (probe != NULL &&
+        syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE,
+                probe, 256) == 0) {
+        uringFeatures.supported = true;
+        for (i = 0; i < ARRAYSIZE(required); i++) {
+            if (required[i] > probe->last_op ||
+                !(probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED)) {
+                Log("uring: io_uring lacks opcode %d\n", required[i]);
+                uringFeatures.supported = false;
+            }
+        }
+        uringFeatures.splice = IORING_OP_SPLICE <= probe->last_op &&
+            (probe->ops[IORING_OP_SPLICE].flags & IO_URING_OP_SUPPORTED);
+        if (!(ring.features & IORING_FEAT_EXT_ARG)) {
+            Log("uring: io_uring cannot wait with a timeout\n");
+            uringFeatures.supported = false;
+        }
+    } else {
+        Log("uring: io_uring cannot be probed: %s\n", strerror(errno));
+    }
+    free(probe);
+    munmap(ring.sqes, ring.sqesSize);
+    if (ring.cqRing != ring.sqRing) {
+        munmap(ring.cqRing, ring.cqRingSize);
+    }
+    munmap(ring.sqRing, ring.sqRingSize);
+    close(ring.fd);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Hand provided buffers (back) to the kernel.
+ *
+ **************************************************************************
+ */
+static void
+UringProvideBuffers(UringLoop *loop, int bid, int count)
+{
+    struct io_uring_sqe *sqe = UringGetSqe(&loop->ring, NULL, UOP_PROVIDE);
+
+    sqe->opcode    = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd        = count;
+    sqe->addr      = (uintptr_t)(loop->bufs + bid * URING_BUF_SIZE);
+    sqe->len       = URING_BUF_SIZE;
+    sqe->off       = bid;
+    sqe->buf_group = URING_BUF_GROUP;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Queue a poll on the drain fd, which completes once draining.
+ *
+ **************************************************************************
+ */
+static void
+UringArmDrain(UringLoop *loop)
+{
+    struct io_uring_sqe *sqe = UringGetSqe(&loop->ring, NULL, UOP_DRAIN);
+
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = httpd_drain_fd();
+    sqe->poll32_events = POLLIN;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Queue an accept on the listen socket.
+ *
+ * A multishot accept stays armed and completes once per connection.
+ *
+ **************************************************************************
+ */
+static void
+UringArmAccept(UringLoop *loop)
+{
+    struct io_uring_sqe *sqe = UringGetSqe(&loop->ring, NULL, UOP_ACCEPT);
+
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = loop->msock;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (loop->multishot) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Close a connection; it is freed once the kernel is done with it.
+ *
+ **************************************************************************
+ */
+static void
+UringConnClose(UringLoop *loop, UringConn *conn)
+{
+    if (conn->state != UCONN_CLOSED) {
+        LogDebug("uring-%d: Closing (ssock=%u, requests=%d)\n",
+                 loop->id, conn->sock, conn->numRequests);
+        conn->state = UCONN_CLOSED;
+        timer_del(&loop->timers, &conn->timer);
+        close(conn->sock);
+        metrics_closed();
+    }
+    if (conn->inflight > 0) {
+        return;
+    }
+    httpd_release_response(&conn->resp);
+    if (conn->pipefd[0] >= 0) {
+        close(conn->pipefd[0]);
+        close(conn->pipefd[1]);
+    }
+    if (conn->fileBuf != NULL) {
+        slab_free(&loop->fileBufSlab, conn->fileBuf);
+    }
+    slab_free(&loop->connSlab, conn);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Queue a receive into a provided buffer.
+ *
+ **************************************************************************
+ */
+static void
+UringArmRecv(UringLoop *loop, UringConn *conn)
+{
+    struct io_uring_sqe *sqe;
+    int space = recvbuf_space(&conn->rb);
+
+    if (space == 0) {
+        UringConnClose(loop, conn);   /* line too long */
+        return;
+    }
+
+    sqe = UringGetSqe(&loop->ring, conn, UOP_RECV);
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = conn->sock;
+    sqe->len       = space < URING_BUF_SIZE ? space : URING_BUF_SIZE;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Queue a send of (the rest of) the header and in-memory body.
+ *
+ **************************************************************************
+ */
+static void
+UringSendHeader(UringLoop *loop, UringConn *conn)
+{
+    struct io_uring_sqe *sqe = UringGetSqe(&loop->ring, conn, UOP_SEND);
+    HttpResponse *resp = &conn->resp;
+
+    memset(&conn->msg, 0, sizeof conn->msg);
+    conn->msg.msg_iov    = &resp->iov[resp->iovIdx];
+    conn->msg.msg_iovlen = resp->iovCnt - resp->iovIdx;
+
+    conn->state    = UCONN_SEND_HEADER;
+    sqe->opcode    = IORING_OP_SENDMSG;
+    sqe->fd        = conn->sock;
+    sqe->addr      = (uintptr_t)&conn->msg;
+    sqe->msg_flags = MSG_NOSIGNAL |
+                     (resp->fileOff < resp->fileEnd ? MSG_MORE : 0);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Queue the next part of the file body.
+ *
+ * Staged bytes are sent on their own; otherwise the next chunk goes
+ * through a linked pair, so that it takes a single submission.
+ *
+ **************************************************************************
+ */
+static void
+UringSendFile(UringLoop *loop, UringConn *conn)
+{
+    HttpResponse *resp = &conn->resp;
+    struct io_uring_sqe *sqe;
+    int len = conn->staged;
+
+    conn->state     = UCONN_SEND_FILE;
+    conn->fileError = false;
+
+    if (len == 0) {
+        len = resp->fileEnd - resp->fileOff < conn->chunk ?
+              resp->fileEnd - resp->fileOff : conn->chunk;
+        sqe = UringGetSqe(&loop->ring, conn, UOP_FILE_IN);
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->len   = len;
+        if (loop->useSplice) {
+            sqe->opcode        = IORING_OP_SPLICE;
+            sqe->splice_fd_in  = resp->fd;
+            sqe->splice_off_in = resp->fileOff;
+            sqe->fd            = conn->pipefd[1];
+            sqe->off           = (uint64_t)-1;
+            sqe->splice_flags  = SPLICE_F_MOVE;
+        } else {
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd     = resp->fd;
+            sqe->addr   = (uintptr_t)conn->fileBuf;
+            sqe->off    = resp->fileOff;
+        }
+        conn->stagedOff = 0;
+        conn->fileOps++;
+    }
+
+    sqe = UringGetSqe(&loop->ring, conn, UOP_FILE_OUT);
+    sqe->len = len;
+    if (loop->useSplice) {
+        sqe->opcode        = IORING_OP_SPLICE;
+        sqe->splice_fd_in  = conn->pipefd[0];
+        sqe->splice_off_in = (uint64_t)-1;
+        sqe->fd            = conn->sock;
+        sqe->off           = (uint64_t)-1;
+        sqe->splice_flags  = SPLICE_F_MOVE;
+    } else {
+        sqe->opcode    = IORING_OP_SEND;
+        sqe->fd        = conn->sock;
+        sqe->addr      = (uintptr_t)(conn->fileBuf + conn->stagedOff);
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    conn->fileOps++;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Parse buffered request lines, and start the response once the
+ *        request is complete.
+ *
+ **************************************************************************
+ */
+static void
+UringReadRequest(UringLoop *loop, UringConn *conn)
+{
+    HttpResponse *resp = &conn->resp;
+
+    while (1) {
+        char *line;
+        int n = recvbuf_getline(&conn->rb, &line);
+
+        if (n < 0) {
+            conn->state = UCONN_RECV;
+            UringArmRecv(loop, conn);
+            return;
+        }
+        if (n == 0) {
+            break;   /* end of headers */
+        }
+        LogDebug("uring-%d: HEADER: %s\n", loop->id, line);
+        if (httpd_parse_get_request(line, &conn->req) < 0) {
+            UringConnClose(loop, conn);
+            return;
+        }
+    }
+    if (!conn->req.gotURL) {
+        UringConnClose(loop, conn);
+        return;
+    }
+    if (++conn->numRequests >= svrArgs.maxRequests) {
+        conn->req.keepAlive = false;
+    }
+    httpd_prepare_response(&conn->req, resp);
+    timer_set(&loop->timers, &conn->timer,
+              httpd_send_begin(&conn->send, resp, loop->now));
+
+    if (resp->fileOff < resp->fileEnd) {
+        if (loop->useSplice && conn->pipefd[0] < 0) {
+            if (pipe2(conn->pipefd, O_CLOEXEC) < 0) {
+                perror("Failed to create a pipe");
+                UringConnClose(loop, conn);
+                return;
+            }
+            /* A chunk that does not fit would block the splice into it. */
+            conn->chunk = fcntl(conn->pipefd[1], F_SETPIPE_SZ, URING_CHUNK);
+            if (conn->chunk <= 0 || conn->chunk > URING_CHUNK) {
+                conn->chunk = fcntl(conn->pipefd[1], F_GETPIPE_SZ);
+            }
+        }
+        if (!loop->useSplice && conn->fileBuf == NULL) {
+            conn->fileBuf = slab_alloc(&loop->fileBufSlab);
+            conn->chunk   = URING_CHUNK;
+            if (conn->fileBuf == NULL) {
+                perror("Failed to allocate a file buffer");
+                UringConnClose(loop, conn);
+                return;
+            }
+        }
+    }
+    UringSendHeader(loop, conn);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Finish a response, and go on with the next request if any.
+ *
+ **************************************************************************
+ */
+static void
+UringResponseDone(UringLoop *loop, UringConn *conn)
+{
+    if (!conn->resp.keepAlive) {
+        UringConnClose(loop, conn);
+        return;
+    }
+    httpd_release_response(&conn->resp);
+    httpd_request_init(&conn->req);
+
+    /* Part of the next request may have come with this one. */
+    conn->idle = recvbuf_pending(&conn->rb) == 0;
+    timer_set(&loop->timers, &conn->timer,
+              conn->idle ? httpd_idle_deadline(loop->now) :
+                           loop->now + svrArgs.headerTimeout * 1000LL);
+    if (!conn->idle) {
+        conn->req.startNs = NowNs();
+    }
+    UringReadRequest(loop, conn);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Handle a completion for a connection.
+ *
+ **************************************************************************
+ */
+static void
+UringConnComplete(UringLoop *loop, UringConn *conn, UringOp op,
+                  const struct io_uring_cqe *cqe)
+{
+    HttpResponse *resp = &conn->resp;
+    int res = cqe->res;
+
+    conn->inflight--;
+    if (conn->state == UCONN_CLOSED) {
+        if (op == UOP_RECV && (cqe->flags & IORING_CQE_F_BUFFER)) {
+            UringProvideBuffers(loop, cqe->flags >> IORING_CQE_BUFFER_SHIFT,
+                                1);
+        }
+        UringConnClose(loop, conn);
+        return;
+    }
+
+    switch (op) {
+        case UOP_RECV:
+            if (res > 0) {
+                int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                recvbuf_put(&conn->rb, loop->bufs + bid * URING_BUF_SIZE, res);
+                UringProvideBuffers(loop, bid, 1);
+                if (conn->idle) {
+                    /* The request has begun: it must now arrive in time. */
+                    conn->idle = false;
+                    timer_set(&loop->timers, &conn->timer,
+                              loop->now + svrArgs.headerTimeout * 1000LL);
+                    conn->req.startNs = NowNs();
+                }
+                UringReadRequest(loop, conn);
+            } else if (res == -ENOBUFS) {
+                UringArmRecv(loop, conn);   /* buffers are being returned */
+            } else {
+                UringConnClose(loop, conn);   /* EOF, error or timeout */
+            }
+            break;
+        case UOP_SEND:
+            if (res < 0) {
+                UringConnClose(loop, conn);
+            } else if (!httpd_advance_iov(resp, res)) {
+                UringSendHeader(loop, conn);
+            } else if (resp->fileOff < resp->fileEnd) {
+                UringSendFile(loop, conn);
+            } else {
+                UringResponseDone(loop, conn);
+            }
+            break;
+        case UOP_FILE_IN:
+            /* A short chunk cancels the linked send; it is staged instead. */
+            if (res <= 0) {
+                conn->fileError = true;
+            } else {
+                resp->fileOff += res;
+                conn->staged  += res;
+            }
+            break;
+        case UOP_FILE_OUT:
+            if (res > 0) {
+                conn->staged    -= res;
+                conn->stagedOff += res;
+            } else if (res != -ECANCELED) {
+                conn->fileError = true;
+            }
+            break;
+        default:
+            break;
+    }
+
+    if ((op == UOP_FILE_IN || op == UOP_FILE_OUT) && --conn->fileOps == 0) {
+        if (conn->fileError) {
+            UringConnClose(loop, conn);
+        } else if (conn->staged > 0 || resp->fileOff < resp->fileEnd) {
+            UringSendFile(loop, conn);
+        } else {
+            UringResponseDone(loop, conn);
+        }
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Handle an accept completion.
+ *
+ **************************************************************************
+ */
+static void
+UringAcceptComplete(UringLoop *loop, const struct io_uring_cqe *cqe)
+{
+    UringConn *conn;
+
+    /* Draining: the listen socket may be shut down or the accept canceled. */
+    if (cqe->res < 0 && httpd_draining()) {
+        return;
+    }
+    if (cqe->res == -EINVAL && loop->multishot) {
+        Log("uring-%d: No multishot accept, accepting one at a time\n",
+            loop->id);
+        loop->multishot = false;
+        UringArmAccept(loop);
+        return;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !loop->draining) {
+        UringArmAccept(loop);
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+            Log("uring-%d: Failed to accept a connection: %s\n",
+                loop->id, strerror(-cqe->res));
+        }
+        return;
+    }
+
+    LogDebug("uring-%d: Accepted client (ssock=%u)\n", loop->id, cqe->res);
+    conn = slab_alloc(&loop->connSlab);
+    if (conn == NULL) {
+        perror("Failed to set up a new connection");
+        close(cqe->res);
+        return;
+    }
+    metrics_accepted();
+    memset(conn, 0, offsetof(UringConn, req));
+    conn->sock      = cqe->res;
+    conn->pipefd[0] = -1;
+    conn->pipefd[1] = -1;
+    httpd_request_init(&conn->req);
+    httpd_response_init(&conn->resp);
+    recvbuf_init(&conn->rb);
+    timer_set(&loop->timers, &conn->timer,
+              loop->now + svrArgs.headerTimeout * 1000LL);
+    conn->req.startNs = NowNs();
+    UringReadRequest(loop, conn);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Shut down the connections whose deadline has passed.
+ *
+ * Their pending requests then complete, with EOF or an error, and close
+ * them. A connection sending a response gets a new deadline instead, as
+ * long as the client keeps taking it.
+ *
+ * Returns the time in milliseconds until the timers next have work to
+ * do, or -1 if there is no connection.
+ *
+ **************************************************************************
+ */
+static int
+UringLoopExpire(UringLoop *loop)
+{
+    Timer *t = timer_expire(&loop->timers, loop->now);
+
+    while (t != NULL) {
+        UringConn *conn = (UringConn *)((char *)t - offsetof(UringConn,
+                                                             timer));
+        t = t->next;
+        if (conn->state != UCONN_RECV) {
+            long long deadline = httpd_send_deadline(&conn->send, conn->sock,
+                                                     loop->now);
+            if (deadline > loop->now) {
+                timer_set(&loop->timers, &conn->timer, deadline);
+                continue;
+            }
+        }
+        LogDebug("uring-%d: %s timeout (ssock=%u)\n", loop->id,
+                 conn->state != UCONN_RECV ? "Send" :
+                 conn->idle ? "Idle" : "Header", conn->sock);
+        if (conn->inflight > 0) {
+            shutdown(conn->sock, SHUT_RDWR);
+        } else {
+            UringConnClose(loop, conn);
+        }
+    }
+    return timer_next_ms(&loop->timers, loop->now);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Stop accepting, and cut short the idle connections' wait.
+ *
+ * Every connection is in the wheel, so they are all taken out of it to
+ * be looked at, and filed again.
+ *
+ **************************************************************************
+ */
+static void
+UringLoopDrain(UringLoop *loop)
+{
+    long long grace = httpd_idle_deadline(loop->now);
+    Timer *t = timer_take_all(&loop->timers);
+    struct io_uring_sqe *sqe;
+
+    Log("uring-%d: Draining %lld connections\n",
+        loop->id, loop->connSlab.inUse);
+    loop->draining = true;
+    sqe = UringGetSqe(&loop->ring, NULL, UOP_CANCEL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr   = UOP_ACCEPT;   /* the user_data of the accept */
+
+    while (t != NULL) {
+        UringConn *conn = (UringConn *)((char *)t - offsetof(UringConn,
+                                                             timer));
+        t = t->next;
+        if (conn->idle && conn->timer.deadline > grace) {
+            conn->timer.deadline = grace;
+        }
+        timer_set(&loop->timers, &conn->timer, conn->timer.deadline);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief The io_uring loop thread function.
+ *
+ **************************************************************************
+ */
+static void *
+UringLoopRun(void *arg)
+{
+    UringLoop *loop = arg;
+    Uring *ring = &loop->ring;
+
+    /* Set up here: a single-issuer ring belongs to the thread creating it. */
+    if (UringInit(ring, URING_ENTRIES) < 0) {
+        perror("Failed to set up an io_uring instance");
+        exit(EXIT_FAILURE);
+    }
+    Log("uring-%d: Starting (%s file bodies)\n",
+        loop->id, loop->useSplice ? "splice" : "read/send");
+
+    UringProvideBuffers(loop, 0, URING_NUM_BUFS);
+    UringArmAccept(loop);
+    UringArmDrain(loop);
+
+    loop->now = NowMs();
+    timer_init(&loop->timers, loop->now);
+    for (;;) {
+        unsigned head;
+        unsigned tail;
+        int timeout = UringLoopExpire(loop);
+
+        /* Checked past the expiry, which may close the last connection. */
+        if (loop->draining && loop->connSlab.inUse == 0) {
+            break;
+        }
+        if (UringSubmit(ring, 1, timeout) < 0 &&
+            errno != EINTR && errno != EBUSY && errno != ETIME) {
+            perror("Failed to wait for io_uring completions");
+            break;
+        }
+        loop->now = NowMs();
+
+        head = *ring->cqHead;
+        tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe cqe = ring->cqes[head & *ring->cqMask];
+            UringConn *conn =
+                (UringConn *)(uintptr_t)(cqe.user_data & ~(uint64_t)UOP_MASK);
+            UringOp op = cqe.user_data & UOP_MASK;
+
+            /* Free the slot first: handlers may queue more requests. */
+            __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+            if (op == UOP_ACCEPT) {
+                UringAcceptComplete(loop, &cqe);
+            } else if (op == UOP_DRAIN) {
+                UringLoopDrain(loop);
+            } else if (op == UOP_CANCEL) {
+                continue;
+            } else if (op == UOP_PROVIDE) {
+                if (cqe.res < 0) {
+                    Log("uring-%d: Failed to provide buffers: %s\n",
+                        loop->id, strerror(-cqe.res));
+                }
+            } else {
+                UringConnComplete(loop, conn, op, &cqe);
+            }
+        }
+    }
+
+    Log("uring-%d: Exiting\n", loop->id);
+    return NULL;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief The io_uring engine: one completion-driven loop per core.
+ *
+ * Each loop has its own ring with a multishot accept on the shared listen
+ * socket, and receives into a group of buffers provided to the kernel, so
+ * idle connections hold no receive buffer of the kernel's. If the kernel
+ * lacks io_uring, a required opcode, or waiting with a timeout (5.11),
+ * the epoll engine is used instead. Each loop also polls the drain fd,
+ * and returns once it is drained.
+ *
+ **************************************************************************
+ */
+void
+UringListenerLoop(int msock)
+{
+    UringLoop *loops;
+    int i;
+
+    UringProbe();
+    if (!uringFeatures.supported) {
+        Log("uring: Falling back to the epoll engine\n");
+        EventListenerLoop(msock);
+        return;
+    }
+
+    loops = calloc(svrArgs.numLoops, sizeof *loops);
+    if (loops == NULL) {
+        perror("Failed to allocate the io_uring loops");
+        return;
+    }
+
+    for (i = 0; i < svrArgs.numLoops; i++) {
+        UringLoop *loop = &loops[i];
+
+        loop->id        = i;
+        loop->msock     = msock;
+        loop->multishot = true;
+        loop->useSplice = uringFeatures.splice;
+        loop->bufs      = malloc(URING_NUM_BUFS * URING_BUF_SIZE);
+        if (loop->bufs == NULL) {
+            perror("Failed to allocate the io_uring buffers");
+            exit(EXIT_FAILURE);
+        }
+        slab_init(&loop->connSlab, "uring conn", sizeof (UringConn),
+                  CONNS_PER_CHUNK);
+        slab_init(&loop->fileBufSlab, "uring file buffer", URING_CHUNK,
+                  BUFS_PER_CHUNK);
+        if (pthread_create(&loop->thread, NULL, UringLoopRun, loop) != 0) {
+            perror("Failed to create an io_uring loop thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < svrArgs.numLoops; i++) {
+        pthread_join(loops[i].thread, NULL);
+        close(loops[i].ring.fd);
+        free(loops[i].bufs);
+        slab_destroy(&loops[i].connSlab);
+        slab_destroy(&loops[i].fileBufSlab);
+    }
+    free(loops);
+}
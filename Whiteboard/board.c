@@ -0,0 +1,1066 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "board.h"
+
+/**
+ * The slots of a shard: a table of open addressing with linear probing.
+ *
+ * Readers probe it without the shard lock. Writers therefore only ever
+ * store a board or a tombstone into a slot; to grow the table, or to
+ * sweep its tombstones out, they build a new one and publish it whole.
+ */
+typedef struct BoardSlots {
+    BoardRetired retired;
+    unsigned     numSlots;    /* a power of 2 */
+    Board       *slot[];
+} BoardSlots;
+
+/**
+ * One shard of the board index.
+ *
+ * Titles are spread over the shards by hash. Each shard has its own
+ * slots, writer lock, clock and share of the memory ceiling, so that
+ * threads using different boards rarely contend. The clock ticks at each
+ * lookup for a POST; boards are stamped with it when they are used, and
+ * the idle boards with the oldest stamps are evicted first.
+ */
+typedef struct BoardShard {
+    pthread_mutex_t lock;        /* of writers */
+    BoardSlots     *slots;       /* or NULL */
+    unsigned        numBoards;
+    unsigned        numDead;     /* tombstones */
+    unsigned        hand;        /* where eviction looks next */
+    unsigned long   clock;
+    size_t          bytes;
+} BoardShard;
+
+/**
+ * A thread that reads boards without locks. While it reads, "epoch" is
+ * the epoch it started in, and 0 otherwise.
+ */
+typedef struct BoardReader {
+    struct BoardReader *next;
+    unsigned long       epoch;
+    bool                claimed;     /* by a live thread */
+} BoardReader;
+
+static BoardShard shards[BOARD_SHARDS];
+static size_t     shardMaxBytes;
+static int        boardMaxSize;
+
+static Board      boardDead;         /* the tombstone */
+#define BOARD_DEAD (&boardDead)
+
+static unsigned long         boardEpoch = 1;
+static BoardReader          *readers;       /* pushed, never unlinked */
+static pthread_key_t         readerKey;
+static __thread BoardReader *myReader;
+static BoardRetired         *retired;       /* pushed by any thread */
+static pthread_mutex_t       reclaimLock = PTHREAD_MUTEX_INITIALIZER;
+static BoardRetired         *reclaimable;   /* under reclaimLock */
+
+static pthread_mutex_t chunkPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static BoardChunk     *chunkPool;
+static int             chunkPoolSize;
+static pthread_key_t   chunkCacheKey;
+static __thread BoardChunk *chunkCache;    /* this thread's free chunks */
+static __thread int         chunkCacheSize;
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Give a thread's reader back when the thread exits.
+ *
+ **************************************************************************
+ */
+static void
+ReaderRelease(void *arg)
+{
+    BoardReader *r = arg;
+
+    __atomic_store_n(&r->claimed, false, __ATOMIC_RELEASE);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Claim a reader for this thread: one that an exited thread gave
+ *        back, or a new one.
+ *
+ **************************************************************************
+ */
+static BoardReader *
+ReaderClaim(void)
+{
+    BoardReader *r;
+
+    for (r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r != NULL;
+         r = r->next) {
+        bool unclaimed = false;
+
+        if (__atomic_compare_exchange_n(&r->claimed, &unclaimed, true, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (r == NULL) {
+        if ((r = calloc(1, sizeof *r)) == NULL) {
+            perror("Failed to allocate a board reader");
+            exit(EXIT_FAILURE);
+        }
+        r->claimed = true;
+        r->next = __atomic_load_n(&readers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&readers, &r->next, r, true,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_setspecific(readerKey, r);
+    myReader = r;
+    return r;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Start reading without locks.
+ *
+ * Until ReaderExit(), no board, table of slots or rope this thread finds
+ * is freed.
+ *
+ **************************************************************************
+ */
+static void
+ReaderEnter(void)
+{
+    BoardReader *r = myReader != NULL ? myReader : ReaderClaim();
+    unsigned long epoch;
+
+    do {
+        epoch = __atomic_load_n(&boardEpoch, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->epoch, epoch, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    } while (__atomic_load_n(&boardEpoch, __ATOMIC_RELAXED) != epoch);
+}
+
+static void
+ReaderExit(void)
+{
+    __atomic_store_n(&myReader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Free something once no reader can see it any more. It must be
+ *        unlinked already.
+ *
+ **************************************************************************
+ */
+static void
+Retire(BoardRetired *r,                        // IN
+       void (*freeFunc)(BoardRetired *r))      // IN
+{
+    r->free = freeFunc;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    r->epoch = __atomic_load_n(&boardEpoch, __ATOMIC_RELAXED);
+    r->next = __atomic_load_n(&retired, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&retired, &r->next, r, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Advance the epoch if every reader has seen it, and free what was
+ *        retired two epochs ago.
+ *
+ * A reader that started in an epoch may hold what was retired in it,
+ * but not what was retired before. Writers call this after their
+ * changes; if another thread is reclaiming, they leave it to that one.
+ * What readers retire, the ropes of cleared boards, waits for the next.
+ *
+ **************************************************************************
+ */
+static void
+Reclaim(void)
+{
+    BoardRetired *r, *pending;
+    BoardRetired *keep = NULL;
+    BoardReader *reader;
+    unsigned long epoch;
+
+    if (__atomic_load_n(&retired, __ATOMIC_RELAXED) == NULL &&
+        __atomic_load_n(&reclaimable, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    if (pthread_mutex_trylock(&reclaimLock) != 0) {
+        return;
+    }
+
+    epoch = __atomic_load_n(&boardEpoch, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (reader = __atomic_load_n(&readers, __ATOMIC_ACQUIRE);
+         reader != NULL; reader = reader->next) {
+        unsigned long e = __atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE);
+
+        if (e != 0 && e != epoch) {
+            break;
+        }
+    }
+    if (reader == NULL) {
+        __atomic_store_n(&boardEpoch, ++epoch, __ATOMIC_SEQ_CST);
+    }
+
+    pending = __atomic_load_n(&reclaimable, __ATOMIC_RELAXED);
+    r = __atomic_exchange_n(&retired, NULL, __ATOMIC_ACQUIRE);
+    while (r != NULL) {
+        BoardRetired *next = r->next;
+
+        r->next = pending;
+        pending = r;
+        r = next;
+    }
+    while ((r = pending) != NULL) {
+        pending = r->next;
+        if (r->epoch + 2 <= epoch) {
+            r->free(r);
+        } else {
+            r->next = keep;
+            keep = r;
+        }
+    }
+    __atomic_store_n(&reclaimable, keep, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&reclaimLock);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Hash a board title (FNV-1a).
+ *
+ **************************************************************************
+ */
+static unsigned
+HashTitle(const char *title)
+{
+    unsigned hash = 2166136261u;
+
+    while (*title != '\0') {
+        hash ^= (unsigned char)*title++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Move up to "n" chunks from the top of this thread's cache to
+ *        the pool, under one lock, and free what the pool has no room
+ *        for.
+ *
+ **************************************************************************
+ */
+static void
+ChunkSpill(int n)
+{
+    BoardChunk *first = chunkCache;
+    BoardChunk *last = first;
+    int count = 1;
+
+    if (first == NULL || n <= 0) {
+        return;
+    }
+    while (count < n && last->next != NULL) {
+        last = last->next;
+        count++;
+    }
+    chunkCache      = last->next;
+    chunkCacheSize -= count;
+    last->next      = NULL;
+
+    pthread_mutex_lock(&chunkPoolLock);
+    if (chunkPoolSize + count <= BOARD_CHUNK_POOL) {
+        last->next    = chunkPool;
+        chunkPool     = first;
+        chunkPoolSize += count;
+        first = NULL;
+    }
+    pthread_mutex_unlock(&chunkPoolLock);
+
+    while (first != NULL) {
+        BoardChunk *next = first->next;
+
+        free(first);
+        first = next;
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Give this thread's cached chunks back to the pool, as it exits.
+ *
+ **************************************************************************
+ */
+static void
+ChunkCacheRelease(void *arg)
+{
+    ChunkSpill(chunkCacheSize);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Take a chunk from this thread's cache, refilling it with half
+ *        a cache of chunks from the pool under one lock, or allocate one.
+ *
+ **************************************************************************
+ */
+BoardChunk *
+BoardChunkAlloc(void)
+{
+    BoardChunk *c;
+
+    if (chunkCache == NULL) {
+        pthread_setspecific(chunkCacheKey, (void *)1);
+
+        pthread_mutex_lock(&chunkPoolLock);
+        while (chunkPool != NULL && chunkCacheSize < BOARD_CHUNK_CACHE / 2) {
+            c = chunkPool;
+            chunkPool = c->next;
+            chunkPoolSize--;
+            c->next = chunkCache;
+            chunkCache = c;
+            chunkCacheSize++;
+        }
+        pthread_mutex_unlock(&chunkPoolLock);
+    }
+
+    c = chunkCache;
+    if (c != NULL) {
+        chunkCache = c->next;
+        chunkCacheSize--;
+    } else if ((c = malloc(sizeof *c)) == NULL) {
+        perror("Failed to allocate a board chunk");
+        exit(EXIT_FAILURE);
+    }
+    c->next = NULL;
+    c->len  = 0;
+    return c;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Give a chain of chunks back to this thread's cache, spilling
+ *        half of it to the pool whenever it is full.
+ *
+ **************************************************************************
+ */
+void
+BoardChunkFreeChain(BoardChunk *c)  // IN
+{
+    if (chunkCache == NULL) {
+        pthread_setspecific(chunkCacheKey, (void *)1);
+    }
+    while (c != NULL) {
+        BoardChunk *next = c->next;
+
+        if (chunkCacheSize == BOARD_CHUNK_CACHE) {
+            ChunkSpill(BOARD_CHUNK_CACHE / 2);
+        }
+        c->next    = chunkCache;
+        chunkCache = c;
+        chunkCacheSize++;
+        c = next;
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Create an empty rope, with the reference of its board.
+ *
+ **************************************************************************
+ */
+static BoardRope *
+RopeNew(void)
+{
+    BoardRope *rope = calloc(1, sizeof *rope);
+
+    if (rope == NULL) {
+        perror("Failed to allocate a board");
+        exit(EXIT_FAILURE);
+    }
+    rope->refCount = 1;
+    return rope;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Free a retired rope and give its chunks back.
+ *
+ **************************************************************************
+ */
+static void
+RopeFree(BoardRetired *r)
+{
+    BoardRope *rope = (BoardRope *)((char *)r - offsetof(BoardRope, retired));
+
+    BoardChunkFreeChain(rope->head);
+    free(rope);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Drop a reference to a rope.
+ *
+ * The last one retires it, as a reader may be about to take a reference
+ * to it still; a reader that drops the last one therefore never touches
+ * the chunk pool either.
+ *
+ **************************************************************************
+ */
+void
+BoardRopePut(BoardRope *rope)  // IN
+{
+    if (__atomic_sub_fetch(&rope->refCount, 1, __ATOMIC_ACQ_REL) == 0) {
+        Retire(&rope->retired, RopeFree);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Create an empty board, with the reference of the index.
+ *
+ **************************************************************************
+ */
+static Board *
+BoardNew(const char *title, unsigned hash)
+{
+    Board *b = calloc(1, sizeof *b);
+
+    if (b == NULL || (b->title = strdup(title)) == NULL) {
+        perror("Failed to allocate a board");
+        exit(EXIT_FAILURE);
+    }
+    b->hash     = hash;
+    b->refCount = 1;
+    b->rope     = RopeNew();
+    b->memSize  = sizeof *b + strlen(title) + 1 + sizeof *b->rope;
+    pthread_mutex_init(&b->lock, NULL);
+    return b;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Free a retired board. Readers may still hold its rope.
+ *
+ **************************************************************************
+ */
+static void
+BoardFree(BoardRetired *r)
+{
+    Board *b = (Board *)((char *)r - offsetof(Board, retired));
+
+    BoardRopePut(b->rope);
+    pthread_mutex_destroy(&b->lock);
+    free(b->title);
+    free(b);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Take a reference to a board or rope found without a lock,
+ *        unless its last one is gone and it is being freed.
+ *
+ **************************************************************************
+ */
+static bool
+RefTryGet(int *refCount)
+{
+    int n = __atomic_load_n(refCount, __ATOMIC_ACQUIRE);
+
+    do {
+        if (n == 0) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(refCount, &n, n + 1, true,
+                                          __ATOMIC_ACQUIRE,
+                                          __ATOMIC_ACQUIRE));
+    return true;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Stamp a board with its shard's clock.
+ *
+ * A relaxed store, and only when the stamp changes, so that readers of a
+ * busy board mostly share its cache line rather than pass it around.
+ *
+ **************************************************************************
+ */
+static void
+BoardTouch(BoardShard *shard, Board *b)
+{
+    unsigned long now = __atomic_load_n(&shard->clock, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&b->lastUsed, __ATOMIC_RELAXED) != now) {
+        __atomic_store_n(&b->lastUsed, now, __ATOMIC_RELAXED);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Find a board in a table of slots, or return NULL.
+ *
+ * Safe without the shard lock, in a reader's epoch.
+ *
+ **************************************************************************
+ */
+static Board *
+SlotsFind(BoardSlots *slots, const char *title, unsigned hash)
+{
+    unsigned mask = slots->numSlots - 1;
+    unsigned i = (hash / BOARD_SHARDS) & mask;
+    Board *b;
+
+    while ((b = __atomic_load_n(&slots->slot[i], __ATOMIC_ACQUIRE)) != NULL) {
+        if (b != BOARD_DEAD && b->hash == hash &&
+            strcmp(b->title, title) == 0) {
+            return b;
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Find the first empty or dead slot that a board would be probed
+ *        for in. The shard lock must be held.
+ *
+ **************************************************************************
+ */
+static unsigned
+SlotsVacancy(const BoardSlots *slots, unsigned hash)
+{
+    unsigned mask = slots->numSlots - 1;
+    unsigned i = (hash / BOARD_SHARDS) & mask;
+
+    while (slots->slot[i] != NULL && slots->slot[i] != BOARD_DEAD) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Free a retired table of slots.
+ *
+ **************************************************************************
+ */
+static void
+SlotsFree(BoardRetired *r)
+{
+    free((char *)r - offsetof(BoardSlots, retired));
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Replace the slots of a shard with a table at most half full of
+ *        its boards and one more, without tombstones. The shard lock must
+ *        be held.
+ *
+ * Readers of the old table go on probing it until it is reclaimed.
+ *
+ **************************************************************************
+ */
+static void
+ShardRebuild(BoardShard *shard)
+{
+    BoardSlots *old = shard->slots;
+    BoardSlots *slots;
+    unsigned numSlots = BOARD_MIN_SLOTS;
+    unsigned i;
+
+    while ((shard->numBoards + 1) * 2 > numSlots) {
+        numSlots *= 2;
+    }
+    slots = calloc(1, sizeof *slots + numSlots * sizeof slots->slot[0]);
+    if (slots == NULL) {
+        perror("Failed to grow the board index");
+        exit(EXIT_FAILURE);
+    }
+    slots->numSlots = numSlots;
+    for (i = 0; old != NULL && i < old->numSlots; i++) {
+        Board *b = old->slot[i];
+
+        if (b != NULL && b != BOARD_DEAD) {
+            slots->slot[SlotsVacancy(slots, b->hash)] = b;
+        }
+    }
+    shard->numDead = 0;
+    __atomic_store_n(&shard->slots, slots, __ATOMIC_RELEASE);
+    if (old != NULL) {
+        Retire(&old->retired, SlotsFree);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Remove the board in a slot of a shard and drop the shard's
+ *        reference.
+ *
+ * The slot is left dead rather than empty, so that readers probing past
+ * it still find the boards beyond. The shard lock must be held.
+ *
+ **************************************************************************
+ */
+static void
+ShardUnlink(BoardShard *shard, unsigned i)
+{
+    Board *b = shard->slots->slot[i];
+
+    __atomic_store_n(&shard->slots->slot[i], BOARD_DEAD, __ATOMIC_RELEASE);
+    shard->numBoards--;
+    shard->numDead++;
+    shard->bytes -= b->memSize;
+    b->linked = false;
+    BoardPut(b);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Evict idle boards until the shard is within its memory share.
+ *        The shard lock must be held.
+ *
+ * Only the index's reference keeps an idle board. One that a session
+ * holds, such as "keep", is passed over: a POST to it may already have
+ * been acknowledged. Each victim is the least recently used of the next
+ * BOARD_EVICT_SAMPLES idle boards from where the last search stopped.
+ *
+ **************************************************************************
+ */
+static void
+ShardTrim(BoardShard *shard, Board *keep)
+{
+    while (shard->bytes > shardMaxBytes) {
+        BoardSlots *slots = shard->slots;
+        unsigned mask = slots->numSlots - 1;
+        Board *victim = NULL;
+        unsigned victimSlot = 0;
+        unsigned sampled = 0;
+        unsigned n;
+
+        for (n = 0; n < slots->numSlots && sampled < BOARD_EVICT_SAMPLES;
+             n++) {
+            unsigned i = (shard->hand + n) & mask;
+            Board *b = slots->slot[i];
+
+            if (b == NULL || b == BOARD_DEAD || b == keep ||
+                __atomic_load_n(&b->refCount, __ATOMIC_ACQUIRE) > 1) {
+                continue;
+            }
+            sampled++;
+            if (victim == NULL ||
+                (long)(__atomic_load_n(&b->lastUsed, __ATOMIC_RELAXED) -
+                       __atomic_load_n(&victim->lastUsed,
+                                       __ATOMIC_RELAXED)) < 0) {
+                victim     = b;
+                victimSlot = i;
+            }
+        }
+        shard->hand = (shard->hand + n) & mask;
+        if (victim == NULL) {
+            break;
+        }
+        LogDebug("Evicting board \"%s\" (%zu bytes)\n",
+                 victim->title, victim->memSize);
+        ShardUnlink(shard, victimSlot);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Initialize the board index.
+ *
+ * "maxSize" bounds the data of each board, and "maxBytes" the memory of
+ * all boards, past which the least recently used are evicted.
+ *
+ **************************************************************************
+ */
+void
+BoardInit(int maxSize,       // IN
+          size_t maxBytes)   // IN
+{
+    int i;
+
+    for (i = 0; i < BOARD_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+    pthread_key_create(&readerKey, ReaderRelease);
+    pthread_key_create(&chunkCacheKey, ChunkCacheRelease);
+    shardMaxBytes = maxBytes / BOARD_SHARDS;
+    boardMaxSize  = maxSize;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the most data a board holds.
+ *
+ **************************************************************************
+ */
+int
+BoardMaxSize(void)
+{
+    return boardMaxSize;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Look up a board by title, creating it if asked to.
+ *
+ * A plain lookup takes no lock. One that may create takes the shard lock,
+ * which also keeps the board from being evicted before the caller holds
+ * it, as a POST must.
+ *
+ * Returns the board with a reference held for the caller, to be dropped
+ * with BoardPut(), or NULL if there is no such board.
+ *
+ **************************************************************************
+ */
+Board *
+BoardGet(const char *title,  // IN
+         bool create)        // IN
+{
+    unsigned hash = HashTitle(title);
+    BoardShard *shard = &shards[hash % BOARD_SHARDS];
+    BoardSlots *slots;
+    Board *b = NULL;
+
+    if (!create) {
+        ReaderEnter();
+        do {
+            slots = __atomic_load_n(&shard->slots, __ATOMIC_ACQUIRE);
+            b = slots != NULL ? SlotsFind(slots, title, hash) : NULL;
+            /* One being freed is unlinked already; look again. */
+        } while (b != NULL && !RefTryGet(&b->refCount));
+        ReaderExit();
+        if (b != NULL) {
+            BoardTouch(shard, b);
+        }
+        return b;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    __atomic_store_n(&shard->clock, shard->clock + 1, __ATOMIC_RELAXED);
+    slots = shard->slots;
+    if (slots != NULL) {
+        b = SlotsFind(slots, title, hash);
+    }
+    if (b == NULL) {
+        unsigned i;
+
+        if (slots == NULL || (shard->numBoards + shard->numDead + 1) * 4 >
+                             slots->numSlots * 3) {
+            ShardRebuild(shard);
+            slots = shard->slots;
+        }
+        b = BoardNew(title, hash);
+        i = SlotsVacancy(slots, hash);
+        if (slots->slot[i] == BOARD_DEAD) {
+            shard->numDead--;
+        }
+        shard->numBoards++;
+        shard->bytes += b->memSize;
+        b->linked = true;
+        __atomic_store_n(&slots->slot[i], b, __ATOMIC_RELEASE);
+        ShardTrim(shard, b);
+    }
+    BoardTouch(shard, b);
+    __atomic_add_fetch(&b->refCount, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->lock);
+
+    Reclaim();
+    return b;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Drop a reference to a board.
+ *
+ **************************************************************************
+ */
+void
+BoardPut(Board *b)
+{
+    if (__atomic_sub_fetch(&b->refCount, 1, __ATOMIC_ACQ_REL) == 0) {
+        Retire(&b->retired, BoardFree);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Charge a change in the memory of a board to its shard, which
+ *        may evict other boards for it.
+ *
+ **************************************************************************
+ */
+static void
+BoardCharge(Board *b, long delta)
+{
+    BoardShard *shard = &shards[b->hash % BOARD_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    b->memSize += delta;
+    if (b->linked) {
+        shard->bytes += delta;
+        ShardTrim(shard, b);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Copy data onto the end of a rope, linking new chunks as it
+ *        fills. The rope's size is left to the caller.
+ *
+ * Returns the number of chunks linked.
+ *
+ **************************************************************************
+ */
+static int
+RopeAppend(BoardRope *rope, const char *src, int len)
+{
+    int added = 0;
+
+    while (len > 0) {
+        BoardChunk *c = rope->tail;
+        int n;
+
+        if (c == NULL || c->len == BOARD_CHUNK_SIZE) {
+            c = BoardChunkAlloc();
+            if (rope->tail != NULL) {
+                rope->tail->next = c;
+            } else {
+                rope->head = c;
+            }
+            rope->tail = c;
+            added++;
+        }
+        n = MIN(len, BOARD_CHUNK_SIZE - c->len);
+        memcpy(c->data + c->len, src, n);
+        __atomic_store_n(&c->len, c->len + n, __ATOMIC_RELAXED);
+        src += n;
+        len -= n;
+    }
+    rope->numChunks += added;
+    return added;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Cut a chain of chunks after its first "len" bytes, freeing the
+ *        rest.
+ *
+ * Returns the last chunk kept; "numChunks" is set to how many are.
+ *
+ **************************************************************************
+ */
+static BoardChunk *
+ChainCut(BoardChunk *c, int len, int *numChunks)
+{
+    *numChunks = 1;
+    while (len > c->len) {
+        len -= c->len;
+        c = c->next;
+        (*numChunks)++;
+    }
+    c->len = len;
+    BoardChunkFreeChain(c->next);
+    c->next = NULL;
+    return c;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Append a message to a board, with a newline, taking over the
+ *        chain of chunks it was received into.
+ *
+ * Appends are ordered by the board's lock, and each is seen whole once
+ * the new size is. A short message is copied into the last chunk and new
+ * ones. One of BOARD_SPLICE_MIN bytes or more has its chunks linked on as
+ * they are, so that it is not copied again, at the cost of the room left
+ * in the last chunk. Nothing already there moves. What does not fit is
+ * cut.
+ *
+ * Returns true if the whole message was stored.
+ *
+ **************************************************************************
+ */
+bool
+BoardPost(Board *b,            // IN/OUT
+          BoardChunk *data,    // IN: taken over
+          int len)             // IN
+{
+    BoardRope *rope;
+    int bytesToStore;
+    int added = 0;   /* chunks */
+
+    pthread_mutex_lock(&b->lock);
+    rope = b->rope;
+    bytesToStore = MIN(len, boardMaxSize - rope->size - 1);
+    if (bytesToStore > 0) {
+        if (bytesToStore < BOARD_SPLICE_MIN) {
+            BoardChunk *c;
+            int left = bytesToStore;
+
+            for (c = data; left > 0; c = c->next) {
+                int n = MIN(left, c->len);
+
+                added += RopeAppend(rope, c->data, n);
+                left  -= n;
+            }
+        } else {
+            int numChunks;
+            BoardChunk *last = ChainCut(data, bytesToStore, &numChunks);
+
+            if (rope->tail != NULL) {
+                rope->tail->next = data;
+            } else {
+                rope->head = data;
+            }
+            rope->tail       = last;
+            rope->numChunks += numChunks;
+            added           += numChunks;
+            data = NULL;
+        }
+
+        /* Always append a newline. */
+        added += RopeAppend(rope, "\n", 1);
+        __atomic_store_n(&rope->size, rope->size + bytesToStore + 1,
+                         __ATOMIC_RELEASE);
+    }
+    if (added > 0) {
+        BoardCharge(b, (long)added * sizeof(BoardChunk));
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    BoardChunkFreeChain(data);
+    Reclaim();
+    return bytesToStore == len || len == 0;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Clear a board, giving it a new, empty rope.
+ *
+ **************************************************************************
+ */
+void
+BoardClear(Board *b)  // IN/OUT
+{
+    BoardRope *old;
+
+    pthread_mutex_lock(&b->lock);
+    old = b->rope;
+    if (old->size > 0) {
+        __atomic_store_n(&b->rope, RopeNew(), __ATOMIC_RELEASE);
+
+        BoardCharge(b, -(long)old->numChunks * (long)sizeof(BoardChunk));
+        BoardRopePut(old);
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    Reclaim();
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get a board's data as of now, without waiting for its writers.
+ *
+ * Returns the rope with a reference held for the caller, to be dropped
+ * with BoardRopePut(); its first "size" bytes stay as they are until
+ * then.
+ *
+ **************************************************************************
+ */
+BoardRope *
+BoardSnapshot(Board *b,    // IN
+              int *size)   // OUT
+{
+    BoardRope *rope;
+
+    ReaderEnter();
+    do {
+        rope = __atomic_load_n(&b->rope, __ATOMIC_ACQUIRE);
+        /* One being freed has been replaced by a CLEAR; look again. */
+    } while (!RefTryGet(&rope->refCount));
+    ReaderExit();
+
+    *size = __atomic_load_n(&rope->size, __ATOMIC_ACQUIRE);
+    return rope;
+}
@@ -0,0 +1,85 @@
+#ifndef _BOARD_H_
+#define _BOARD_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define BOARD_SHARDS        64
+#define BOARD_MIN_SLOTS     16     /* per shard, a power of 2 */
+#define BOARD_CHUNK_SIZE    1024   /* of a board's data */
+#define BOARD_CHUNK_POOL    4096   /* free chunks kept for reuse */
+#define BOARD_CHUNK_CACHE   64     /* of those, kept by each thread */
+#define BOARD_SPLICE_MIN    (4 * BOARD_CHUNK_SIZE)  /* of a POST linked as
+                                                       received, not copied */
+#define BOARD_MAX_MEM_MB    256    /* of all boards, by default */
+#define BOARD_EVICT_SAMPLES 16     /* idle boards compared per eviction */
+
+/**
+ * Something unlinked from where lock-free readers find it. It is freed
+ * once every reader that may have found it first is done.
+ */
+typedef struct BoardRetired {
+    struct BoardRetired *next;
+    unsigned long        epoch;      /* when it was retired */
+    void               (*free)(struct BoardRetired *r);
+} BoardRetired;
+
+/**
+ * A board's data: a chain of chunks, appended to in place.
+ *
+ * A POST either copies into the last chunk, linking new ones as it fills,
+ * or, if long, links on the chunks it was received into as they are; it
+ * does so before it publishes the new "size", so the first "size" bytes
+ * never change under a reader. Only the last chunk's "len" still grows.
+ * A CLEAR starts a new rope rather than write over this one, which its
+ * readers keep, chunks and all, until they drop their references; it is
+ * freed once no reader can still be taking one.
+ */
+typedef struct BoardChunk {
+    struct BoardChunk *next;
+    int                len;      /* of "data" in use */
+    char               data[BOARD_CHUNK_SIZE];
+} BoardChunk;
+
+typedef struct BoardRope {
+    int         refCount;    /* one for the board, one per reader */
+    int         size;
+    int         numChunks;
+    BoardChunk *head;
+    BoardChunk *tail;
+    BoardRetired retired;
+} BoardRope;
+
+/**
+ * A named board.
+ *
+ * Writers take "lock". Readers take no lock, to find the board or to get
+ * a reference to its current rope, so they never wait for one another
+ * or for a POST to be copied in.
+ */
+typedef struct Board {
+    char            *title;
+    unsigned         hash;
+    int              refCount;   /* one for the index, one per user */
+    unsigned long    lastUsed;   /* by its shard's clock */
+    size_t           memSize;    /* of the board and its current rope */
+    bool             linked;     /* in the index */
+    BoardRetired     retired;
+
+    pthread_mutex_t  lock;
+    BoardRope       *rope;       /* swapped under "lock" */
+} Board;
+
+void BoardInit(int maxSize, size_t maxBytes);
+int BoardMaxSize(void);
+Board *BoardGet(const char *title, bool create);
+void BoardPut(Board *b);
+BoardChunk *BoardChunkAlloc(void);
+void BoardChunkFreeChain(BoardChunk *c);
+bool BoardPost(Board *b, BoardChunk *data, int len);
+void BoardClear(Board *b);
+BoardRope *BoardSnapshot(Board *b, int *size);
+void BoardRopePut(BoardRope *rope);
+
+#endif
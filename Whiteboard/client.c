@@ -22,14 +22,21 @@ static bool ProcessCmdHelp(int sd, char *data, int dataSize);
 static bool ProcessCmdShow(int sd, char *data, int dataSize);
 static bool ProcessCmdClear(int sd, char *data, int dataSize);
 static bool ProcessCmdPost(int sd, char *data, int dataSize);
+static bool ProcessCmdQuit(int sd, char *data, int dataSize);
+static bool ProcessCmdBoard(int sd, char *data, int dataSize);
 
 CmdHandler cmdHandlers[] = {
     { "help",  ProcessCmdHelp  },
     { "show",  ProcessCmdShow  },
     { "clear", ProcessCmdClear },
     { "post",  ProcessCmdPost  },
+    { "quit",  ProcessCmdQuit  },
+    { "board", ProcessCmdBoard },
 };
 
+static unsigned nextId = 1;   /* of the session's next request */
+static char title[MAX_TITLE_LEN];   /* of the board requests go to */
+
 
 /**
  **************************************************************************
@@ -90,11 +97,54 @@ ProcessCmdHelp(int sd,        // IN
     printf("   show          : Show the content of White Board.\n");
     printf("   clear         : Clear the content of White Board.\n");
     printf("   post message  : Post a message (\"msg\") to White Board.\n");
+    printf("   board [name]  : Switch to the named board, or the default.\n");
+    printf("   quit          : Say goodbye to the server and exit.\n");
     printf("\n");
     return true;
 }
 
 
+/**
+ **************************************************************************
+ *
+ * \brief Send a request on the session, and read the header of its reply.
+ *
+ * The request goes to the current board.
+ *
+ * Returns false if the session is over: the connection failed, the
+ * server said goodbye first, or the reply is not the one expected.
+ *
+ **************************************************************************
+ */
+static bool
+Request(int sd,              // IN
+        MsgHdr *req,         // IN/OUT: gets its id
+        const void *data,    // IN: req->dataSize bytes
+        MsgType replyType,   // IN
+        MsgHdr *reply)       // OUT
+{
+    req->id = nextId++;
+    memcpy(req->title, title, sizeof req->title);
+    if (WriteMsg(sd, req, data) <= 0) {
+        return false;
+    }
+    if (ReadFully(sd, reply, sizeof *reply) <= 0) {
+        Error("The server closed the session\n");
+        return false;
+    }
+    if (reply->type == MSG_BYE && replyType != MSG_BYE) {
+        Log("The server ended the session\n");
+        return false;
+    }
+    if (reply->type != replyType || reply->id != req->id) {
+        Error("Unexpected reply message type %d (#%u) to request #%u\n",
+              reply->type, reply->id, req->id);
+        return false;
+    }
+    return true;
+}
+
+
 /**
  **************************************************************************
  *
@@ -112,27 +162,20 @@ ProcessCmdShow(int sd,        // IN
     memset(&req, 0, sizeof req);
     req.type = MSG_SHOW;
 
-    if (WriteFully(sd, &req, sizeof req) <= 0) {
-        return false;
-    }
-
-    if (ReadFully(sd, &reply, sizeof reply) <= 0) {
-        return false;
-    }
-    if (reply.type != MSG_BOARD) {
-        Error("Unexpected reply message type %d\n", reply.type);
+    if (!Request(sd, &req, NULL, MSG_BOARD, &reply)) {
         return false;
     }
 
     while (reply.dataSize > 0) {
-        char ch;
-        if (ReadFully(sd, &ch, sizeof ch) <= 0) {
+        char buf[512];
+        int n = MIN(reply.dataSize, (int)sizeof buf);
+        if (ReadFully(sd, buf, n) <= 0) {
             return false;
         }
-        printf("%c", ch);
-        reply.dataSize--;
+        fwrite(buf, 1, n, stdout);
+        reply.dataSize -= n;
     }
-    return false;
+    return true;
 }
 
 
@@ -153,17 +196,7 @@ ProcessCmdClear(int sd,        // IN
     memset(&req, 0, sizeof req);
     req.type = MSG_CLEAR;
 
-    if (WriteFully(sd, &req, sizeof req) <= 0) {
-        return false;
-    }
-    if (ReadFully(sd, &reply, sizeof reply) <= 0) {
-        return false;
-    }
-    if (reply.type != MSG_STATUS) {
-        Error("Unexpected reply message type %d\n", reply.type);
-        return false;
-    }
-    return false;
+    return Request(sd, &req, NULL, MSG_STATUS, &reply);
 }
 
 
@@ -181,25 +214,74 @@ ProcessCmdPost(int sd,        // IN
 {
     MsgHdr req, reply;
 
+    if (dataSize > MAX_MSG_DATA_SIZE) {
+        Error("Message too long (%d bytes)\n", dataSize);
+        return true;
+    }
+
     memset(&req, 0, sizeof req);
     req.type     = MSG_POST;
     req.dataSize = dataSize;
 
-    if (WriteFully(sd, &req, sizeof req) <= 0) {
+    if (!Request(sd, &req, data, MSG_STATUS, &reply)) {
         return false;
     }
-    if (WriteFully(sd, data, dataSize) <= 0) {
-        return false;
+    if (reply.status == MSG_STATUS_FULL) {
+        Error("The board is full: the message was cut\n");
     }
+    return true;
+}
 
-    if (ReadFully(sd, &reply, sizeof reply) <= 0) {
-        return false;
+
+/**
+ **************************************************************************
+ *
+ * \brief Process the "quit" command: end the session with a goodbye.
+ *
+ **************************************************************************
+ */
+static bool
+ProcessCmdQuit(int sd,        // IN
+               char *data,    // IN
+               int dataSize)  // IN
+{
+    MsgHdr req, reply;
+
+    memset(&req, 0, sizeof req);
+    req.type = MSG_BYE;
+
+    Request(sd, &req, NULL, MSG_BYE, &reply);
+    return false;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Process the "board" command: send the next requests to the
+ *        named board, or to the default one if none is named.
+ *
+ **************************************************************************
+ */
+static bool
+ProcessCmdBoard(int sd,        // IN
+                char *data,    // IN
+                int dataSize)  // IN
+{
+    char *saveptr;
+    char *name = dataSize > 0 ? strtok_r(data, " ", &saveptr) : NULL;
+
+    if (name == NULL) {
+        name = "";
     }
-    if (reply.type != MSG_STATUS) {
-        Error("Unexpected reply message type %d\n", reply.type);
-        return false;
+    if (strlen(name) >= sizeof title) {
+        Error("Board name too long (at most %d characters)\n",
+              (int)sizeof title - 1);
+        return true;
     }
-    return false;
+    memset(title, 0, sizeof title);
+    strcpy(title, name);
+    return true;
 }
 
 
@@ -208,6 +290,9 @@ ProcessCmdPost(int sd,        // IN
  *
  * \brief Dispatch client commands.
  *
+ * The commands share one connection, the session, which ends with "quit"
+ * or at the end of the input.
+ *
  **************************************************************************
  */
 void
@@ -224,16 +309,27 @@ Client(int sock,                   // IN
         char *cmd, *saveptr;
         char *data;
         int cmdBufSize, dataSize;
+        char prompt[MAX_TITLE_LEN + 8];
         int i;
 
-        cmdBuf = readline("207> ");
+        if (title[0] != '\0') {
+            snprintf(prompt, sizeof prompt, "207:%s> ", title);
+        } else {
+            snprintf(prompt, sizeof prompt, "207> ");
+        }
+        cmdBuf = readline(prompt);
         if (cmdBuf == NULL) {
+            ProcessCmdQuit(sock, NULL, 0);
             return;
         }
 
         cmdBufSize = strlen(cmdBuf);
 
         cmd = strtok_r(cmdBuf, " ", &saveptr);
+        if (cmd == NULL) {
+            free(cmdBuf);
+            continue;
+        }
 
         data     = cmdBuf + strlen(cmd) + 1;
         dataSize = cmdBufSize - strlen(cmd);
@@ -247,7 +343,6 @@ Client(int sock,                   // IN
         }
         if (i == ARRAYSIZE(cmdHandlers)) {
             Error("Unknown command %s\n", cmd);
-            running = false;
         }
         free(cmdBuf);
     }
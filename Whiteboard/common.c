@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 #include "common.h"
@@ -19,7 +21,7 @@ Log(const char *fmt, ...)
     va_list arg;
 
     va_start(arg, fmt);
-    vfprintf(stdout, fmt, arg);
+    LogWriteV(stdout, fmt, arg);
     va_end(arg);
 }
 
@@ -37,7 +39,7 @@ Error(const char *fmt, ...)
     va_list arg;
 
     va_start(arg, fmt);
-    vfprintf(stderr, fmt, arg);
+    LogWriteV(stderr, fmt, arg);
     va_end(arg);
 }
 
@@ -105,6 +107,57 @@ WriteFully(int sd,     // IN
 }
 
 
+/**
+ **************************************************************************
+ *
+ * \brief Write a message, header and data, to the socket.
+ *
+ * Both go out in one writev(), so that on a session the data does not
+ * wait for the peer to acknowledge the header.
+ *
+ **************************************************************************
+ */
+int
+WriteMsg(int sd,              // IN
+         const MsgHdr *hdr,   // IN
+         const void *data)    // IN: hdr->dataSize bytes
+{
+    struct iovec iov[2];
+    int iovcnt = hdr->dataSize > 0 ? 2 : 1;
+    struct iovec *v = iov;
+    int nbytes = sizeof *hdr + hdr->dataSize;
+
+    iov[0].iov_base = (void *)hdr;
+    iov[0].iov_len  = sizeof *hdr;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len  = hdr->dataSize;
+
+    while (iovcnt > 0) {
+        ssize_t n = writev(sd, v, iovcnt);
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                Error("writev error: %d\n", (int)n);
+            }
+            return n;
+        }
+        while (iovcnt > 0 && (size_t)n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return nbytes;
+}
+
+
 /**
  **************************************************************************
  *
@@ -173,21 +226,30 @@ PrintMsg(const MsgHdr *msg,   // IN
 {
     switch (msg->type) {
         case MSG_SHOW:
-            Log("   %s Request: SHOW\n", prefix);
+            Log("   %s Request #%u: SHOW \"%s\"\n",
+                prefix, msg->id, msg->title);
             break;
         case MSG_CLEAR:
-            Log("   %s Request: CLEAR\n", prefix);
+            Log("   %s Request #%u: CLEAR \"%s\"\n",
+                prefix, msg->id, msg->title);
             break;
         case MSG_POST:
-            Log("   %s Request: POST (%u bytes)\n", prefix, msg->dataSize);
+            Log("   %s Request #%u: POST \"%s\" (%u bytes)\n",
+                prefix, msg->id, msg->title, msg->dataSize);
             break;
         case MSG_BOARD:
-            Log("   %s Reply: BOARD (%u bytes)\n", prefix, msg->dataSize);
+            Log("   %s Reply #%u: BOARD (%u bytes)\n",
+                prefix, msg->id, msg->dataSize);
             break;
         case MSG_STATUS:
-            Log("   %s Reply: STATUS (%u)\n", prefix, msg->status);
+            Log("   %s Reply #%u: STATUS (%u)\n",
+                prefix, msg->id, msg->status);
+            break;
+        case MSG_BYE:
+            Log("   %s #%u: BYE\n", prefix, msg->id);
             break;
         default:
-            Log("   %s Unknown message type %d\n", prefix, msg->type);
+            Log("   %s #%u: Unknown message type %d\n",
+                prefix, msg->id, msg->type);
     }
 }
@@ -6,16 +6,22 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "log.h"
+
 #define ARRAYSIZE(_x)    (sizeof(_x) / sizeof((_x)[0]))
 #define MIN(x, y)        (((x) <= (y)) ? (x) : (y))
 
 #define PORT_STRLEN      6
 #define MAX_TITLE_LEN    32
 
-#define MAX_BOARD_DATA_SIZE 8192
+#define MAX_BOARD_DATA_SIZE (1 << 20)    /* per board, by default */
+#define MAX_MSG_DATA_SIZE   (1 << 20)   /* past it, the stream is garbage */
 
 /**
  *  Message type exchanged between client/server.
+ *
+ *  A connection carries a session of requests, each answered in turn,
+ *  until either side says MSG_BYE.
  */
 typedef enum MsgType {
     MSG_UNKNOWN = 0,
@@ -26,20 +32,31 @@ typedef enum MsgType {
     /* Server -> Client */
     MSG_BOARD   = 4,
     MSG_STATUS  = 5,
+    /* Either way: the end of the session, answered in kind */
+    MSG_BYE     = 6,
 } MsgType;
 
 typedef enum MsgStatus {
     MSG_STATUS_SUCCESS = 0,
+    MSG_STATUS_UNKNOWN = 1,   /* message type */
+    MSG_STATUS_FULL    = 2,   /* the post was cut to fit the board */
 } MsgStatus;
 
 /**
  * Data type for messages exchanged between client/server.
+ *
+ * Each message is this header followed by "dataSize" bytes of data. A
+ * reply carries the "id" of its request; the server's own MSG_BYE has 0.
+ * A request names its board by "title", NUL-padded; "" is the default
+ * board.
  */
 typedef struct MsgHdr {
-    short type;
-    short status;
-    int   dataSize;
-    char  data[0];
+    short    type;
+    short    status;
+    int      dataSize;
+    unsigned id;
+    char     title[MAX_TITLE_LEN];
+    char     data[0];
 } MsgHdr;
 
 
@@ -48,6 +65,7 @@ void Error(const char *fmt, ...);
 
 int ReadFully(int sd, void *buf, int nbytes);
 int WriteFully(int sd, void *buf, int nbytes);
+int WriteMsg(int sd, const MsgHdr *hdr, const void *data);
 
 void SocketAddrToString(const struct sockaddr_in *addr, char *addrStr,
                         int addrStrLen);
@@ -0,0 +1,704 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "log.h"
+
+#define LOG_ALIGN          16
+#define LOG_MAX_RECORD     (2 * LOG_MAX_STRLEN + 512)
+#define LOG_MAX_SPEC       32
+#define LOG_ARGS_RESERVE   256        /* for fixed-size args after a %s */
+
+#define CACHELINE_ALIGNED  __attribute__((aligned(64)))
+
+/**
+ * A log message in a ring: the format string and its arguments in
+ * binary form, to be formatted later by the flusher thread.
+ */
+typedef struct LogRecord {
+    uint32_t    size;        /* whole record, a multiple of LOG_ALIGN */
+    uint32_t    toStderr;
+    const char *fmt;         /* NULL for padding up to the ring's end */
+} LogRecord;
+
+typedef enum RingState {
+    RING_ACTIVE,   /* owned by a thread */
+    RING_DEAD,     /* its thread exited; may still hold messages */
+    RING_FREE,     /* drained and ready for another thread */
+} RingState;
+
+/**
+ * A single-producer, single-consumer ring of log records.
+ *
+ * Only the owning thread moves "head" and only the flusher moves "tail",
+ * each on its own cache line, so logging takes no lock.
+ */
+typedef struct LogRing {
+    uint32_t        head CACHELINE_ALIGNED;
+    uint32_t        tail CACHELINE_ALIGNED;
+    RingState       state CACHELINE_ALIGNED;   /* changed under ringsLock */
+    struct LogRing *next;                      /* only ever appended to */
+    char            buf[LOG_RING_SIZE];
+} LogRing;
+
+/**
+ * How to pass a conversion's argument.
+ */
+typedef enum ArgType {
+    ARG_NONE,
+    ARG_INT,
+    ARG_LONG,
+    ARG_LLONG,
+    ARG_SIZE,
+    ARG_PTRDIFF,
+    ARG_INTMAX,
+    ARG_DOUBLE,
+    ARG_LDOUBLE,
+    ARG_PTR,
+    ARG_STR,
+    ARG_COUNT,     /* %n: consumed but never written */
+} ArgType;
+
+/**
+ * A parsed printf conversion specification.
+ */
+typedef struct LogSpec {
+    ArgType type;
+    int     numStars;   /* '*' width/precision arguments before it */
+    int     len;        /* length of the spec text, from the '%' */
+} LogSpec;
+
+static LogRing        *ringsHead;    /* in creation order */
+static LogRing        *ringsTail;
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t   ringKey;
+static __thread LogRing *myRing;
+
+static pthread_t       flusher;
+static pthread_mutex_t wakeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  wakeCond = PTHREAD_COND_INITIALIZER;   /* flusher */
+static pthread_cond_t  roomCond = PTHREAD_COND_INITIALIZER;   /* producers */
+static bool            flusherIdle;   /* waiting on wakeCond */
+static int             logBlocked;    /* producers waiting on roomCond */
+static bool            logRunning;
+static bool            logStopping;
+static LogOverflow     logOverflow;
+static unsigned long   logDropped;
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Parse the conversion specification starting at a '%'.
+ *
+ **************************************************************************
+ */
+static void
+LogParseSpec(const char *pct, LogSpec *spec)
+{
+    const char *p = pct + 1;
+    int lenMod = 0;   /* 'h', 'l', 'L' (long long), 'z', 't' or 'j' */
+
+    spec->numStars = 0;
+    p += strspn(p, "-+ #0'");
+    if (*p == '*') {
+        spec->numStars++;
+        p++;
+    } else {
+        p += strspn(p, "0123456789");
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->numStars++;
+            p++;
+        } else {
+            p += strspn(p, "0123456789");
+        }
+    }
+
+    if (p[0] == 'l' && p[1] == 'l') {
+        lenMod = 'L';
+        p += 2;
+    } else if (p[0] == 'h' && p[1] == 'h') {
+        lenMod = 'h';
+        p += 2;
+    } else if (*p != '\0' && strchr("hlLqjzt", *p) != NULL) {
+        lenMod = *p == 'q' ? 'L' : *p;
+        p++;
+    }
+
+    switch (*p) {
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+            spec->type = lenMod == 'l' ? ARG_LONG :
+                         lenMod == 'L' ? ARG_LLONG :
+                         lenMod == 'z' ? ARG_SIZE :
+                         lenMod == 't' ? ARG_PTRDIFF :
+                         lenMod == 'j' ? ARG_INTMAX : ARG_INT;
+            break;
+        case 'c':
+            spec->type = ARG_INT;
+            break;
+        case 'e': case 'E': case 'f': case 'F':
+        case 'g': case 'G': case 'a': case 'A':
+            spec->type = lenMod == 'L' ? ARG_LDOUBLE : ARG_DOUBLE;
+            break;
+        case 'p':
+            spec->type = ARG_PTR;
+            break;
+        case 's':
+            spec->type = ARG_STR;
+            break;
+        case 'n':
+            spec->type = ARG_COUNT;
+            break;
+        default:
+            spec->type = ARG_NONE;   /* "%%", or printed as is */
+            break;
+    }
+    if (*p != '\0') {
+        p++;
+    }
+    spec->len = p - pct;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Encode a message's arguments in binary form after its header.
+ *
+ * Strings are copied, since they may be gone by the time the message is
+ * formatted; everything else is copied by value. Strings are cut to
+ * leave room for the arguments after them.
+ *
+ * Returns the size of the whole record, or 0 if its arguments do not fit
+ * in LOG_MAX_RECORD even so.
+ *
+ **************************************************************************
+ */
+static uint32_t
+LogEncode(char *rec, const char *fmt, va_list args)
+{
+    char *p   = rec + sizeof(LogRecord);
+    char *end = rec + LOG_MAX_RECORD;
+    const char *pct;
+
+#define PUT_ARG(_type, _vatype)                         \
+    do {                                                \
+        _type _v = (_type)va_arg(args, _vatype);        \
+        if (sizeof _v > (size_t)(end - p)) {            \
+            return 0;                                   \
+        }                                               \
+        memcpy(p, &_v, sizeof _v);                      \
+        p += sizeof _v;                                 \
+    } while (0)
+
+    for (pct = strchr(fmt, '%'); pct != NULL; pct = strchr(pct, '%')) {
+        LogSpec spec;
+        int i;
+
+        LogParseSpec(pct, &spec);
+        pct += spec.len;
+        for (i = 0; i < spec.numStars; i++) {
+            PUT_ARG(int, int);
+        }
+        switch (spec.type) {
+            case ARG_INT:     PUT_ARG(int, int);                 break;
+            case ARG_LONG:    PUT_ARG(long, long);               break;
+            case ARG_LLONG:   PUT_ARG(long long, long long);     break;
+            case ARG_SIZE:    PUT_ARG(size_t, size_t);           break;
+            case ARG_PTRDIFF: PUT_ARG(ptrdiff_t, ptrdiff_t);     break;
+            case ARG_INTMAX:  PUT_ARG(intmax_t, intmax_t);       break;
+            case ARG_DOUBLE:  PUT_ARG(double, double);           break;
+            case ARG_LDOUBLE: PUT_ARG(long double, long double); break;
+            case ARG_PTR:     PUT_ARG(void *, void *);           break;
+            case ARG_COUNT:   (void)va_arg(args, void *);        break;
+            case ARG_STR: {
+                const char *s = va_arg(args, const char *);
+                ptrdiff_t room = end - p - 1 - LOG_ARGS_RESERVE;
+                size_t n;
+                if (s == NULL) {
+                    s = "(null)";
+                }
+                /* Leave room for the fixed-size arguments that may follow. */
+                n = strnlen(s, LOG_MAX_STRLEN - 1);
+                if ((ptrdiff_t)n > room) {
+                    n = room > 0 ? room : 0;
+                }
+                if (n + 1 > (size_t)(end - p)) {
+                    return 0;
+                }
+                memcpy(p, s, n);
+                p[n] = '\0';
+                p += n + 1;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+#undef PUT_ARG
+
+    return (p - rec + LOG_ALIGN - 1) & ~(LOG_ALIGN - 1);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Format an encoded record onto its stream.
+ *
+ **************************************************************************
+ */
+static void
+LogFormat(FILE *stream, const char *fmt, const char *args)
+{
+    const char *p = fmt;
+
+#define GET_ARG(_type, _v)                  \
+    _type _v;                               \
+    memcpy(&_v, args, sizeof _v);           \
+    args += sizeof _v
+
+#define PRINT_ARG(_v)                                                   \
+    (spec.numStars == 0 ? fprintf(stream, specStr, _v) :                \
+     spec.numStars == 1 ? fprintf(stream, specStr, stars[0], _v) :      \
+                          fprintf(stream, specStr, stars[0], stars[1], _v))
+
+    while (*p != '\0') {
+        const char *pct = strchr(p, '%');
+        char specStr[LOG_MAX_SPEC];
+        int stars[2];
+        LogSpec spec;
+        int i;
+
+        if (pct == NULL) {
+            fputs(p, stream);
+            break;
+        }
+        fwrite(p, 1, pct - p, stream);
+
+        LogParseSpec(pct, &spec);
+        p = pct + spec.len;
+        if (spec.len >= sizeof specStr) {
+            continue;   /* not a sane spec: drop it */
+        }
+        memcpy(specStr, pct, spec.len);
+        specStr[spec.len] = '\0';
+        for (i = 0; i < spec.numStars; i++) {
+            memcpy(&stars[i], args, sizeof(int));
+            args += sizeof(int);
+        }
+
+        switch (spec.type) {
+            case ARG_INT:     { GET_ARG(int, v);         PRINT_ARG(v); break; }
+            case ARG_LONG:    { GET_ARG(long, v);        PRINT_ARG(v); break; }
+            case ARG_LLONG:   { GET_ARG(long long, v);   PRINT_ARG(v); break; }
+            case ARG_SIZE:    { GET_ARG(size_t, v);      PRINT_ARG(v); break; }
+            case ARG_PTRDIFF: { GET_ARG(ptrdiff_t, v);   PRINT_ARG(v); break; }
+            case ARG_INTMAX:  { GET_ARG(intmax_t, v);    PRINT_ARG(v); break; }
+            case ARG_DOUBLE:  { GET_ARG(double, v);      PRINT_ARG(v); break; }
+            case ARG_LDOUBLE: { GET_ARG(long double, v); PRINT_ARG(v); break; }
+            case ARG_PTR:     { GET_ARG(void *, v);      PRINT_ARG(v); break; }
+            case ARG_STR:
+                PRINT_ARG(args);
+                args += strlen(args) + 1;
+                break;
+            case ARG_COUNT:
+                break;
+            default:
+                fputs(spec.len == 2 && pct[1] == '%' ? "%" : specStr, stream);
+                break;
+        }
+    }
+#undef GET_ARG
+#undef PRINT_ARG
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Mark the ring of an exiting thread for reuse once drained.
+ *
+ **************************************************************************
+ */
+static void
+LogRingRelease(void *arg)
+{
+    LogRing *ring = arg;
+
+    pthread_mutex_lock(&ringsLock);
+    __atomic_store_n(&ring->state, RING_DEAD, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ringsLock);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the calling thread's ring, claiming one on first use.
+ *
+ **************************************************************************
+ */
+static LogRing *
+LogGetRing(void)
+{
+    LogRing *ring;
+
+    if (myRing != NULL) {
+        return myRing;
+    }
+
+    pthread_mutex_lock(&ringsLock);
+    for (ring = ringsHead; ring != NULL; ring = ring->next) {
+        if (ring->state == RING_FREE) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof *ring);
+        if (ring != NULL && ringsTail == NULL) {
+            __atomic_store_n(&ringsHead, ring, __ATOMIC_RELEASE);
+            ringsTail = ring;
+        } else if (ring != NULL) {
+            __atomic_store_n(&ringsTail->next, ring, __ATOMIC_RELEASE);
+            ringsTail = ring;
+        }
+    }
+    if (ring != NULL) {
+        __atomic_store_n(&ring->state, RING_ACTIVE, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&ringsLock);
+
+    if (ring != NULL) {
+        pthread_setspecific(ringKey, ring);
+        myRing = ring;
+    }
+    return ring;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Copy a record into the ring, if there is room for it.
+ *
+ * A record never wraps around; if it does not fit before the end of the
+ * ring, the rest of the ring is padded and it goes to the start.
+ *
+ **************************************************************************
+ */
+static bool
+LogRingPut(LogRing *ring, const char *rec, uint32_t size)
+{
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t off = head & (LOG_RING_SIZE - 1);
+    uint32_t contig = LOG_RING_SIZE - off;
+    uint32_t need = contig < size ? contig + size : size;
+
+    if (LOG_RING_SIZE - (head - tail) < need) {
+        return false;
+    }
+    if (contig < size) {
+        LogRecord *pad = (LogRecord *)(ring->buf + off);
+        pad->size = contig;
+        pad->fmt  = NULL;
+        off = 0;
+    }
+    memcpy(ring->buf + off, rec, size);
+    __atomic_store_n(&ring->head, head + need, __ATOMIC_RELEASE);
+    return true;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Format and remove all the records in a ring.
+ *
+ * Returns the number of records formatted.
+ *
+ **************************************************************************
+ */
+static int
+LogRingDrain(LogRing *ring)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = ring->tail;
+    int count = 0;
+
+    while (tail != head) {
+        const LogRecord *rec =
+            (const LogRecord *)(ring->buf + (tail & (LOG_RING_SIZE - 1)));
+        if (rec->fmt != NULL) {
+            LogFormat(rec->toStderr ? stderr : stdout, rec->fmt,
+                      (const char *)(rec + 1));
+            count++;
+        }
+        tail += rec->size;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return count;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Drain every ring once.
+ *
+ * Returns the number of records formatted.
+ *
+ **************************************************************************
+ */
+static int
+LogDrainAll(void)
+{
+    static unsigned long reported;
+    unsigned long dropped;
+    LogRing *ring;
+    int count = 0;
+
+    for (ring = __atomic_load_n(&ringsHead, __ATOMIC_ACQUIRE);
+         ring != NULL;
+         ring = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE)) {
+        count += LogRingDrain(ring);
+        if (__atomic_load_n(&ring->state, __ATOMIC_RELAXED) == RING_DEAD) {
+            pthread_mutex_lock(&ringsLock);
+            if (ring->state == RING_DEAD &&
+                ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&ring->state, RING_FREE, __ATOMIC_RELAXED);
+            }
+            pthread_mutex_unlock(&ringsLock);
+        }
+    }
+
+    dropped = __atomic_load_n(&logDropped, __ATOMIC_RELAXED);
+    if (dropped != reported) {
+        fprintf(stderr, "log: %lu messages dropped\n", dropped - reported);
+        reported = dropped;
+        count++;
+    }
+    if (count > 0) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return count;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Tell whether any ring holds records.
+ *
+ **************************************************************************
+ */
+static bool
+LogPending(void)
+{
+    LogRing *ring;
+
+    for (ring = __atomic_load_n(&ringsHead, __ATOMIC_ACQUIRE);
+         ring != NULL;
+         ring = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) !=
+            __atomic_load_n(&ring->tail, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Wake the flusher if it is idle.
+ *
+ * The fence pairs with the one in LogFlusher(): either the flusher sees
+ * the record just queued before it sleeps, or this sees it idle.
+ *
+ **************************************************************************
+ */
+static void
+LogWakeFlusher(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&flusherIdle, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&wakeLock);
+        flusherIdle = false;
+        pthread_cond_signal(&wakeCond);
+        pthread_mutex_unlock(&wakeLock);
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief The flusher thread function.
+ *
+ * It drains the rings until they are all empty, then sleeps until a
+ * producer queues a record, and lets blocked producers retry whenever it
+ * frees room.
+ *
+ **************************************************************************
+ */
+static void *
+LogFlusher(void *arg)
+{
+    while (1) {
+        bool stopping = __atomic_load_n(&logStopping, __ATOMIC_ACQUIRE);
+
+        if (LogDrainAll() > 0) {
+            pthread_mutex_lock(&wakeLock);
+            if (logBlocked > 0) {
+                pthread_cond_broadcast(&roomCond);
+            }
+            pthread_mutex_unlock(&wakeLock);
+            continue;
+        }
+        if (stopping) {
+            break;
+        }
+
+        pthread_mutex_lock(&wakeLock);
+        __atomic_store_n(&flusherIdle, true, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (flusherIdle && !LogPending() &&
+               !__atomic_load_n(&logStopping, __ATOMIC_ACQUIRE)) {
+            pthread_cond_wait(&wakeCond, &wakeLock);
+        }
+        flusherIdle = false;
+        pthread_mutex_unlock(&wakeLock);
+    }
+    return NULL;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Start asynchronous logging.
+ *
+ * From now on, messages are queued in per-thread rings and written out
+ * by a background flusher thread. Until this is called (e.g. in the
+ * interactive clients), messages are written synchronously.
+ *
+ **************************************************************************
+ */
+void
+LogInit(LogOverflow overflow)
+{
+    if (logRunning) {
+        return;
+    }
+    logOverflow = overflow;
+    pthread_key_create(&ringKey, LogRingRelease);
+    if (pthread_create(&flusher, NULL, LogFlusher, NULL) != 0) {
+        perror("Failed to create the log flusher thread");
+        return;
+    }
+    __atomic_store_n(&logRunning, true, __ATOMIC_RELEASE);
+    atexit(LogShutdown);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Write out all queued messages and stop asynchronous logging.
+ *
+ **************************************************************************
+ */
+void
+LogShutdown(void)
+{
+    if (!__atomic_exchange_n(&logRunning, false, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    pthread_mutex_lock(&wakeLock);
+    __atomic_store_n(&logStopping, true, __ATOMIC_RELEASE);
+    pthread_cond_signal(&wakeCond);
+    pthread_mutex_unlock(&wakeLock);
+    pthread_join(flusher, NULL);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Queue a message for the flusher thread.
+ *
+ * "fmt" must stay valid until the message is written out, which holds
+ * for the string literals that all callers pass.
+ *
+ **************************************************************************
+ */
+void
+LogWriteV(FILE *stream, const char *fmt, va_list args)
+{
+    char rec[LOG_MAX_RECORD] __attribute__((aligned(LOG_ALIGN)));
+    LogRecord *hdr = (LogRecord *)rec;
+    LogRing *ring;
+
+    if (!__atomic_load_n(&logRunning, __ATOMIC_ACQUIRE) ||
+        (ring = LogGetRing()) == NULL) {
+        vfprintf(stream, fmt, args);
+        return;
+    }
+
+    hdr->size     = LogEncode(rec, fmt, args);
+    hdr->toStderr = stream == stderr;
+    if (hdr->size == 0) {
+        __atomic_add_fetch(&logDropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    hdr->fmt      = fmt;
+
+    if (LogRingPut(ring, rec, hdr->size)) {
+        LogWakeFlusher();
+        return;
+    }
+    if (logOverflow == LOG_OVERFLOW_DROP) {
+        __atomic_add_fetch(&logDropped, 1, __ATOMIC_RELAXED);
+        LogWakeFlusher();
+        return;
+    }
+
+    /* The flusher broadcasts under the lock once it has made room. */
+    pthread_mutex_lock(&wakeLock);
+    logBlocked++;
+    while (!LogRingPut(ring, rec, hdr->size)) {
+        flusherIdle = false;
+        pthread_cond_signal(&wakeCond);
+        pthread_cond_wait(&roomCond, &wakeLock);
+    }
+    logBlocked--;
+    pthread_mutex_unlock(&wakeLock);
+    LogWakeFlusher();
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Get the number of messages dropped because a ring was full, or
+ *        their arguments too large for a record.
+ *
+ **************************************************************************
+ */
+unsigned long
+LogDropped(void)
+{
+    return __atomic_load_n(&logDropped, __ATOMIC_RELAXED);
+}
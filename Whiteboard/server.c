@@ -4,35 +4,33 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "server.h"
+#include "board.h"
 
-typedef struct WhiteBoard {
-    int  dataSize;
-    char dataBuf[MAX_BOARD_DATA_SIZE];
-} WhiteBoard;
-
-static WhiteBoard board;
-
-typedef bool (*MsgFunc)(int sd, const MsgHdr *req, const char *cliName);
+typedef void (*MsgFunc)(Session *s, const MsgHdr *req);
 
 typedef struct MsgHandler {
     MsgType     type;
     MsgFunc     func;
 } MsgHandler;
 
-static bool ProcessMsgShow(int sd, const MsgHdr *req, const char *cliName);
-static bool ProcessMsgClear(int sd, const MsgHdr *req, const char *cliName);
-static bool ProcessMsgPost(int sd, const MsgHdr *req, const char *cliName);
+static void ProcessMsgShow(Session *s, const MsgHdr *req);
+static void ProcessMsgClear(Session *s, const MsgHdr *req);
+static void ProcessMsgPost(Session *s, const MsgHdr *req);
+static void ProcessMsgBye(Session *s, const MsgHdr *req);
 
 MsgHandler msgHandlers[] = {
     { MSG_SHOW,  ProcessMsgShow  },
     { MSG_CLEAR, ProcessMsgClear },
     { MSG_POST,  ProcessMsgPost  },
+    { MSG_BYE,   ProcessMsgBye   },
 };
 
 
@@ -47,7 +45,12 @@ static void
 Usage(const char *prog) // IN
 {
     Log("Usage:\n");
-    Log("    %s <port>\n", prog);
+    Log("    %s [-n loops] [-s bytes] [-m MB] <port>\n", prog);
+    Log("\n");
+    Log("    -n  number of event loop threads (default: number of cores)\n");
+    Log("    -s  most data of a board (default: %d)\n", MAX_BOARD_DATA_SIZE);
+    Log("    -m  memory for all boards, past which the least recently\n");
+    Log("        used are evicted (default: %d)\n", BOARD_MAX_MEM_MB);
     exit(EXIT_FAILURE);
 }
 
@@ -64,16 +67,258 @@ ParseArgs(int argc,            // IN
           char *argv[],        // IN
           ServerArgs *svrArgs) // OUT
 {
-    if (argc != 2) {
+    int opt;
+
+    svrArgs->numLoops     = sysconf(_SC_NPROCESSORS_ONLN);
+    svrArgs->maxBoardSize = MAX_BOARD_DATA_SIZE;
+    svrArgs->maxMemMB     = BOARD_MAX_MEM_MB;
+    while ((opt = getopt(argc, argv, "n:s:m:")) != -1) {
+        switch (opt) {
+            case 'n':
+                svrArgs->numLoops = atoi(optarg);
+                break;
+            case 's':
+                svrArgs->maxBoardSize = atoi(optarg);
+                break;
+            case 'm':
+                svrArgs->maxMemMB = atoi(optarg);
+                break;
+            default:
+                Usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || svrArgs->numLoops <= 0 ||
+        svrArgs->maxBoardSize <= 0 || svrArgs->maxMemMB <= 0) {
         Usage(argv[0]);
     }
-    svrArgs->listenPort = atoi(argv[1]);
+    svrArgs->listenPort = atoi(argv[optind]);
     if (svrArgs->listenPort == 0) {
         Usage(argv[0]);
     }
 }
 
 
+/**
+ **************************************************************************
+ *
+ * \brief Grow a session buffer to hold at least the given size.
+ *
+ **************************************************************************
+ */
+static void
+SessionGrow(char **buf,   // IN/OUT
+            int *cap,     // IN/OUT
+            int size)     // IN
+{
+    int newCap = *cap > 0 ? *cap : 256;
+
+    if (size <= *cap) {
+        return;
+    }
+    while (newCap < size) {
+        newCap *= 2;
+    }
+    *buf = realloc(*buf, newCap);
+    if (*buf == NULL) {
+        perror("Failed to grow a session buffer");
+        exit(EXIT_FAILURE);
+    }
+    *cap = newCap;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Make room for a reply at the end of "out".
+ *
+ * Returns where to write it; it is queued by SessionQueue().
+ *
+ **************************************************************************
+ */
+static char *
+SessionReserve(Session *s,  // IN/OUT
+               int size)    // IN
+{
+    if (s->outOff > 0) {
+        memmove(s->out, s->out + s->outOff, s->outLen - s->outOff);
+        s->outLen -= s->outOff;
+        s->outOff  = 0;
+    }
+    SessionGrow(&s->out, &s->outCap, s->outLen + size);
+    return s->out + s->outLen;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Queue a piece of the replies: the next "len" bytes of "out",
+ *        or of a rope, whose reference the session takes over.
+ *
+ **************************************************************************
+ */
+static void
+SessionQueue(Session *s,        // IN/OUT
+             BoardRope *rope,   // IN: or NULL
+             int len)           // IN
+{
+    SessionSeg *seg;
+
+    s->outQueued += len;
+    if (rope == NULL) {
+        s->outLen += len;
+        if (s->numSegs > s->segHead && s->segs[s->numSegs - 1].rope == NULL) {
+            s->segs[s->numSegs - 1].len += len;
+            return;
+        }
+    }
+    if (s->numSegs == s->segCap) {
+        if (s->segHead > 0) {
+            memmove(s->segs, s->segs + s->segHead,
+                    (s->numSegs - s->segHead) * sizeof *s->segs);
+            s->numSegs -= s->segHead;
+            s->segHead  = 0;
+        } else {
+            s->segCap = s->segCap > 0 ? s->segCap * 2 : 8;
+            s->segs = realloc(s->segs, s->segCap * sizeof *s->segs);
+            if (s->segs == NULL) {
+                perror("Failed to grow a session queue");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    seg = &s->segs[s->numSegs++];
+    seg->rope     = rope;
+    seg->chunk    = rope != NULL ? rope->head : NULL;
+    seg->chunkOff = 0;
+    seg->len      = len;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Find room for up to "len" more bytes of a POST's data in the
+ *        session's chunks, linking new ones as needed.
+ *
+ * Returns how many pieces of "v", up to "max", it takes; the bytes put
+ * there are then counted by SessionDataAdd().
+ *
+ **************************************************************************
+ */
+static int
+SessionDataRoom(Session *s,        // IN/OUT
+                struct iovec *v,   // OUT
+                int max,           // IN
+                int len)           // IN
+{
+    BoardChunk *c;
+    int n = 0;
+
+    if (s->dataHead == NULL) {
+        s->dataHead = s->dataFill = BoardChunkAlloc();
+    }
+    c = s->dataFill;
+    while (len > 0 && n < max) {
+        int room = MIN(len, BOARD_CHUNK_SIZE - c->len);
+
+        if (room > 0) {
+            v[n].iov_base = c->data + c->len;
+            v[n].iov_len  = room;
+            n++;
+            len -= room;
+        }
+        if (len > 0 && n < max) {
+            if (c->next == NULL) {
+                c->next = BoardChunkAlloc();
+            }
+            c = c->next;
+        }
+    }
+    return n;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Count "n" bytes of a POST's data put in the room given by
+ *        SessionDataRoom().
+ *
+ **************************************************************************
+ */
+static void
+SessionDataAdd(Session *s,  // IN/OUT
+               int n)       // IN
+{
+    s->dataLen += n;
+    while (n > 0) {
+        BoardChunk *c = s->dataFill;
+        int len = MIN(n, BOARD_CHUNK_SIZE - c->len);
+
+        c->len += len;
+        n      -= len;
+        if (c->len == BOARD_CHUNK_SIZE && c->next != NULL) {
+            s->dataFill = c->next;
+        }
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Copy the part of a POST's data that came with what was read
+ *        into "in" to the session's chunks.
+ *
+ **************************************************************************
+ */
+static void
+SessionDataCopy(Session *s,        // IN/OUT
+                const char *src,   // IN
+                int len)           // IN
+{
+    while (len > 0) {
+        struct iovec v[8];
+        int n = SessionDataRoom(s, v, ARRAYSIZE(v), len);
+        int i, copied = 0;
+
+        for (i = 0; i < n; i++) {
+            memcpy(v[i].iov_base, src + copied, v[i].iov_len);
+            copied += v[i].iov_len;
+        }
+        SessionDataAdd(s, copied);
+        src += copied;
+        len -= copied;
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Queue a reply, header and data, to be written to the client.
+ *
+ **************************************************************************
+ */
+static void
+SessionReply(Session *s,          // IN/OUT
+             const MsgHdr *reply, // IN
+             const void *data)    // IN: reply->dataSize bytes
+{
+    char *out = SessionReserve(s, sizeof *reply + reply->dataSize);
+
+    memcpy(out, reply, sizeof *reply);
+    if (reply->dataSize > 0) {
+        memcpy(out + sizeof *reply, data, reply->dataSize);
+    }
+    SessionQueue(s, NULL, sizeof *reply + reply->dataSize);
+
+    PrintMsg(reply, s->cliName);
+}
+
+
 /**
  **************************************************************************
  *
@@ -81,28 +326,33 @@ ParseArgs(int argc,            // IN
  *
  **************************************************************************
  */
-static bool
-ProcessMsgShow(int sd,               // IN
-               const MsgHdr *req,    // IN
-               const char *cliName)  // IN
+static void
+ProcessMsgShow(Session *s,          // IN/OUT
+               const MsgHdr *req)   // IN
 {
     MsgHdr reply;
-
-    PrintMsg(req, cliName);
+    Board *b = BoardGet(req->title, false);
+    BoardRope *rope = NULL;
 
     memset(&reply, 0, sizeof reply);
-    reply.type     = MSG_BOARD;
-    reply.dataSize = board.dataSize;
+    reply.type = MSG_BOARD;
+    reply.id   = req->id;
 
-    if (WriteFully(sd, &reply, sizeof reply) <= 0) {
-        return false;
+    if (b != NULL) {
+        rope = BoardSnapshot(b, &reply.dataSize);
+        BoardPut(b);
     }
-    if (WriteFully(sd, board.dataBuf, board.dataSize) <= 0) {
-        return false;
+
+    /* The data goes from the board's chunks, as they are. */
+    memcpy(SessionReserve(s, sizeof reply), &reply, sizeof reply);
+    SessionQueue(s, NULL, sizeof reply);
+    if (reply.dataSize > 0) {
+        SessionQueue(s, rope, reply.dataSize);
+    } else if (rope != NULL) {
+        BoardRopePut(rope);
     }
 
-    PrintMsg(&reply, cliName);
-    return true;
+    PrintMsg(&reply, s->cliName);
 }
 
 
@@ -113,28 +363,27 @@ ProcessMsgShow(int sd,               // IN
  *
  **************************************************************************
  */
-static bool
-ProcessMsgClear(int sd,               // IN
-                const MsgHdr *req,    // IN
-                const char *cliName)  // IN
+static void
+ProcessMsgClear(Session *s,          // IN/OUT
+                const MsgHdr *req)   // IN
 {
     MsgHdr reply;
-
-    PrintMsg(req, cliName);
+    Board *b;
 
     memset(&reply, 0, sizeof reply);
     reply.type     = MSG_STATUS;
     reply.status   = MSG_STATUS_SUCCESS;
     reply.dataSize = 0;
+    reply.id       = req->id;
 
-    board.dataSize = 0;
-
-    if (WriteFully(sd, &reply, sizeof reply) <= 0) {
-        return false;
+    /* A board never posted to, or since evicted, is empty already. */
+    b = BoardGet(req->title, false);
+    if (b != NULL) {
+        BoardClear(b);
+        BoardPut(b);
     }
 
-    PrintMsg(&reply, cliName);
-    return true;
+    SessionReply(s, &reply, NULL);
 }
 
 
@@ -143,51 +392,278 @@ ProcessMsgClear(int sd,               // IN
  *
  * \brief Handler for MSG_POST.
  *
+ * The message is only appended once it has all come, so that the posts
+ * of clients sending at the same time do not mix. The board is created by
+ * its first post; one that does not fit is cut, and answered with
+ * MSG_STATUS_FULL.
+ *
  **************************************************************************
  */
-static bool
-ProcessMsgPost(int sd,               // IN
-               const MsgHdr *req,    // IN
-               const char *cliName)  // IN
+static void
+ProcessMsgPost(Session *s,          // IN/OUT
+               const MsgHdr *req)   // IN
 {
     MsgHdr reply;
-    int bytesToStore, bytesToSkip;
+    Board *b = BoardGet(req->title, true);
+    bool whole = s->dataLen == req->dataSize;
 
-    PrintMsg(req, cliName);
+    /* The board takes the chunks the data was received into. */
+    whole = BoardPost(b, s->dataHead, s->dataLen) && whole;
+    s->dataHead = s->dataFill = NULL;
+    BoardPut(b);
 
-    bytesToStore = MIN(req->dataSize,
-                       MAX_BOARD_DATA_SIZE - board.dataSize - 1);
-    bytesToSkip = req->dataSize - bytesToStore;
+    memset(&reply, 0, sizeof reply);
+    reply.type     = MSG_STATUS;
+    reply.status   = whole ? MSG_STATUS_SUCCESS : MSG_STATUS_FULL;
+    reply.dataSize = 0;
+    reply.id       = req->id;
 
-    if (bytesToStore > 0) {
-        if (ReadFully(sd, board.dataBuf + board.dataSize, bytesToStore) <= 0) {
-            return false;
-        }
-        board.dataSize += bytesToStore;
+    SessionReply(s, &reply, NULL);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Handler for MSG_BYE: answer it, and end the session.
+ *
+ **************************************************************************
+ */
+static void
+ProcessMsgBye(Session *s,          // IN/OUT
+              const MsgHdr *req)   // IN
+{
+    MsgHdr reply;
+
+    memset(&reply, 0, sizeof reply);
+    reply.type = MSG_BYE;
+    reply.id   = req->id;
+
+    SessionReply(s, &reply, NULL);
+    s->bye = true;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Answer a request of an unknown type, so that the session goes
+ *        on.
+ *
+ **************************************************************************
+ */
+static void
+ProcessMsgUnknown(Session *s,          // IN/OUT
+                  const MsgHdr *req)   // IN
+{
+    MsgHdr reply;
 
-        /* Always append a newline. */
-        board.dataBuf[board.dataSize] = '\n';
-        board.dataSize++;
+    Error("   [%s] Unknown message type %d\n", s->cliName, req->type);
+
+    memset(&reply, 0, sizeof reply);
+    reply.type   = MSG_STATUS;
+    reply.status = MSG_STATUS_UNKNOWN;
+    reply.id     = req->id;
+
+    SessionReply(s, &reply, NULL);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Dispatch a request whose data has all come.
+ *
+ **************************************************************************
+ */
+static void
+SessionDispatch(Session *s)  // IN/OUT
+{
+    int i;
+
+    PrintMsg(&s->req, s->cliName);
+    for (i = 0; i < ARRAYSIZE(msgHandlers); i++) {
+        MsgHandler *handler = &msgHandlers[i];
+        if (handler->type == s->req.type) {
+            handler->func(s, &s->req);
+            break;
+        }
     }
+    if (i == ARRAYSIZE(msgHandlers)) {
+        ProcessMsgUnknown(s, &s->req);
+    }
+    BoardChunkFreeChain(s->dataHead);
+    s->dataHead = s->dataFill = NULL;
+    s->hdrBytes = 0;
+    s->dataLen  = 0;
+}
 
-    while (bytesToSkip > 0) {
-        char ch;
-        if (ReadFully(sd, &ch, 1) <= 0) {
-            return false;
+
+/**
+ **************************************************************************
+ *
+ * \brief Parse the requests read so far, and dispatch those complete.
+ *
+ * Parsing stops early once enough replies are queued, until the client
+ * takes them, or once it has said goodbye.
+ *
+ * Returns false if a message is too large to be framed right.
+ *
+ **************************************************************************
+ */
+static bool
+SessionParse(Session *s)  // IN/OUT
+{
+    while (s->inOff < s->inLen && !s->bye &&
+           s->outQueued < SESSION_OUT_MAX) {
+        int avail = s->inLen - s->inOff;
+
+        if (s->hdrBytes < sizeof s->req) {
+            int n = MIN(avail, (int)sizeof s->req - s->hdrBytes);
+
+            memcpy((char *)&s->req + s->hdrBytes, s->in + s->inOff, n);
+            s->hdrBytes += n;
+            s->inOff    += n;
+            if (s->hdrBytes < sizeof s->req) {
+                break;
+            }
+            if (s->req.dataSize < 0 || s->req.dataSize > MAX_MSG_DATA_SIZE) {
+                Error("   [%s] Bad message size %d\n",
+                      s->cliName, s->req.dataSize);
+                return false;
+            }
+            s->req.title[sizeof s->req.title - 1] = '\0';
+            s->dataLeft = s->req.dataSize;
+        } else {
+            int n = MIN(avail, s->dataLeft);
+
+            /* Only a POST keeps its data, and only what a board holds. */
+            if (s->req.type == MSG_POST && s->dataLen < BoardMaxSize()) {
+                SessionDataCopy(s, s->in + s->inOff,
+                                MIN(n, BoardMaxSize() - s->dataLen));
+            }
+            s->dataLeft -= n;
+            s->inOff    += n;
+        }
+        if (s->dataLeft == 0) {
+            SessionDispatch(s);
         }
-        bytesToSkip--;
     }
+    return true;
+}
 
-    memset(&reply, 0, sizeof reply);
-    reply.type     = MSG_STATUS;
-    reply.status   = MSG_STATUS_SUCCESS;
-    reply.dataSize = 0;
 
-    if (WriteFully(sd, &reply, sizeof reply) <= 0) {
-        return false;
+/**
+ **************************************************************************
+ *
+ * \brief Consume "n" written bytes from the queued replies.
+ *
+ **************************************************************************
+ */
+static void
+SessionConsume(Session *s,  // IN/OUT
+               size_t n)    // IN
+{
+    while (n > 0) {
+        SessionSeg *seg = &s->segs[s->segHead];
+        int len = MIN(n, (size_t)seg->len);
+
+        seg->len     -= len;
+        s->outQueued -= len;
+        n            -= len;
+        if (seg->rope == NULL) {
+            s->outOff += len;
+        } else {
+            /* Only step to a next chunk that the data goes on to. */
+            seg->chunkOff += len;
+            while (seg->len > 0) {
+                int chunkLen = __atomic_load_n(&seg->chunk->len,
+                                               __ATOMIC_RELAXED);
+
+                if (seg->chunkOff < chunkLen) {
+                    break;
+                }
+                seg->chunk     = seg->chunk->next;
+                seg->chunkOff -= chunkLen;
+            }
+        }
+        if (seg->len == 0) {
+            if (seg->rope != NULL) {
+                BoardRopePut(seg->rope);
+            }
+            s->segHead++;
+        }
     }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Write as much of the queued replies as the socket takes.
+ *
+ * They go out in one writev() per SESSION_IOV_MAX pieces: the bytes of
+ * "out" between the board data, and each chunk of the data.
+ *
+ * Returns false if the connection failed.
+ *
+ **************************************************************************
+ */
+static bool
+SessionFlush(Session *s)  // IN/OUT
+{
+    while (s->segHead < s->numSegs) {
+        struct iovec v[SESSION_IOV_MAX];
+        int iovcnt = 0;
+        int outPos = s->outOff;
+        int i;
+        ssize_t n;
+
+        for (i = s->segHead; i < s->numSegs && iovcnt < SESSION_IOV_MAX;
+             i++) {
+            const SessionSeg *seg = &s->segs[i];
+
+            if (seg->rope == NULL) {
+                v[iovcnt].iov_base = s->out + outPos;
+                v[iovcnt].iov_len  = seg->len;
+                iovcnt++;
+                outPos += seg->len;
+            } else {
+                BoardChunk *chunk = seg->chunk;
+                int off = seg->chunkOff;
+                int left = seg->len;
+
+                while (iovcnt < SESSION_IOV_MAX) {
+                    int chunkLen = __atomic_load_n(&chunk->len,
+                                                   __ATOMIC_RELAXED);
+                    int len = MIN(left, chunkLen - off);
+
+                    v[iovcnt].iov_base = chunk->data + off;
+                    v[iovcnt].iov_len  = len;
+                    iovcnt++;
+                    left -= len;
+                    if (left == 0) {
+                        break;
+                    }
+                    chunk = chunk->next;
+                    off   = 0;
+                }
+            }
+        }
 
-    PrintMsg(&reply, cliName);
+        n = writev(s->sd, v, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        SessionConsume(s, n);
+    }
+    s->segHead = 0;
+    s->numSegs = 0;
+    s->outOff  = 0;
+    s->outLen  = 0;
     return true;
 }
 
@@ -195,43 +671,142 @@ ProcessMsgPost(int sd,               // IN
 /**
  **************************************************************************
  *
- * \brief The server routine to handle requests from a particular client.
+ * \brief Create the session of a newly accepted, non-blocking socket.
+ *
+ **************************************************************************
+ */
+Session *
+SessionNew(int sd,               // IN
+           const char *cliName)  // IN
+{
+    Session *s = calloc(1, sizeof *s);
+
+    if (s == NULL) {
+        perror("Failed to allocate a session");
+        exit(EXIT_FAILURE);
+    }
+    s->sd = sd;
+    snprintf(s->cliName, sizeof s->cliName, "%s", cliName);
+    return s;
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Close a session's socket, and free it.
  *
  **************************************************************************
  */
 void
-Server(int sd)  // IN
+SessionFree(Session *s)  // IN
 {
-    struct sockaddr_storage cliAddr;
-    char cliName[INET6_ADDRSTRLEN + PORT_STRLEN];
-    socklen_t cliAddrLen;
-    MsgHdr req;
     int i;
 
-    cliAddrLen = sizeof cliAddr;
-    if (getpeername(sd, (struct sockaddr *)&cliAddr, &cliAddrLen) < 0) {
-        perror("Failed to get peer address info for client socket");
-        close(sd);
-        return;
+    for (i = s->segHead; i < s->numSegs; i++) {
+        if (s->segs[i].rope != NULL) {
+            BoardRopePut(s->segs[i].rope);
+        }
     }
-    SocketAddrToString6((const struct sockaddr *)&cliAddr,
-                        cliName, sizeof cliName);
+    close(s->sd);
+    BoardChunkFreeChain(s->dataHead);
+    free(s->out);
+    free(s->segs);
+    free(s);
+}
 
-    Log("\nClient %s (sock=%u) connected\n", cliName, sd);
 
-    if (ReadFully(sd, &req, sizeof(req)) > 0) {
-        for (i = 0; i < ARRAYSIZE(msgHandlers); i++) {
-            MsgHandler *handler = &msgHandlers[i];
-            if (handler->type == req.type) {
-                handler->func(sd, &req, cliName);
-                break;
+/**
+ **************************************************************************
+ *
+ * \brief Serve a session as far as its socket allows.
+ *
+ * Its socket is edge-triggered for both reading and writing, so the
+ * session reads until the socket has nothing more, unless it must wait
+ * for the client to take its replies: then the socket becoming writable
+ * brings it back here.
+ *
+ * Returns false once the session is over: the client said goodbye and
+ * has the answer, went away, or sent a message that cannot be framed.
+ *
+ **************************************************************************
+ */
+bool
+SessionHandleEvent(Session *s)  // IN/OUT
+{
+    for (;;) {
+        struct iovec v[SESSION_IOV_MAX];
+        int iovcnt, i;
+        int room = 0;   /* in the chunks */
+        int n;
+
+        if (!SessionParse(s) || !SessionFlush(s)) {
+            return false;
+        }
+        if (s->bye) {
+            return s->outQueued > 0;
+        }
+        if (s->outQueued >= SESSION_OUT_MAX) {
+            return true;
+        }
+        if (s->inOff < s->inLen) {
+            continue;
+        }
+
+        /* A POST's data goes straight into its chunks, the rest to "in". */
+        iovcnt = 0;
+        if (s->hdrBytes == sizeof s->req && s->req.type == MSG_POST &&
+            s->dataLeft > 0 && s->dataLen < BoardMaxSize()) {
+            iovcnt = SessionDataRoom(s, v, SESSION_IOV_MAX - 1,
+                                     MIN(s->dataLeft,
+                                         BoardMaxSize() - s->dataLen));
+            for (i = 0; i < iovcnt; i++) {
+                room += v[i].iov_len;
             }
         }
-        if (i == ARRAYSIZE(msgHandlers)) {
-            Error("   [%s] Unknown message type %d\n", cliName, req.type);
+        v[iovcnt].iov_base = s->in;
+        v[iovcnt].iov_len  = sizeof s->in;
+
+        n = readv(s->sd, v, iovcnt + 1);
+        if (n > 0) {
+            int direct = MIN(n, room);
+
+            if (direct > 0) {
+                SessionDataAdd(s, direct);
+                s->dataLeft -= direct;
+                if (s->dataLeft == 0) {
+                    SessionDispatch(s);
+                }
+            }
+            s->inOff = 0;
+            s->inLen = n - direct;
+        } else if (n == 0) {
+            return false;
+        } else if (errno != EINTR) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
         }
     }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Tell a client that its session is over, as the server stops.
+ *
+ * The goodbye goes after the replies already queued, as far as the
+ * socket takes them without waiting.
+ *
+ **************************************************************************
+ */
+void
+SessionBye(Session *s)  // IN/OUT
+{
+    MsgHdr bye;
+
+    memset(&bye, 0, sizeof bye);
+    bye.type = MSG_BYE;
 
-    Log("Client %s (sock=%u) disconnected\n\n", cliName, sd);
-    close(sd);
+    SessionReply(s, &bye, NULL);
+    SessionFlush(s);
 }
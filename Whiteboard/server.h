@@ -1,14 +1,82 @@
 #ifndef _SERVER_H_
 #define _SERVER_H_
 
+#include <stdbool.h>
+
+#include "common.h"
+#include "board.h"
+
+#define SESSION_IN_SIZE   4096          /* read from the socket at once */
+#define SESSION_OUT_MAX   (64 * 1024)   /* of queued replies, to stop
+                                           parsing requests at */
+#define SESSION_IOV_MAX   64            /* pieces written or read at
+                                           once */
+
 /**
  * The server command line arguments.
  */
 typedef struct ServerArgs {
     unsigned short listenPort;
+    int            numLoops;
+    int            maxBoardSize;   /* of each board's data */
+    int            maxMemMB;       /* of all boards, past which idle ones
+                                      are evicted */
 } ServerArgs;
 
+/**
+ * A piece of the replies queued on a session: either bytes of its "out"
+ * buffer, or board data, sent from the board's rope as it is.
+ */
+typedef struct SessionSeg {
+    BoardRope  *rope;      /* held; NULL for the next "len" bytes of "out" */
+    BoardChunk *chunk;     /* of "rope", where the rest starts */
+    int         chunkOff;
+    int         len;       /* left to write */
+} SessionSeg;
+
+/**
+ * A client's session, served without ever blocking on the client.
+ *
+ * Requests are parsed from "in" as it fills: first the header, then its
+ * data, of which a POST keeps what a board may take in board chunks, to
+ * be handed to the board once the request is complete. Data that follows
+ * a POST's header is read straight into its chunks. Replies are queued
+ * as "segs", headers in "out" and board data by reference, and written as
+ * the socket takes them.
+ */
+typedef struct Session {
+    int             sd;
+    char            cliName[INET6_ADDRSTRLEN + PORT_STRLEN];
+    struct Session *prev;         /* in the server's list of sessions */
+    struct Session *next;
+
+    char            in[SESSION_IN_SIZE];
+    int             inOff;
+    int             inLen;
+
+    MsgHdr          req;          /* being parsed */
+    int             hdrBytes;     /* of "req" read so far */
+    int             dataLeft;     /* of its data still to read */
+    BoardChunk     *dataHead;     /* kept of a POST's data */
+    BoardChunk     *dataFill;     /* being filled; empty ones may follow */
+    int             dataLen;
+
+    char           *out;
+    int             outOff;
+    int             outLen;
+    int             outCap;
+    SessionSeg     *segs;
+    int             segHead;
+    int             numSegs;
+    int             segCap;
+    int             outQueued;    /* bytes in "segs" */
+    bool            bye;          /* closing once the replies are written */
+} Session;
+
 void ParseArgs(int argc, char *argv[], ServerArgs *svrArgs);
-void Server(int sd);
+Session *SessionNew(int sd, const char *cliName);
+void SessionFree(Session *s);
+bool SessionHandleEvent(Session *s);
+void SessionBye(Session *s);
 
 #endif
@@ -2,20 +2,66 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/time.h>
-#include <sys/select.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "server.h"
+#include "board.h"
+
+#define MAX_EVENTS       64
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+/**
+ * An event loop, run by its own thread, and the sessions it serves.
+ */
+typedef struct EventLoop {
+    int        id;
+    int        epfd;
+    pthread_t  thread;
+    Session   *sessions;      /* open, for the goodbye on stop */
+} EventLoop;
 
 static int            msock           = -1;
 static volatile bool  listenerRunning = true;
+static int            stopPipe[2]     = { -1, -1 };   /* wakes the loops */
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Stop the server: every loop wakes up on the stop pipe, and
+ *        returns.
+ *
+ * Only async-signal-safe calls are made here.
+ *
+ **************************************************************************
+ */
+static void
+StopServer(void)
+{
+    char ch = 0;
+
+    listenerRunning = false;
+    if (msock > 0) {
+        shutdown(msock, SHUT_RDWR);
+    }
+    if (write(stopPipe[1], &ch, 1) < 0) {
+        /* No loops yet: they see "listenerRunning" as they start. */
+    }
+}
 
 
 /**
@@ -29,10 +75,7 @@ static void
 SignalHandler(int signo)
 {
     if (signo == SIGINT) {
-        if (msock > 0) {
-            shutdown(msock, SHUT_RDWR);
-        }
-        listenerRunning = false;
+        StopServer();
     }
 }
 
@@ -66,7 +109,12 @@ CreatePassiveTCP6(unsigned port)
         exit(EXIT_FAILURE);
     }
 
-    if (listen(msock, 10) < 0) {
+    if (fcntl(msock, F_SETFL, O_NONBLOCK) < 0) {
+        perror("Failed to make the listen socket non-blocking");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(msock, SOMAXCONN) < 0) {
         perror("Failed to listen for connections");
         exit(EXIT_FAILURE);
     }
@@ -85,19 +133,21 @@ CreatePassiveTCP6(unsigned port)
  **************************************************************************
  */
 static bool
-ValidateClientSocket(int ssock)   // IN
+ValidateClientSocket(int ssock,       // IN
+                     char *cliName,   // OUT
+                     int cliNameLen)  // IN
 {
     struct sockaddr_storage localAddr;
     struct sockaddr_storage cliAddr;
     socklen_t localAddrLen;
     socklen_t cliAddrLen;
     char svrName[INET6_ADDRSTRLEN + PORT_STRLEN];
-    char cliName[INET6_ADDRSTRLEN + PORT_STRLEN];
 
     if (ssock < 0) {
-        if (listenerRunning && errno != EINTR) {
+        if (listenerRunning && errno != EINTR && errno != EAGAIN &&
+            errno != EWOULDBLOCK && errno != ECONNABORTED) {
             perror("Failed to accept a connection");
-            listenerRunning = false;
+            StopServer();
         }
         return false;
     }
@@ -119,8 +169,9 @@ ValidateClientSocket(int ssock)   // IN
     SocketAddrToString6((const struct sockaddr *)&localAddr,
                         svrName, sizeof svrName);
     SocketAddrToString6((const struct sockaddr *)&cliAddr,
-                        cliName, sizeof cliName);
-    Log("Accepted client %s at server %s\n", cliName, svrName);
+                        cliName, cliNameLen);
+    Log("Accepted client %s at server %s (sock=%u)\n",
+        cliName, svrName, ssock);
 
     return true;
 }
@@ -129,45 +180,202 @@ ValidateClientSocket(int ssock)   // IN
 /**
  **************************************************************************
  *
- * \brief The server loop to accept new client connections.
+ * \brief Accept the pending connections, and start their sessions on
+ *        this loop.
  *
  **************************************************************************
  */
 static void
-ServerListenerLoop(void)
+AcceptClients(EventLoop *loop)  // IN/OUT
 {
-    fd_set rfds;
-    fd_set afds;
-    int nfds;
-    int fd;
+    while (listenerRunning) {
+        char cliName[INET6_ADDRSTRLEN + PORT_STRLEN];
+        struct sockaddr_storage cliAddr;
+        socklen_t cliAddrLen = sizeof cliAddr;
+        struct epoll_event ev;
+        Session *s;
+        int ssock;
+
+        ssock = accept(msock, (struct sockaddr *)&cliAddr, &cliAddrLen);
+        if (!ValidateClientSocket(ssock, cliName, sizeof cliName)) {
+            if (ssock < 0 && errno != ECONNABORTED) {
+                return;
+            }
+            continue;
+        }
+        if (fcntl(ssock, F_SETFL, O_NONBLOCK) < 0) {
+            perror("Failed to make a client socket non-blocking");
+            close(ssock);
+            continue;
+        }
+
+        s = SessionNew(ssock, cliName);
+        ev.events   = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = s;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, ssock, &ev) < 0) {
+            perror("Failed to watch a client socket");
+            SessionFree(s);
+            continue;
+        }
+        s->next = loop->sessions;
+        if (loop->sessions != NULL) {
+            loop->sessions->prev = s;
+        }
+        loop->sessions = s;
+    }
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief End a client's session: close its socket, and free it.
+ *
+ **************************************************************************
+ */
+static void
+CloseClient(EventLoop *loop,  // IN/OUT
+            Session *s)       // IN
+{
+    Log("Client %s (sock=%u) disconnected\n\n", s->cliName, s->sd);
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        loop->sessions = s->next;
+    }
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+    SessionFree(s);
+}
+
 
-    nfds = getdtablesize();  // Get descriptor table size
-    FD_ZERO(&afds);
-    FD_SET(msock, &afds);    // Watch msock
+/**
+ **************************************************************************
+ *
+ * \brief The event loop thread function: accept new client connections,
+ *        and serve their sessions.
+ *
+ * All sockets are non-blocking, so a slow client only ever holds up its
+ * own session. The listen socket is in every loop's epoll set with
+ * EPOLLEXCLUSIVE, so a new connection wakes up only one of them, which
+ * then serves it for good. When the server stops, the clients still
+ * connected are told so with a MSG_BYE.
+ *
+ **************************************************************************
+ */
+static void *
+EventLoopRun(void *arg)
+{
+    EventLoop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
 
     while (listenerRunning) {
-        memcpy(&rfds, &afds, sizeof(rfds));
-        if (select(nfds, &rfds, NULL, NULL, NULL) < 0) {
-            perror("Failed to select");
-            return;
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        int i;
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to wait for events");
+            break;
         }
+        for (i = 0; i < n; i++) {
+            Session *s = events[i].data.ptr;
+
+            if (s == NULL) {
+                AcceptClients(loop);
+            } else if (s == (Session *)loop) {
+                break;   /* the stop pipe */
+            } else if (!SessionHandleEvent(s)) {
+                CloseClient(loop, s);
+            }
+        }
+    }
 
-        if (FD_ISSET(msock, &rfds)) {
-            int ssock;
-            struct sockaddr_storage cliAddr;
-            socklen_t cliAddrLen = sizeof cliAddr;
-            ssock = accept(msock, (struct sockaddr *)&cliAddr, &cliAddrLen);
+    while (loop->sessions != NULL) {
+        SessionBye(loop->sessions);
+        CloseClient(loop, loop->sessions);
+    }
+    close(loop->epfd);
+    return NULL;
+}
 
-            if (ValidateClientSocket(ssock)) {
-                FD_SET(ssock, &afds);
-            }
+
+/**
+ **************************************************************************
+ *
+ * \brief Start the event loops, and wait for them to return once the
+ *        server stops.
+ *
+ **************************************************************************
+ */
+static void
+ServerListenerLoop(int numLoops)  // IN
+{
+    EventLoop *loops = calloc(numLoops, sizeof *loops);
+    int i;
+
+    if (loops == NULL || pipe(stopPipe) < 0) {
+        perror("Failed to set up the event loops");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < numLoops; i++) {
+        EventLoop *loop = &loops[i];
+        struct epoll_event ev;
+
+        loop->id   = i;
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd < 0) {
+            perror("Failed to create the epoll instance");
+            exit(EXIT_FAILURE);
+        }
+        ev.events   = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;      // Watch msock
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, msock, &ev) < 0) {
+            perror("Failed to watch the listen socket");
+            exit(EXIT_FAILURE);
         }
+        ev.events   = EPOLLIN;
+        ev.data.ptr = loop;      // Watch the stop pipe
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, stopPipe[0], &ev) < 0) {
+            perror("Failed to watch the stop pipe");
+            exit(EXIT_FAILURE);
+        }
+        if (pthread_create(&loop->thread, NULL, EventLoopRun, loop) != 0) {
+            perror("Failed to create an event loop thread");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-        for (fd = 0; fd < nfds; fd++) {
-            if (fd != msock && FD_ISSET(fd, &rfds)) {
-                Server(fd);
-                FD_CLR(fd, &afds);
-            }
+    for (i = 0; i < numLoops; i++) {
+        pthread_join(loops[i].thread, NULL);
+    }
+    close(stopPipe[0]);
+    close(stopPipe[1]);
+    free(loops);
+}
+
+
+/**
+ **************************************************************************
+ *
+ * \brief Raise the limit of open files as far as allowed, so that the
+ *        number of sessions is not held at its default.
+ *
+ **************************************************************************
+ */
+static void
+RaiseFileLimit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+            perror("Failed to raise the open file limit");
         }
     }
 }
@@ -187,15 +395,21 @@ main(int argc,      // IN
     ServerArgs svrArgs;
 
     signal(SIGINT, SignalHandler);
+    signal(SIGPIPE, SIG_IGN);
 
     ParseArgs(argc, argv, &svrArgs);
 
+    LogInit(LOG_OVERFLOW_BLOCK);
+
+    RaiseFileLimit();
+    BoardInit(svrArgs.maxBoardSize, (size_t)svrArgs.maxMemMB << 20);
     msock = CreatePassiveTCP6(svrArgs.listenPort);
 
-    Log("\nServer started listening at *:%u\n", svrArgs.listenPort);
+    Log("\nServer started listening at *:%u, %d event loops\n",
+        svrArgs.listenPort, svrArgs.numLoops);
     Log("Press Ctrl-C to stop the server.\n\n");
 
-    ServerListenerLoop();
+    ServerListenerLoop(svrArgs.numLoops);
 
     close(msock);
     Log("Server stopped listening at *:%u\n", svrArgs.listenPort);
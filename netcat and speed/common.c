@@ -19,7 +19,7 @@ Log(const char *fmt, ...)
     va_list arg;
 
     va_start(arg, fmt);
-    vfprintf(stderr, fmt, arg);
+    LogWriteV(stderr, fmt, arg);
     va_end(arg);
 }
 
@@ -37,7 +37,7 @@ Error(const char *fmt, ...)
     va_list arg;
 
     va_start(arg, fmt);
-    vfprintf(stderr, fmt, arg);
+    LogWriteV(stderr, fmt, arg);
     va_end(arg);
 }
 
@@ -6,6 +6,8 @@
 #include <arpa/inet.h>
 #include <sys/time.h>
 
+#include "log.h"
+
 #define ARRAYSIZE(_x)    (sizeof(_x) / sizeof((_x)[0]))
 
 #define FALSE  0
@@ -186,6 +186,8 @@ main(int argc,      // IN
 
     ParseArgs(argc, argv, &svrArgs);
 
+    LogInit(LOG_OVERFLOW_BLOCK);
+
     listenSocket = CreatePassiveTCP(svrArgs.listenPort);
 
     Log("\nServer started listening at *:%u\n", svrArgs.listenPort);
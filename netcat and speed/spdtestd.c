@@ -92,7 +92,7 @@ ServerLoop(ServerArgs *svrArgs)
             break;
         }
 
-        Log("Received message %u\n", msg->hdr.seq);
+        LogDebug("Received message %u\n", msg->hdr.seq);
         usleep(svrArgs->sleepUS);
 
         ack = &msg->hdr;
@@ -165,6 +165,8 @@ main(int argc,      // IN
 
     ParseArgs(argc, argv, &svrArgs);
 
+    LogInit(LOG_OVERFLOW_BLOCK);
+
     svrSock = CreatePassiveUDP(svrArgs.port);
 
     Log("\nServer started at *:%u\n", svrArgs.port);